@@ -35,6 +35,7 @@
 #include <QTextEdit>
 
 #include "Utils.hpp"
+#include "FrameBuffer.hpp"
 
 #define CONNECTION_FAILED "Connection failed" // Connection error
 #define SOCKET_CREATION_FAILED "Socket creation failed" // Socket creation error
@@ -121,7 +122,9 @@ class Client : public QWidget {
 
     /**
      * @brief Process incoming data from the server.
+     * The data is buffered until it holds complete messages, which are then handled in order.
      * @param buffer The buffer containing the incoming data.
+     * @throws FrameBuffer::FrameBufferException if the server sent an invalid message.
      */
     void processIncomingData(std::string &buffer);
 
@@ -139,6 +142,18 @@ class Client : public QWidget {
      */
     void _displayConnectedUsers(const std::string& message, const std::string &header);
 
+    /**
+     * @brief Apply a PRESENCE message to the list of connected users, and display it.
+     * Asks the server for a snapshot if changes were missed, or the message is invalid.
+     * @param message The payload of the message: "<base>,<version>,<change>,...".
+     */
+    void _applyPresence(const std::string &message);
+
+    /**
+     * @brief Ask the server for the list of connected users, and its changes afterwards.
+     */
+    void _requestPresence();
+
 
     /**
      * @brief Display the chat content in the GUI.
@@ -174,6 +189,10 @@ class Client : public QWidget {
     int _currentPrivateUserIndex; // Index of the current private user
     std::string _header; // Header for the message
     int _messageSize; // Size of the message
+    int _protocolVersion; // Wire format version used with the server (see BinaryProtocol)
+    FrameBuffer _readBuffer; // Bytes received from the server and not processed yet
+    std::vector<std::string> _users; // Connected users, kept up to date by the PRESENCE messages
+    uint64_t _presenceVersion; // Presence version of _users
 
     std::vector<std::string> _availableCommands; // Vector of available commands
 
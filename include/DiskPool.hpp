@@ -0,0 +1,64 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Worker threads running the file operations of the server, off the reactor threads.
+ *
+ * Tasks wait in one bounded FIFO queue, and the workers take them in order. A full queue
+ * refuses new tasks instead of blocking the thread submitting them: the shards keep the
+ * refused tasks, and submit them again once the pool calls its room callback, which it
+ * does each time a worker takes a task from a full queue.
+ *
+ * Tasks submitted in order start in order, but several workers may run them at the same
+ * time: a caller needing two tasks to finish in order waits for the first one before
+ * submitting the second, as a session does.
+ *
+ * The workers start with the first task submitted.
+ */
+class DiskPool {
+  public:
+    /**
+     * Creates the pool, without starting its workers.
+     * @param workers The number of worker threads, at least one.
+     * @param capacity The number of tasks the queue holds, at least one.
+     * @param onRoom Called by a worker after it made room in a full queue.
+     */
+    DiskPool(size_t workers, size_t capacity, std::function<void()> onRoom);
+
+    /**
+     * Runs the tasks still queued, then stops the workers.
+     */
+    ~DiskPool();
+
+    DiskPool(const DiskPool &) = delete;
+    DiskPool &operator=(const DiskPool &) = delete;
+
+    /**
+     * Queues a task, unless the queue is full.
+     * @param work The task, moved into the queue if it is accepted. It runs on a worker
+     * thread, so it must own its data.
+     * @return false if the queue is full, the task is left to the caller.
+     */
+    bool submit(std::function<void()> &work);
+
+  private:
+    /**
+     * Runs the queued tasks until the pool is destroyed.
+     */
+    void _run();
+
+    std::mutex _mutex; // Protects the queue
+    std::condition_variable _ready; // Signaled when a task is queued, or the pool destroyed
+    std::deque<std::function<void()>> _tasks; // Tasks not started yet, in submission order
+    std::vector<std::thread> _workers; // Worker threads, empty until the first task
+    size_t _workerCount; // Number of workers to start
+    size_t _capacity; // Maximum number of queued tasks
+    std::function<void()> _onRoom; // Called after making room in a full queue
+    bool _stopping; // true once the pool is destroyed
+};
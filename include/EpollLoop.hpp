@@ -0,0 +1,128 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "EventLoop.hpp"
+
+#define EPOLL_MAX_EVENTS 1024 // Maximum number of events handled per wakeup
+
+/**
+ * @brief Edge-triggered epoll implementation of the EventLoop.
+ *
+ * Every socket is registered once with EPOLLET, and drained until EAGAIN when it is
+ * reported ready, so a wakeup costs O(ready sockets) whatever the number of idle ones.
+ * Events carry a generation counter next to the file descriptor, so events queued for
+ * a client removed earlier in the same wakeup are dropped even if its descriptor was
+ * already reused by a new connection.
+ *
+ * Sent buffers are queued per client and written by flush(), once per wakeup, with one
+ * sendmsg for up to SEND_BATCH_SIZE of them. What a socket does not accept stays queued
+ * until epoll reports it writable again.
+ *
+ * A client moved to a shared memory channel has the signal of the channel registered too,
+ * its events flagged with SHARED_EVENT: the ring is read when the client wrote to it, and
+ * written again when the client made room in its ring.
+ */
+class EpollLoop : public EventLoop {
+  public:
+    /**
+     * Creates the epoll instance.
+     * @param handler The receiver of the events.
+     * @throws EventLoopException if the epoll instance cannot be created.
+     */
+    EpollLoop(Handler &handler);
+
+    /**
+     * Closes the epoll instance.
+     */
+    ~EpollLoop() override;
+
+    void listen(int socket) override;
+    void add(int client) override;
+    void share(int client, const std::shared_ptr<SharedChannel> &channel) override;
+    void remove(int client) override;
+    void send(int client, const Buffer &data) override;
+    void flush() override;
+    size_t pending(int client) const override;
+    void pause() override;
+    std::string detach(int client) override;
+    void wake() override;
+    void poll(int timeout) override;
+
+  private:
+    /**
+     * @brief Outbound state of a client socket.
+     */
+    struct Connection {
+      bool registered = false; // true between add and remove
+      bool dirty = false; // true while the client is in _dirty
+      size_t sent = 0; // Bytes of the first queued buffer already written
+      size_t pending = 0; // Bytes queued and not written yet
+      std::deque<Buffer> outbound; // Buffers waiting to be written
+      std::shared_ptr<SharedChannel> shared; // Shared memory channel the bytes go through, nullptr for the socket
+    };
+
+    static constexpr uint64_t SHARED_EVENT = 0x80000000; // Flag of the events of a shared memory channel, above any descriptor
+
+    /**
+     * Accepts every pending connection of a listening socket, non-blocking and
+     * close-on-exec, until the backlog is empty or accept fails.
+     * @param listener The listening socket.
+     */
+    void _accept(int listener);
+
+    /**
+     * Reads a client until EAGAIN, end of stream or removal by the handler.
+     * @param client The file descriptor of the client.
+     */
+    void _read(int client);
+
+    /**
+     * Reads the shared memory channel of a client until it is empty or the client is removed.
+     * @param client The file descriptor of the client.
+     */
+    void _readShared(int client);
+
+    /**
+     * Writes the queued bytes of a client until the queue is empty or the socket is full.
+     * @param client The file descriptor of the client.
+     */
+    void _write(int client);
+
+    /**
+     * Copies the queued bytes of a client to its shared memory channel, until the queue is
+     * empty or the ring is full.
+     * @param client The file descriptor of the client.
+     */
+    void _writeShared(int client);
+
+    /**
+     * Stops watching the shared memory channel of a client, if it has one.
+     * @param client The file descriptor of the client.
+     */
+    void _unshare(int client);
+
+    /**
+     * Builds the epoll user data of a socket.
+     * @param fd The file descriptor.
+     * @return The generation of the descriptor in the high bits, the descriptor in the low bits.
+     */
+    uint64_t _tag(int fd) const;
+
+    Handler &_handler; // Receiver of the events
+    int _epoll; // epoll file descriptor
+    std::vector<int> _listeners; // Listening sockets
+    int _wakeFd; // eventfd written by wake()
+    bool _paused; // true once pause() stopped the accepts and reads
+    std::vector<uint32_t> _generations; // Generation of every file descriptor, bumped on removal
+    std::vector<Connection> _connections; // Outbound state of every client, indexed by file descriptor
+    std::vector<int> _dirty; // Clients with bytes queued since the last flush
+    std::vector<struct epoll_event> _events; // Events returned by epoll_wait
+    std::vector<char> _buffer; // Buffer receiving the bytes read
+    std::vector<struct iovec> _iov; // Gather list of the buffers written by one sendmsg
+};
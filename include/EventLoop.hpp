@@ -0,0 +1,183 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstddef>
+#include <exception>
+
+#include "SharedChannel.hpp"
+
+#define READ_CHUNK_SIZE 65536 // Number of bytes read from a client socket at once
+#define SEND_BATCH_SIZE 64 // Maximum number of queued buffers written to a socket by one system call
+#define EVENT_LOOP_CREATION_FAILED "Failed to create event loop" // Error message for event loop creation failure
+#define EVENT_LOOP_WAIT_FAILED "Failed to wait for events" // Error message for event loop wait failure
+
+/**
+ * @brief Event loop used by the server to multiplex its sockets.
+ *
+ * The loop accepts connections on the listening sockets, reads the client sockets, and
+ * reports everything to a Handler. Sockets are registered once, when they are added,
+ * and each call to poll() only does work for the sockets that are ready.
+ * Outbound bytes are queued per client, so a slow reader never blocks the loop.
+ */
+class EventLoop {
+  public:
+    /**
+     * Immutable bytes to send. A broadcast encodes its message once, and queues the same
+     * buffer for every recipient.
+     */
+    using Buffer = std::shared_ptr<const std::string>;
+
+    /**
+     * @brief Exception class for event loop errors.
+     */
+    class EventLoopException : public std::exception {
+      public:
+        /**
+         * Constructor that takes an error message.
+         * @param message The error message to be associated with the exception.
+         */
+        EventLoopException(const std::string& message) : _message(message) {}
+
+        /**
+         * Returns the error message associated with the exception.
+         * @return A C-style string containing the error message.
+         */
+        const char* what() const noexcept override {
+            return _message.c_str();
+        }
+      private:
+        std::string _message; ///< The error message associated with the exception.
+    };
+
+    /**
+     * @brief Receiver of the events of the loop.
+     */
+    class Handler {
+      public:
+        virtual ~Handler() = default;
+
+        /**
+         * Called for every accepted connection. The socket is not registered yet.
+         * @param client The file descriptor of the new client, already non-blocking.
+         */
+        virtual void onAccept(int client) = 0;
+
+        /**
+         * Called when accepting a connection failed. The loop then waits for the next
+         * readiness of the listening socket, so a handler running out of file descriptors
+         * should drain the socket itself.
+         * @param error The errno value of the failure.
+         */
+        virtual void onAcceptError(int error) = 0;
+
+        /**
+         * Called with bytes read from a client.
+         * @param client The file descriptor of the client.
+         * @param data The bytes read.
+         * @param size The number of bytes.
+         * @return false if the handler removed the client, which stops reading it.
+         */
+        virtual bool onData(int client, const char *data, size_t size) = 0;
+
+        /**
+         * Called when a client closed its connection or the connection failed.
+         * The handler is expected to remove the client.
+         * @param client The file descriptor of the client.
+         */
+        virtual void onClose(int client) = 0;
+
+        /**
+         * Called after the loop wrote the bytes queued for a client, as far as its socket
+         * accepted them. pending() tells how many are left.
+         * @param client The file descriptor of the client.
+         */
+        virtual void onFlushed(int client) = 0;
+
+        /**
+         * Called on the thread of the loop after wake() was called.
+         */
+        virtual void onWake() = 0;
+    };
+
+    virtual ~EventLoop() = default;
+
+    /**
+     * Registers a listening socket, whose connections are reported to onAccept. Several
+     * sockets can be registered, a TCP one and a Unix one for instance.
+     * @param socket The listening socket.
+     */
+    virtual void listen(int socket) = 0;
+
+    /**
+     * Registers a client socket, whose bytes are reported to onData.
+     * @param client The file descriptor of the client.
+     */
+    virtual void add(int client) = 0;
+
+    /**
+     * Unregisters a client socket. Pending events of the socket are dropped.
+     * The caller still owns the file descriptor and closes it.
+     * @param client The file descriptor of the client.
+     */
+    virtual void remove(int client) = 0;
+
+    /**
+     * Moves the traffic of a client to a shared memory channel: the bytes queued from now
+     * on are written to the channel, and the bytes the client writes to it are reported to
+     * onData like those read from a socket. The socket stays registered, and its end still
+     * reports the close. Nothing may be queued for the client when it is called.
+     * @param client The file descriptor of the client.
+     * @param channel The server side of the channel.
+     */
+    virtual void share(int client, const std::shared_ptr<SharedChannel> &channel) = 0;
+
+    /**
+     * Stops accepting connections and reading the clients, before handing them off to
+     * another process. The bytes already read are given to the handler before it returns.
+     */
+    virtual void pause() = 0;
+
+    /**
+     * Unregisters a client socket without closing it, and takes the bytes queued for it
+     * and not sent yet. A send in flight is completed or cancelled first, so the peer
+     * received exactly the bytes before the ones returned.
+     * @param client The file descriptor of the client.
+     * @return The bytes not sent.
+     */
+    virtual std::string detach(int client) = 0;
+
+    /**
+     * Queues bytes to send to a client. Never blocks: the bytes are written by flush(),
+     * and what the socket cannot take yet is written when it becomes writable. The buffer
+     * is queued by reference, several queued buffers are written by one system call.
+     * @param client The file descriptor of the client.
+     * @param data The bytes to send.
+     */
+    virtual void send(int client, const Buffer &data) = 0;
+
+    /**
+     * Writes the bytes queued since the last flush, as far as the sockets accept them.
+     */
+    virtual void flush() = 0;
+
+    /**
+     * Gets the number of bytes queued for a client and not written to its socket yet.
+     * @param client The file descriptor of the client.
+     * @return The number of bytes.
+     */
+    virtual size_t pending(int client) const = 0;
+
+    /**
+     * Wakes the loop up, from any thread. onWake is then called by the thread running
+     * the loop. Several calls before the loop wakes up may result in a single onWake.
+     */
+    virtual void wake() = 0;
+
+    /**
+     * Waits for events and reports them to the handler.
+     * @param timeout The maximum time to wait in milliseconds, -1 to wait forever.
+     * @throws EventLoopException if waiting failed.
+     */
+    virtual void poll(int timeout) = 0;
+};
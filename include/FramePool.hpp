@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+
+#define FRAME_POOL_GRANULE 64 // Coroutine frame sizes are rounded up to a multiple of it
+#define FRAME_POOL_CLASSES 32 // Number of size classes, larger frames come from the heap
+#define FRAME_POOL_KEEP 4096 // Free frames kept per size class and thread, the others go back to the heap
+
+/**
+ * @brief Allocator of the coroutine frames, one set of free lists per thread.
+ *
+ * Every message a session executes is a coroutine, whose frame is allocated when the
+ * handler is called and freed when it returns. The frames of a size class are recycled
+ * through a free list instead of going to the heap each time, so once a shard reached its
+ * usual load, executing a message allocates no memory.
+ *
+ * The lists belong to the thread, without any lock: a frame freed by another thread than
+ * the one that allocated it (a session adopted before the shards start) joins the lists of
+ * the thread freeing it.
+ */
+class FramePool {
+  public:
+    /**
+     * Allocates a frame.
+     * @param size The size of the frame in bytes.
+     * @return The memory of the frame.
+     * @throws std::bad_alloc if the heap is exhausted.
+     */
+    static void *allocate(size_t size);
+
+    /**
+     * Frees a frame.
+     * @param frame The memory of the frame.
+     * @param size The size of the frame in bytes, as given to allocate().
+     */
+    static void deallocate(void *frame, size_t size) noexcept;
+
+  private:
+    /**
+     * @brief Free frame, linked through its first bytes.
+     */
+    struct Block {
+      Block *next; // Next free frame of the class
+    };
+
+    /**
+     * @brief Free frames of a size class.
+     */
+    struct FreeList {
+      Block *head = nullptr; // First free frame
+      size_t count = 0; // Number of free frames
+    };
+
+    /**
+     * @brief Free lists of a thread, returned to the heap when it ends.
+     */
+    struct Lists {
+      std::array<FreeList, FRAME_POOL_CLASSES> classes; // Free frames, by size class
+
+      ~Lists();
+    };
+
+    static thread_local Lists _lists; // Free frames of the calling thread
+};
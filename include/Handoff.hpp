@@ -0,0 +1,131 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <exception>
+
+#include "ShardGroup.hpp"
+
+#define HANDOFF_MAX_FDS 250 // File descriptors sent per message, under the kernel limit of 253
+#define HANDOFF_FAILED "Failed to hand off the sessions" // Error message for a handoff failure
+
+/**
+ * @brief Transfer of the listening sockets and the sessions to a new server process.
+ *
+ * A server started with a handoff socket path listens on it. A new process started with
+ * the same path connects to it, and the running process then stops reading, sends its
+ * listening sockets, client sockets and shared memory channels over the Unix socket
+ * (SCM_RIGHTS) with the state of every session, and exits. The new process resumes the sessions where they stopped:
+ * the TCP connections stay open, the bytes queued for a client and not sent yet are sent
+ * by the new process, and the bytes of a message partially received are kept. Connections
+ * arriving meanwhile wait in the backlog of the listening sockets, which are the same.
+ */
+class Handoff {
+  public:
+    /**
+     * @brief Exception class for handoff errors.
+     */
+    class HandoffException : public std::exception {
+      public:
+        /**
+         * Constructor that takes an error message.
+         * @param message The error message to be associated with the exception.
+         */
+        HandoffException(const std::string& message) : _message(message) {}
+
+        /**
+         * Returns the error message associated with the exception.
+         * @return A C-style string containing the error message.
+         */
+        const char* what() const noexcept override {
+            return _message.c_str();
+        }
+      private:
+        std::string _message; ///< The error message associated with the exception.
+    };
+
+    /**
+     * @brief State of a session handed off.
+     */
+    struct Session {
+      int fd = -1; // Socket of the client
+      uint32_t address = 0; // IPv4 address the client was admitted with, 0 if not tracked
+      uint8_t protocol = 0; // Protocol version negotiated by the client
+      bool subscribed = false; // true if the client receives the presence changes
+      std::string name; // Name of the client, empty if not logged in
+      std::vector<std::string> channels; // Channels joined by the client
+      std::string readBuffer; // Bytes of a message partially received
+      std::string unsent; // Bytes queued for the client and not sent yet
+      int sharedMemory = -1; // memfd of the shared memory channel of the client, -1 if it uses its socket
+      int serverSignal = -1; // eventfd of the channel waking the server up, -1 if none
+      int clientSignal = -1; // eventfd of the channel waking the client up, -1 if none
+    };
+
+    /**
+     * @brief Everything a process hands off.
+     */
+    struct State {
+      uint64_t presenceVersion = 0; // Presence version known by the clients
+      std::vector<int> listeners; // Listening sockets, one per shard
+      int localListener = -1; // Unix listening socket of the local clients, -1 if none
+      std::vector<Session> sessions; // Sessions of every shard
+    };
+
+    /**
+     * Waits for a new process on a Unix socket, then hands the shards of this process off
+     * to it. Returns once everything is sent, the shards having stopped.
+     * @param path The path of the Unix socket.
+     * @param group The shards of this process.
+     */
+    static void serve(const std::string &path, ShardGroup &group);
+
+    /**
+     * Connects to the process serving a handoff on a Unix socket.
+     * @param path The path of the Unix socket.
+     * @return The connected socket, -1 if no process serves the path.
+     */
+    static int connect(const std::string &path);
+
+    /**
+     * Sends a state and its file descriptors.
+     * @param socket The connected Unix socket.
+     * @param state The state.
+     * @throws HandoffException if the state cannot be sent.
+     */
+    static void send(int socket, const State &state);
+
+    /**
+     * Receives a state and its file descriptors.
+     * @param socket The connected Unix socket.
+     * @return The state, with the file descriptors of this process.
+     * @throws HandoffException if the state cannot be received.
+     */
+    static State receive(int socket);
+
+  private:
+    /**
+     * Listens on a Unix socket, replacing the file left by a previous process.
+     * @param path The path of the Unix socket.
+     * @return The listening socket, -1 on failure.
+     */
+    static int _listen(const std::string &path);
+
+    /**
+     * Writes all the bytes of a buffer.
+     * @param socket The socket.
+     * @param data The bytes.
+     * @param size The number of bytes.
+     * @throws HandoffException on failure.
+     */
+    static void _write(int socket, const char *data, size_t size);
+
+    /**
+     * Reads exactly a number of bytes.
+     * @param socket The socket.
+     * @param data The buffer receiving the bytes.
+     * @param size The number of bytes.
+     * @throws HandoffException on failure or end of stream.
+     */
+    static void _read(int socket, char *data, size_t size);
+};
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MessageLog.hpp"
+
+/**
+ * @brief Index of the message log by conversation, reading the messages from the mapped segments.
+ *
+ * A conversation is a channel ("#name"), the messages sent to everyone ("*"), or the
+ * private messages between two clients. For each one the store keeps the sequence number
+ * and the position (segment, offset) of its records, in order, so the last N messages, or
+ * the N messages before a sequence number, are found with one binary search and read in
+ * O(N), whatever the size of the conversation.
+ *
+ * The store also keeps, for each client, the private messages it received while offline
+ * and that were not delivered yet: the Offline records addressed to it, until a Delivered
+ * record acknowledges them. These queues are pointers into the log like the conversations,
+ * rebuilt from the log at startup, so they are as durable as the messages themselves.
+ *
+ * The compaction of the log (see LogCompactor) moves or drops the records of a sealed
+ * segment: compact() replaces the file and fixes the index under the same lock, so a
+ * reader sees either the old segment or the new one, never a mix.
+ *
+ * The records are read in place from the segments, each mapped up to its size on its
+ * first read, and mapped again when a record beyond the end of the mapping is read, the
+ * segment being written growing meanwhile. Nothing past the end of a file is mapped, a
+ * page past it not being readable. The store is fed by the observer of the log: the
+ * records recovered at startup, then each record once the writer thread wrote it, so a
+ * message is not visible until it reached the segment.
+ */
+class HistoryStore {
+  public:
+    /**
+     * @brief What became of a record of a compacted segment.
+     */
+    struct Relocation {
+      static constexpr uint64_t DROPPED = UINT64_MAX; // Offset of a record removed from the log
+
+      uint64_t sequence; // Number of the record
+      MessageLog::Kind kind; // Audience of the record before the compaction
+      std::string sender; // Name of the sender
+      std::string target; // Name of the recipient or of the channel
+      uint64_t offset; // Offset of the record in the new segment, DROPPED if removed
+      bool offline; // true if the record is still an Offline one in the new segment
+    };
+
+    /**
+     * Creates an empty store.
+     * @param log The log whose segments are read.
+     */
+    HistoryStore(const MessageLog &log);
+
+    /**
+     * Unmaps the segments.
+     */
+    ~HistoryStore();
+
+    HistoryStore(const HistoryStore &) = delete;
+    HistoryStore &operator=(const HistoryStore &) = delete;
+
+    /**
+     * Gets the conversation of a message.
+     * @param kind The audience of the message.
+     * @param sender The name of the sender.
+     * @param target The recipient or the channel, empty for a broadcast.
+     * @return The identifier of the conversation.
+     */
+    static std::string conversation(MessageLog::Kind kind, std::string_view sender, std::string_view target);
+
+    /**
+     * Indexes a record written to the log, as the observer of the log.
+     * @param record The record.
+     * @param segment The index of its segment.
+     * @param offset The offset of the record in the segment.
+     */
+    void add(const MessageLog::RecordView &record, uint64_t segment, uint64_t offset);
+
+    /**
+     * Reads the messages of a conversation, from the newest to the oldest.
+     * @param conversation The identifier of the conversation.
+     * @param before Only the messages with a lower sequence number are read, 0 for the latest.
+     * @param count The maximum number of messages read.
+     * @param visit Called for every message, its strings valid during the call only. It
+     * returns false to stop before taking the message.
+     * @return true if older messages remain before the last one taken.
+     */
+    bool read(const std::string &conversation, uint64_t before, size_t count, const std::function<bool(const MessageLog::RecordView &)> &visit);
+
+    /**
+     * Finds the newest message of a conversation beyond the newest bytes of text it keeps,
+     * with one binary search.
+     * @param conversation The identifier of the conversation.
+     * @param bytes The bytes of text kept, the newest messages first.
+     * @return The sequence number of the message, those up to it being beyond the bytes
+     * kept, 0 if none is.
+     */
+    uint64_t floor(const std::string &conversation, uint64_t bytes);
+
+    /**
+     * Reads the offline messages of a client not delivered yet, from the oldest to the newest.
+     * @param name The name of the client.
+     * @param after Only the messages with a higher sequence number are read, 0 for all.
+     * @param count The maximum number of messages read.
+     * @param visit Called for every message, its strings valid during the call only. It
+     * returns false to stop before taking the message.
+     * @return The number of messages remaining after the last one taken.
+     */
+    size_t readOffline(const std::string &name, uint64_t after, size_t count, const std::function<bool(const MessageLog::RecordView &)> &visit);
+
+    /**
+     * Gets the number of offline messages of a client not delivered yet.
+     * @param name The name of the client.
+     * @return The number of messages.
+     */
+    size_t offlineCount(const std::string &name);
+
+    /**
+     * Checks if an offline message is still waiting to be delivered.
+     * @param name The name of its recipient.
+     * @param sequence The sequence number of the message.
+     * @return true if it is in the queue of the recipient.
+     */
+    bool queued(const std::string &name, uint64_t sequence);
+
+    /**
+     * Checks if a Delivered record is still needed: the log still holds an Offline record
+     * it acknowledged, which would be delivered again at startup without it.
+     * @param name The name of the recipient.
+     * @param sequence The sequence number acknowledged by the record.
+     * @return true if such a record remains.
+     */
+    bool acknowledges(const std::string &name, uint64_t sequence);
+
+    /**
+     * Replaces a sealed segment by its compacted copy, or removes it, and moves its records
+     * in the index, readers waiting meanwhile.
+     * @param segment The index of the segment.
+     * @param relocations Every record of the segment, by sequence number.
+     * @param replace Renames the copy over the segment, or removes it, the lock being held.
+     * It returns false if it failed, the index is left as it was then.
+     * @return false if replace() failed.
+     */
+    bool compact(uint64_t segment, const std::vector<Relocation> &relocations, const std::function<bool()> &replace);
+
+  private:
+    /**
+     * @brief Position of a record.
+     */
+    struct Entry {
+      uint64_t sequence; // Number of the record
+      uint64_t segment; // Index of its segment
+      uint64_t offset; // Offset of the record in the segment
+      uint64_t before; // Bytes of text indexed in its conversation before the record
+    };
+
+    /**
+     * @brief A segment mapped in memory.
+     */
+    struct Mapping {
+      const char *data; // Start of the mapping
+      size_t size; // Size of the mapping, the file size when it was mapped
+    };
+
+    /**
+     * Gets the mapping of a segment, mapping it again if it is too small, the lock being held.
+     * @param segment The index of the segment.
+     * @param size The bytes the mapping has to cover.
+     * @return The mapping, null data if the segment cannot be mapped or is smaller.
+     */
+    Mapping _map(uint64_t segment, size_t size);
+
+    /**
+     * Unmaps the mappings replaced by larger ones, the lock being held exclusively, so no
+     * reader still reads them.
+     */
+    void _unmapRetired();
+
+    /**
+     * Reads an indexed record in place, the lock being held.
+     * @param entry The position of the record.
+     * @param record The record to fill.
+     * @return false if its segment cannot be mapped.
+     */
+    bool _read(const Entry &entry, MessageLog::RecordView &record);
+
+    /**
+     * Removes the offline messages acknowledged by a Delivered record from their queue.
+     * @param record The Delivered record.
+     */
+    void _delivered(const MessageLog::RecordView &record);
+
+    const MessageLog &_log; // Log of the segments
+    std::shared_mutex _mutex; // Protects the index, written by the writer thread and read by the shards
+    std::unordered_map<std::string, std::vector<Entry>> _conversations; // Records of every conversation, by sequence number
+    std::unordered_map<std::string, uint64_t> _textBytes; // Bytes of text indexed in every conversation, the dropped records included
+    std::unordered_map<std::string, std::deque<Entry>> _offline; // Offline messages not delivered yet, by recipient and sequence number
+    std::unordered_map<std::string, std::set<uint64_t>> _acknowledged; // Offline messages delivered, still Offline records in the log, by recipient
+    std::mutex _mappingMutex; // Protects the mappings
+    std::map<uint64_t, Mapping> _mappings; // Segments mapped, by index
+    std::vector<Mapping> _retired; // Mappings replaced by larger ones, unmapped once no reader holds them
+};
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "HistoryStore.hpp"
+#include "MessageLog.hpp"
+#include "TokenBucket.hpp"
+
+#define LOG_COMPACTOR_CHUNK (256 << 10) // Bytes read or written at once, what the bandwidth limit lets through in a burst
+#define LOG_COMPACTOR_SUFFIX ".compact" // Extension of the copy of a segment being rewritten
+
+/**
+ * @brief Background retention of the message log: drops the expired messages from the sealed segments.
+ *
+ * A message expires when it is older than the age limit of its conversation, when it is
+ * beyond the newest bytes of text its conversation keeps, or when the log is larger than
+ * its size limit, the oldest segments going first. The offline messages not delivered yet
+ * never expire, nor the acknowledgements the log still needs.
+ *
+ * Every interval, a thread scans the sealed segments, oldest first, skipping the ones
+ * where no message expired since their last scan. A segment whose messages all expired
+ * is removed; one where at least half of the bytes expired is copied without them, and
+ * the copy renamed over it. Either way the history is updated under its lock along with
+ * the file (HistoryStore::compact()). Reading and writing the segments goes through a
+ * token bucket, so the compaction uses a bounded share of the disk and does not delay the
+ * writer of the log.
+ */
+class LogCompactor {
+  public:
+    /**
+     * @brief Retention of a conversation.
+     */
+    struct Retention {
+      uint64_t age = 0; // Seconds a message is kept, 0 for ever
+      uint64_t bytes = 0; // Bytes of text kept, the newest messages first, 0 for no limit
+    };
+
+    /**
+     * Creates a stopped compactor.
+     * @param log The log whose segments are compacted.
+     * @param history The history of the log, updated along with the segments.
+     * @param age The seconds a message is kept, unless a rule of its conversation says otherwise, 0 for ever.
+     * @param logBytes The size of the log beyond which the oldest segments are dropped, 0 for no limit.
+     * @param rules The retention of the conversations, see parseRules().
+     * @param interval The seconds between two scans of the segments.
+     * @param bandwidth The bytes read and written per second, 0 for no limit.
+     */
+    LogCompactor(MessageLog &log, HistoryStore &history, uint64_t age, uint64_t logBytes, std::map<std::string, Retention> rules, size_t interval, size_t bandwidth);
+
+    /**
+     * Stops the thread.
+     */
+    ~LogCompactor();
+
+    LogCompactor(const LogCompactor &) = delete;
+    LogCompactor &operator=(const LogCompactor &) = delete;
+
+    /**
+     * Parses the retention of the conversations, "<conversation>=<age>/<bytes>,...". The
+     * conversation is a channel ("#name"), "*" for the messages sent to everyone, "#" for
+     * every channel without a rule, or "@" for every private conversation.
+     * @param rules The rules.
+     * @return The retention of every conversation listed, the invalid entries skipped.
+     */
+    static std::map<std::string, Retention> parseRules(const std::string &rules);
+
+    /**
+     * Checks if any limit is set, a compactor without any having nothing to do.
+     * @return true if a message can expire.
+     */
+    bool enabled() const;
+
+    /**
+     * Removes the copies left by an interrupted compaction, and starts the thread.
+     */
+    void start();
+
+    /**
+     * Stops the thread, abandoning the segment being compacted.
+     */
+    void stop();
+
+  private:
+    /**
+     * @brief What becomes of a record of the segment compacted.
+     */
+    struct Decision {
+      uint64_t offset; // Offset of the record in the segment
+      size_t size; // Size of the record
+      HistoryStore::Relocation relocation; // Its relocation, to be filled with its new offset
+    };
+
+    /**
+     * @brief A record kept for the recovery of the offline queues, expired otherwise.
+     */
+    struct Pin {
+      std::string name; // Name of the recipient
+      uint64_t sequence; // Sequence number of the offline message, or acknowledged by the Delivered record
+      bool acknowledgement; // true for a Delivered record
+    };
+
+    /**
+     * @brief When a segment scanned can have something more to drop.
+     */
+    struct Hint {
+      uint64_t expiry = UINT64_MAX; // Time its next message expires, in milliseconds since the epoch
+      std::vector<Pin> pins; // Records kept only until their offline message is delivered, or their acknowledgement unneeded
+    };
+
+    /**
+     * Scans the segments until the compactor is stopped.
+     */
+    void _run();
+
+    /**
+     * Scans every sealed segment once, oldest first.
+     */
+    void _pass();
+
+    /**
+     * Drops the expired records of a sealed segment, by removing it or rewriting it.
+     * @param segment The index of the segment.
+     * @param evicted true if the segment is beyond the size limit of the log, all of its
+     * records expiring but the offline messages waiting and their acknowledgements.
+     * @param now The time of the scan, in milliseconds since the epoch.
+     * @return false if the compactor was stopped.
+     */
+    bool _compactSegment(uint64_t segment, bool evicted, uint64_t now);
+
+    /**
+     * Decides what becomes of a record: kept as it is, kept as a Private record, or dropped.
+     * @param record The record.
+     * @param evicted true if its segment is beyond the size limit of the log.
+     * @param now The time of the scan, in milliseconds since the epoch.
+     * @param decision The decision, its relocation offset left to the caller.
+     * @param hint The hint of the segment, updated with the record if it is kept.
+     * @return false if the record is dropped.
+     */
+    bool _decide(const MessageLog::RecordView &record, bool evicted, uint64_t now, Decision &decision, Hint &hint);
+
+    /**
+     * Checks if a record pinned in a segment can go now.
+     * @param hint The hint of the segment.
+     * @return true if an offline message was delivered, or an acknowledgement is no longer needed.
+     */
+    bool _released(const Hint &hint);
+
+    /**
+     * Gets the retention of a conversation: its rule, the rule of its kind, or the defaults.
+     * @param conversation The identifier of the conversation.
+     * @return The retention.
+     */
+    const Retention &_retention(const std::string &conversation) const;
+
+    /**
+     * Gets the newest sequence number beyond the bytes a conversation keeps, computed once
+     * per scan.
+     * @param conversation The identifier of the conversation.
+     * @param bytes The bytes of text it keeps.
+     * @return The sequence number, the messages up to it expiring, 0 if none does.
+     */
+    uint64_t _floor(const std::string &conversation, uint64_t bytes);
+
+    /**
+     * Writes bytes to the copy of a segment, at the pace of the bandwidth limit.
+     * @param fd The copy.
+     * @param data The bytes.
+     * @return false if the write failed or the compactor was stopped.
+     */
+    bool _write(int fd, const std::string &data);
+
+    /**
+     * Waits until the bandwidth limit lets some bytes through.
+     * @param bytes The number of bytes, at most LOG_COMPACTOR_CHUNK.
+     * @return false if the compactor was stopped meanwhile.
+     */
+    bool _throttle(size_t bytes);
+
+    MessageLog &_log; // Log compacted
+    HistoryStore &_history; // History of the log
+    Retention _default; // Retention of the conversations without a rule
+    uint64_t _logBytes; // Size of the log beyond which the oldest segments are dropped, 0 for no limit
+    std::map<std::string, Retention> _rules; // Retention of the conversations with a rule
+    size_t _interval; // Seconds between two scans
+    RateLimit _bandwidth; // Bytes read and written per second, and burst
+    TokenBucket _bucket; // Bytes the compaction can read or write now
+    bool _byteRules; // true if a rule limits the bytes of a conversation, every segment being scanned then
+    std::unordered_map<std::string, uint64_t> _floors; // Sequence number up to which the messages are beyond the bytes of their conversation, for this scan
+    std::map<uint64_t, Hint> _hints; // When the segments scanned can have something more to drop, by index
+
+    std::mutex _mutex; // Protects _stopping
+    std::condition_variable _stopped; // Signaled when the compactor is stopped
+    bool _stopping; // true once stop() is called
+    std::thread _thread; // Thread running the scans
+};
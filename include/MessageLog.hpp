@@ -0,0 +1,294 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#define MESSAGE_LOG_FAILED "Failed to open the message log" // Error message for a log that cannot be opened
+#define MESSAGE_LOG_HEADER_SIZE 8 // Bytes before the fields of a record: its length and checksum
+#define MESSAGE_LOG_MAX_RECORD (64 << 20) // Largest record accepted when reading a segment, in bytes
+
+/**
+ * @brief Append-only log of the messages sent by the clients, split into segment files.
+ *
+ * Every record is length-prefixed and checksummed (CRC-32C):
+ *
+ *     length (4) | crc32c (4) | sequence (8) | time (8) | kind (1) | sender size (2) | target size (2) | sender | target | text
+ *
+ * in big-endian, the length and checksum covering everything after them. A segment is
+ * named after its index (00000000000000000042.log) and holds records until the next one
+ * would make it larger than the segment size, so the log only keeps one file open.
+ *
+ * Appending only copies the record into a buffer. A writer thread takes the whole buffer at
+ * once and writes it with one system call per segment (group commit), then syncs it
+ * according to the policy: never, at most once per interval, or after every batch. Records
+ * are assigned their sequence number and position when appended, in order.
+ *
+ * A record that cannot be written is dropped, the segment being cut back to the records before
+ * it, and the next records start a new segment.
+ *
+ * Opening the log scans every segment: a record cut by a crash, or failing its checksum,
+ * ends the log there, and the segment is truncated before it.
+ */
+class MessageLog {
+  public:
+    /**
+     * @brief Exception class for log errors.
+     */
+    class MessageLogException : public std::exception {
+      public:
+        /**
+         * Constructor that takes an error message.
+         * @param message The error message to be associated with the exception.
+         */
+        MessageLogException(const std::string& message) : _message(message) {}
+
+        /**
+         * Returns the error message associated with the exception.
+         * @return A C-style string containing the error message.
+         */
+        const char* what() const noexcept override {
+            return _message.c_str();
+        }
+      private:
+        std::string _message; ///< The error message associated with the exception.
+    };
+
+    /**
+     * @brief Audience of a message.
+     */
+    enum class Kind : uint8_t {
+      Private = 1, // To one client, named by the target
+      Broadcast = 2, // To everyone, the target is empty
+      Channel = 3, // To the members of the channel named by the target
+      Offline = 4, // To one client, named by the target, who was offline: delivered at its next login
+      Delivered = 5 // No message: the offline messages of the target up to the sequence number in the text were delivered
+    };
+
+    /**
+     * @brief When the segments are synced to the disk.
+     */
+    enum class Sync {
+      None, // Left to the kernel
+      Interval, // At most once per sync interval
+      Batch // After every batch written
+    };
+
+    /**
+     * @brief A message of the log.
+     */
+    struct Record {
+      uint64_t sequence = 0; // Number of the record, from 1, assigned by append()
+      uint64_t time = 0; // Time of the append, in milliseconds since the epoch
+      Kind kind = Kind::Broadcast; // Audience of the message
+      std::string sender; // Name of the sender
+      std::string target; // Name of the recipient or of the channel, empty for a broadcast
+      std::string text; // Text of the message
+    };
+
+    /**
+     * @brief A record read in place, its strings pointing into the bytes it was parsed from.
+     */
+    struct RecordView {
+      uint64_t sequence = 0; // Number of the record
+      uint64_t time = 0; // Time of the append, in milliseconds since the epoch
+      Kind kind = Kind::Broadcast; // Audience of the message
+      std::string_view sender; // Name of the sender
+      std::string_view target; // Name of the recipient or of the channel, empty for a broadcast
+      std::string_view text; // Text of the message
+    };
+
+    /**
+     * Called for every record of the log, with its segment and its offset in the segment:
+     * by open() for the records recovered, then by the writer thread once they are written.
+     */
+    using Observer = std::function<void(const RecordView &record, uint64_t segment, uint64_t offset)>;
+
+    /**
+     * Creates a closed log.
+     * @param directory The directory of the segments, created if needed.
+     * @param segmentSize The size beyond which a new segment is started, in bytes.
+     * @param sync The sync policy.
+     * @param syncInterval The minimum time between two syncs of the Interval policy, in milliseconds.
+     * @param bufferSize The bytes appended and not written yet beyond which append() refuses records.
+     * @param onRoom Called by the writer thread after it emptied a full buffer.
+     */
+    MessageLog(const std::string &directory, size_t segmentSize, Sync sync, size_t syncInterval, size_t bufferSize, std::function<void()> onRoom);
+
+    /**
+     * Writes the records appended and closes the log.
+     */
+    ~MessageLog();
+
+    MessageLog(const MessageLog &) = delete;
+    MessageLog &operator=(const MessageLog &) = delete;
+
+    /**
+     * Sets the observer of the records, before the log is opened.
+     * @param observer The observer.
+     */
+    void observe(Observer observer);
+
+    /**
+     * Recovers the segments, truncating the torn records, and starts the writer thread.
+     * @throws MessageLogException if the directory or a segment cannot be read.
+     */
+    void open();
+
+    /**
+     * Writes and syncs the records appended, then stops the writer thread. Nothing can be
+     * appended afterwards.
+     */
+    void close();
+
+    /**
+     * Appends a record, unless the buffer is full or the record too large to be read back.
+     * @param record The record, its sequence number and time are set.
+     * @return false if the buffer is full, the log closed, or the record larger than
+     * MESSAGE_LOG_MAX_RECORD, the record is not appended.
+     */
+    bool append(Record &record);
+
+    /**
+     * Gets the sequence number the next record will get.
+     * @return The sequence number.
+     */
+    uint64_t nextSequence();
+
+    /**
+     * Waits until the records before a sequence number are written, and observed.
+     * @param sequence The sequence number.
+     * @return false if the log was closed first, or one of these records could not be written.
+     */
+    bool waitWritten(uint64_t sequence);
+
+    /**
+     * Parses the record at the start of some bytes, without copying its strings.
+     * @param data The bytes, which must outlive the record.
+     * @param record The record to fill.
+     * @param verify false to skip the checksum, for bytes already verified.
+     * @return The size of the record, 0 if the bytes end before it, -1 if it is corrupted.
+     */
+    static long parse(std::string_view data, RecordView &record, bool verify = true);
+
+    /**
+     * Computes the size of a record once encoded, its header included.
+     * @param record The record.
+     * @return The size, in bytes.
+     */
+    static size_t size(const Record &record);
+
+    /**
+     * Encodes a record.
+     * @param record The record.
+     * @param out The string the record is appended to.
+     */
+    static void encode(const Record &record, std::string &out);
+
+    /**
+     * Computes the CRC-32C of some bytes.
+     * @param data The bytes.
+     * @param size The number of bytes.
+     * @return The checksum.
+     */
+    static uint32_t checksum(const char *data, size_t size);
+
+    /**
+     * Gets the path of a segment.
+     * @param index The index of the segment.
+     * @return The path.
+     */
+    std::string segmentPath(uint64_t index) const;
+
+    /**
+     * Lists the segments of the directory.
+     * @param error Set if the directory cannot be read.
+     * @return The indexes of the segments, sorted.
+     */
+    std::vector<uint64_t> segments(std::error_code &error) const;
+
+    /**
+     * Gets the index of the segment being written. The segments before it are complete,
+     * and never written again.
+     * @return The index of the segment.
+     */
+    uint64_t sealed();
+
+  private:
+    /**
+     * @brief Encoded records of one segment, written together.
+     */
+    struct Chunk {
+      uint64_t segment; // Index of the segment
+      uint64_t offset; // Offset of the first record in the segment
+      uint64_t sequence; // Sequence number of the first record
+      std::string bytes; // Encoded records
+    };
+
+    /**
+     * Scans a segment, and truncates it after its last valid record.
+     * @param index The index of the segment.
+     * @return false if the segment had to be truncated, the later segments being invalid then.
+     */
+    bool _recover(uint64_t index);
+
+    /**
+     * Writes the batches appended until the log is closed.
+     */
+    void _run();
+
+    /**
+     * Writes a chunk at the end of its segment, switching to it if needed.
+     * @param chunk The chunk.
+     * @return false if the chunk could not be written, its records are dropped.
+     */
+    bool _write(const Chunk &chunk);
+
+    /**
+     * Drops the records of a chunk that could not be written, and of the chunks of its segment
+     * appended after it, the next records starting a new segment.
+     * @param chunk The chunk.
+     * @return false.
+     */
+    bool _drop(const Chunk &chunk);
+
+    /**
+     * Syncs the segment being written.
+     */
+    void _syncSegment();
+
+    std::string _directory; // Directory of the segments, ending with a slash
+    size_t _segmentSize; // Size beyond which a new segment is started
+    Sync _sync; // Sync policy
+    size_t _syncInterval; // Minimum time between two syncs of the Interval policy, in milliseconds
+    size_t _bufferSize; // Bytes appended and not written yet beyond which append() refuses records
+    std::function<void()> _onRoom; // Called after emptying a full buffer
+    Observer _observer; // Called for every record recovered or written, may be empty
+
+    std::mutex _mutex; // Protects the fields below, up to the writer's
+    std::condition_variable _appended; // Signaled when a record is appended, or the log closed
+    std::condition_variable _wrote; // Signaled when a batch is written, or the writer thread stopped
+    std::vector<Chunk> _pending; // Records appended and not written yet
+    size_t _pendingBytes; // Size of _pending
+    uint64_t _sequence; // Sequence number of the next record
+    uint64_t _written; // Sequence number of the next record not written yet
+    uint64_t _lost; // Sequence number of the first record that could not be written, 0 if none
+    uint64_t _segment; // Index of the segment receiving the next record
+    uint64_t _segmentBytes; // Size of that segment, once the pending records are written
+    uint64_t _sealed; // Index of the segment the writer thread writes, or recovered last
+    bool _open; // true between open() and close()
+    bool _stopping; // true once close() is called
+
+    std::thread _writer; // Writer thread
+    int _fd; // Segment being written, -1 if none, used by the writer thread only
+    uint64_t _fdSegment; // Index of the segment of _fd
+    bool _broken; // true if a chunk of that segment could not be written, used by the writer thread only
+    bool _unsynced; // true if bytes were written since the last sync, used by the writer thread only
+};
@@ -3,6 +3,11 @@
 #include <iostream>
 #include <vector>
 #include <map>
+#include <deque>
+#include <array>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <string>
 #include <sys/socket.h>
@@ -10,12 +15,24 @@
 #include <unistd.h>
 #include <cstring>
 #include <arpa/inet.h>
-#include <sys/select.h>
 #include <stdbool.h>
 #include <algorithm>
 #include <filesystem>
 #include <fstream>
 #include <thread>
+#include <chrono>
+#include <functional>
+
+#include "BinaryProtocol.hpp"
+#include "FrameBuffer.hpp"
+#include "ServerConfig.hpp"
+#include "EventLoop.hpp"
+#include "ShardGroup.hpp"
+#include "SessionTable.hpp"
+#include "TimerWheel.hpp"
+#include "Handoff.hpp"
+#include "Task.hpp"
+#include "MessageLog.hpp"
 
 #define MAX_CLIENTS 10 // Maximum number of clients
 #define MAX_BUFFER_SIZE 1024 // Maximum buffer size for messages
@@ -23,22 +40,41 @@
 #define SOCKET_BIND_FAILED "Failed to bind socket" // Error message for socket binding failure
 #define SOCKET_LISTEN_FAILED "Failed to listen on socket" // Error message for socket listening failure
 #define SOCKET_ACCEPT_FAILED "Failed to accept connection" // Error message for socket acceptance failure
-#define SELECT_FAILED "Failed to select" // Error message for select failure
 #define SERVER_NOT_RUNNING "Server is not running" // Error message for server not running
 #define INVALID_CLIENT_FD "Invalid client file descriptor" // Error message for invalid client file descriptor
 #define SOCKET_FD_IN_CLIENTS "Socket file descriptor in client" // Error message for socket file descriptor in client
 #define SOCKET_OPT_FAILED "Failed to set socket options" // Error message for setting socket options failure
+#define LOCAL_SOCKET_FAILED "Failed to listen on the local socket" // Error message for local socket failure
 
 #define DB_PATH "../db/" // Path to the database
-#define MESSAGES_FOLDER(name) DB_PATH + name + "/messages/" // Path to the messages folder
+#define LOG_FOLDER "log" // Folder of the message log in the database
+#define HISTORY_DEFAULT_COUNT 50 // Messages answered to a HISTORY message not giving their number
+#define HISTORY_MAX_COUNT 500 // Maximum number of messages answered to a HISTORY message
+#define READ_AHEAD_FRAMES 4 // Frames of the largest size a client can send ahead of the message being executed, beyond which it is disconnected
+#define PUBLIC_TARGET "0" // Target of the messages the client sends to everyone, refused as a user name
 
 /**
   * @brief Server class that handles client connections and communication.
   *
   * This class is responsible for managing client connections, sending and receiving messages,
   * and executing commands. It uses sockets for network communication and supports multiple clients.
+  * The sockets are multiplexed by an EventLoop, which reports its events to the server.
+  *
+  * A Server instance is one shard of the server: it runs on one thread and owns the
+  * sessions accepted on its listening socket. The shards of a process share a ShardGroup,
+  * through which they reach the sessions owned by the other shards.
+  *
+  * Every session runs as a coroutine on the thread of its shard: it reads a message with
+  * readFrame(), awaits its handler, then reads the next one. A handler suspends on write()
+  * while the client is too far behind, on sleep(), on offload() while the disk pool
+  * does its file operations, or on persist() while the message log is full, and the loop
+  * serves the other sessions meanwhile. The messages of a client are executed one at a
+  * time in order, the next ones waiting in its read buffer.
+  *
+  * The payload of a frame points into the read buffer, or into a buffer shared by the
+  * session: a handler copies what it needs before it first suspends.
   */
-class Server {
+class Server : public EventLoop::Handler {
   public:
       /**
        * @brief Exception class for server-related errors.
@@ -63,6 +99,57 @@ class Server {
           std::string _message; ///< The error message associated with the exception.
       };
 
+      /**
+       * @brief What the coroutine of a session is suspended on.
+       */
+      enum class Wait {
+        None, // Running, or not suspended by the server
+        Frame, // A message of the client, see readFrame()
+        Drain, // Room in the queue of the client, see write()
+        Sleep, // Its sleep() timer
+        Offload, // The end of a task on the disk pool, see offload()
+        Log, // Room in the buffer of the message log, see persist()
+        Ready // Nothing anymore, its resumption is posted
+      };
+
+      /**
+       * @brief Awaitable returned by readFrame().
+       * The coroutine resumes once a whole message is buffered, and gets false if the client
+       * sent an invalid one.
+       */
+      class FrameAwaiter {
+        public:
+          FrameAwaiter(Server &server, int client, Frame &frame) : _server(server), _client(client), _frame(frame), _valid(true) {}
+
+          bool await_ready();
+          void await_suspend(std::coroutine_handle<> coroutine);
+          bool await_resume() const noexcept { return _valid; }
+
+        private:
+          Server &_server; // Server owning the session
+          int _client; // File descriptor of the client
+          Frame &_frame; // Frame receiving the message
+          bool _valid; // false once the client sent an invalid message
+      };
+
+      /**
+       * @brief Awaitable suspending the coroutine of a session until the server resumes it,
+       * returned by write(), sleep(), offload() and persist().
+       */
+      class Wakeup {
+        public:
+          Wakeup(Server &server, int client, Wait wait) : _server(server), _client(client), _wait(wait) {}
+
+          bool await_ready() const noexcept { return _wait == Wait::None; }
+          void await_suspend(std::coroutine_handle<> coroutine);
+          void await_resume() const noexcept {}
+
+        private:
+          Server &_server; // Server owning the session
+          int _client; // File descriptor of the client
+          Wait _wait; // Event resuming the coroutine, None to go on without suspending
+      };
+
       /**
        * Constructor that initializes the server with a default port.
        */
@@ -75,22 +162,35 @@ class Server {
       Server(unsigned short port);
 
       /**
-       * Destructor that cleans up resources and closes the server socket.
+       * Constructor that initializes the server with a specified port and configuration.
+       * @param port The port number on which the server will listen for incoming connections.
+       * @param config The settings of the server.
        */
-      ~Server();
+      Server(unsigned short port, const ServerConfig &config);
 
       /**
-       * Initializes the server by creating a socket, binding it to the specified port,
-       * and setting it to listen for incoming connections.
-       * @throws ServerException if any error occurs during initialization.
+       * Constructor that initializes one shard of a multi-threaded server.
+       * @param port The port number on which the server will listen for incoming connections.
+       * @param config The settings of the server.
+       * @param group The state shared by the shards.
+       * @param shard The index of this shard in the group.
+       */
+      Server(unsigned short port, const ServerConfig &config, std::shared_ptr<ShardGroup> group, size_t shard);
+
+      /**
+       * Destructor that cleans up resources and closes the server socket.
        */
-      void init();
+      ~Server();
 
       /**
-       * Initializes the commands that the server can execute.
+       * Initializes the server by creating a socket, binding it to the specified port,
+       * and setting it to listen for incoming connections. The first shard also listens
+       * on the Unix socket of the local clients, if one is configured.
+       * @param listener A listening socket handed off by a previous process, -1 to create one.
+       * @param localListener A Unix listening socket handed off by a previous process, -1 to create one.
        * @throws ServerException if any error occurs during initialization.
        */
-      void initCommands();
+      void init(int listener = -1, int localListener = -1);
 
       /**
        * Initializes the database by creating the necessary directories and files.
@@ -99,14 +199,15 @@ class Server {
       void initDatabase();
 
       /**
-       * Loads the database by reading client information from files.
-       * @throws ServerException if any error occurs during database loading.
+       * Loads the database by opening the registry of the accounts, built from the
+       * legacy folders of the clients on the first run.
+       * @throws UserRegistry::UserRegistryException if the registry cannot be opened.
        */
       void loadDatabase();
 
       /**
-       * Saves the database by writing client information to files.
-       * @throws ServerException if any error occurs during database saving.
+       * Saves the database by recording the login of a client in the registry, creating
+       * its account if needed. Called on the disk pool.
        * @param client The client file descriptor.
        * @param name The name of the client.
        */
@@ -118,6 +219,30 @@ class Server {
        */
       void run();
 
+      /**
+       * Wakes the event loop of this shard up, from any thread, to execute the tasks
+       * posted to it by the other shards.
+       */
+      void wake();
+
+      /**
+       * Stops accepting connections and reading the clients, before a handoff.
+       */
+      void pause();
+
+      /**
+       * Detaches the listening socket and the sessions of this shard for a new process,
+       * which then owns them, and makes run() return. Called after every shard paused.
+       * @param state Receives the listening socket and the sessions.
+       */
+      void handOff(Handoff::State &state);
+
+      /**
+       * Resumes a session handed off by a previous process.
+       * @param session The state of the session.
+       */
+      void adopt(const Handoff::Session &session);
+
       /**
        * Stops the server and closes all client connections.
        * @throws ServerException if any error occurs during server shutdown.
@@ -125,23 +250,60 @@ class Server {
       void stop();
 
       /**
-       * Handles incoming messages from clients and processes them.
-       * @throws ServerException if any error occurs during message handling.
+       * Adds an accepted connection to the clients, or closes it if the server or its
+       * address already has as many connections as allowed.
+       * @param client The file descriptor of the accepted client.
+       */
+      void onAccept(int client) override;
+
+      /**
+       * Handles a failure to accept a connection. Running out of file descriptors refuses
+       * the pending connections, other transient failures are only logged.
+       * @param error The errno value of the failure.
+       * @throws ServerException if the listening socket itself is broken.
+       */
+      void onAcceptError(int error) override;
+
+      /**
+       * Buffers the bytes read from a client and executes every complete message.
+       * @param client The file descriptor of the client.
+       * @param data The bytes read.
+       * @param size The number of bytes.
+       * @return false if the client was removed, after an invalid message or by a handler.
        */
-      void readFromClients();
+      bool onData(int client, const char *data, size_t size) override;
 
       /**
-       * Sends messages to clients based on their file descriptors.
-       * @throws ServerException if any error occurs during message sending.
+       * Removes a client that closed its connection, and notifies the other clients.
+       * @param client The file descriptor of the client.
+       */
+      void onClose(int client) override;
+
+      /**
+       * Executes the tasks posted to this shard by the other shards.
+       */
+      void onWake() override;
+
+      /**
+       * Compares the bytes still queued for a client with the watermarks: above the high
+       * watermark the client becomes a slow consumer, below the low one it catches up.
+       * @param client The file descriptor of the client.
+       */
+      void onFlushed(int client) override;
+
+      /**
+       * Writes the messages queued for the clients since the last call, and disconnects
+       * the slow consumers when the policy asks for it. Called after every wakeup of the loop.
        */
       void writeToClients();
 
       /**
        * Accepts a new client connection and adds it to the list of clients.
        * @param client The file descriptor of the accepted client.
+       * @param address The IPv4 address the client was admitted with, 0 if not tracked.
        * @throws ServerException if any error occurs during client acceptance.
        */
-      void addClient(int client);
+      void addClient(int client, uint32_t address = 0);
 
       /**
        * Removes a client from the list of clients and closes the connection.
@@ -158,46 +320,192 @@ class Server {
 
 
       /**
-       * Sends a message to a specific client.
+       * Queues a message for a specific client. The message is dropped if the client
+       * is a slow consumer, see ServerConfig::slowConsumerPolicy.
        * @param client The file descriptor of the client to whom the message will be sent.
        * @param message The message to be sent to the client.
        */
       void sendToClient(int client, const std::string& message);
 
       /**
-       * Sends a message to all clients.
-       * @param message The message to be sent to all clients.
+       * Queues an encoded message shared with other clients, without copying it.
        * @param client The file descriptor of the client to whom the message will be sent.
+       * @param message The encoded message.
        */
-      void commandHelp(int client, const std::string& message);
+      void sendToClient(int client, const EventLoop::Buffer& message);
 
       /**
-       * Sends a message to all clients.
-       * @param message The message to be sent to all clients.
+       * Encodes a message with the protocol version negotiated by a client, and sends it.
        * @param client The file descriptor of the client to whom the message will be sent.
+       * @param message The message to be sent to the client.
+       * @param header The header of the message.
+       */
+      void sendToClient(int client, const std::string& message, const std::string& header);
+
+      /**
+       * Awaits the next message of a client, from its coroutine.
+       * @param client The file descriptor of the client.
+       * @param frame The frame receiving the message.
+       * @return The awaitable, giving false if the message is invalid.
+       */
+      FrameAwaiter readFrame(int client, Frame& frame);
+
+      /**
+       * Encodes a message for a client and queues it, from its coroutine, even while the
+       * client is a slow consumer. The coroutine then waits, if the queue of the client went
+       * over the high watermark, until it drains to the low one.
+       * @param client The file descriptor of the client.
+       * @param message The message to be sent to the client.
+       * @param header The header of the message.
+       * @return The awaitable.
+       */
+      Wakeup write(int client, const std::string& message, const std::string& header);
+
+      /**
+       * Suspends the coroutine of a client, at the resolution of the timers.
+       * @param client The file descriptor of the client.
+       * @param milliseconds The time to wait.
+       * @return The awaitable.
+       */
+      Wakeup sleep(int client, uint64_t milliseconds);
+
+      /**
+       * Runs a task on the disk pool, and suspends the coroutine of a client until it is
+       * done. While the queue of the pool is full, the task waits on this shard for room.
+       * The task runs even if the client leaves meanwhile, so it must own its data.
+       * Build it before the co_await expression: GCC 12 frees the captures of a lambda
+       * created in the operand of co_await with the wrong pointer.
+       * @param client The file descriptor of the client.
+       * @param work The task, which must not touch the server.
+       * @return The awaitable.
        */
-      void commandList(int client, const std::string& message);
+      Wakeup offload(int client, std::function<void()> work);
+
+      /**
+       * Submits the tasks refused by the full queue of the disk pool again, in order, once
+       * a worker made room.
+       */
+      void resumeOffloads();
+
+      /**
+       * Appends a message of a client to the message log. The coroutine only waits while
+       * the buffer of the log is full, the record then waits on this shard for room. The
+       * message is delivered before it is written: the log is what is kept of it.
+       * @param client The file descriptor of the sender.
+       * @param kind The audience of the message.
+       * @param target The recipient or the channel, empty for a broadcast.
+       * @param text The text of the message.
+       * @return The awaitable.
+       */
+      Wakeup persist(int client, MessageLog::Kind kind, const std::string& target, const std::string& text);
+
+      /**
+       * Appends the records refused by the full message log again, in order, and resumes
+       * their sessions, once the writer made room.
+       */
+      void resumeLog();
 
       /**
        * Sends a message to all clients.
-       * @param message The message to be sent to a specific clien to login
        * @param client The file descriptor of the client to whom the message will be sent.
+       * @param frame The parsed message received from the client.
+       */
+      void commandHelp(int client, const Frame& frame);
+
+      /**
+       * Sends the list of the connected users, or of the members of a channel.
+       * @param client The file descriptor of the client to whom the message will be sent.
+       * @param frame The parsed message, its payload is empty or the name of a channel.
        */
-      void clientLogin(int client, const std::string& message);
+      Task<> commandList(int client, const Frame& frame);
+
+      /**
+       * Makes a client receive the presence changes instead of the whole list of names,
+       * and sends it a snapshot of the list.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed PRESENCE message, its payload is ignored.
+       */
+      Task<> commandPresence(int client, const Frame& frame);
+
+      /**
+       * Answers a heartbeat of a client.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed PING message, its payload is sent back.
+       */
+      Task<> commandPing(int client, const Frame& frame);
+
+      /**
+       * Receives the answer to a heartbeat. Any message proves the client is alive, so
+       * there is nothing left to do.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed PONG message.
+       */
+      Task<> commandPong(int client, const Frame& frame);
+
+      /**
+       * Moves a client connected to the Unix socket to a shared memory channel. The answer
+       * carries the size of the rings, and the memfd, server signal and client signal of the
+       * channel (SCM_RIGHTS); an empty answer without descriptors refuses the channel.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed SHARED_MEMORY message, its payload is ignored.
+       */
+      Task<> commandSharedMemory(int client, const Frame& frame);
+
+      /**
+       * Sends the past messages of a conversation: the channel, "*" for the messages sent to
+       * everyone, or the name of the client the private messages were exchanged with. The
+       * answer is "<cursor>" then a line "<sequence> <time> <sender> <size> <text>" per
+       * message, oldest first, the cursor being the "before" of the previous page, or 0 once
+       * there is none. The messages are read on the disk pool.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed HISTORY message, "<conversation> [<count> [<before>]]".
+       */
+      Task<> commandHistory(int client, const Frame& frame);
+
+      /**
+       * Sends the next private messages the client received while offline, as at login.
+       * An empty queue is answered with "0" alone.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed OFFLINE message, its payload is ignored.
+       */
+      Task<> commandOffline(int client, const Frame& frame);
+
+      /**
+       * Subscribes a client to a channel, and notifies the members.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed JOIN_CHANNEL message, its payload is the name of the channel.
+       */
+      Task<> commandJoin(int client, const Frame& frame);
+
+      /**
+       * Unsubscribes a client from a channel, and notifies the members.
+       * @param client The file descriptor of the client.
+       * @param frame The parsed LEAVE_CHANNEL message, its payload is the name of the channel.
+       */
+      Task<> commandLeave(int client, const Frame& frame);
 
       /**
        * Sends a message to all clients.
-       * @param message The message to be sent to all clients.
        * @param client The file descriptor of the client to whom the message will be sent.
+       * @param frame The parsed LOGIN message, its payload is the requested name.
        */
-      void commandsMessage(int client, const std::string& message);
+      Task<> clientLogin(int client, const Frame& frame);
 
       /**
-       * Sends a private message to a specific client. (Not implemented yet)
-       * @param req The message to be sent to all clients.
+       * Sends a message to all clients, or to the members of a channel.
        * @param client The file descriptor of the client to whom the message will be sent.
+       * @param frame The parsed message, its payload is "/msg <target> <message>", where a
+       * target starting with '#' is a channel, any other target meaning everyone.
+       */
+      Task<> commandsMessage(int client, const Frame& frame);
+
+      /**
+       * Sends a private message to a logged in client, or stores it for a client with an
+       * account until its next login, and appends it to the message log.
+       * @param client The file descriptor of the client sending the message.
+       * @param frame The parsed PRIVATE_MESSAGE, its payload is "<target> <message>".
        */
-      void sendPrivateMessage(int client, const std::string &req);
+      Task<> sendPrivateMessage(int client, const Frame &frame);
 
       /**
        * Get the file descriptor of a client by its name.
@@ -206,47 +514,243 @@ class Server {
       int getClientFileDescriptor(const std::string& name);
 
   private:
+      using Command = Task<> (Server::*)(int, const Frame&); // Coroutine executing a message
+
+      /**
+       * @brief Coroutine of a session.
+       */
+      struct Coroutine {
+        Task<> task; // Coroutine executing the messages of the client, empty once ended
+        std::coroutine_handle<> suspended; // Innermost coroutine of the chain, resumed by the server
+        Wait wait = Wait::None; // What the coroutine is suspended on
+        Frame *frame = nullptr; // Frame receiving the next message, while waiting for one
+      };
 
       /**
-       * Initializes the server socket and sets it to listen for incoming connections.
-       * @throws ServerException if any error occurs during socket initialization.
+       * @brief Offline messages read by the disk pool for one OFFLINE message.
        */
-      void _initFdSets();
+      struct OfflineBatch {
+        std::string lines; // One line per message, each preceded by a newline
+        size_t count = 0; // Number of messages
+        uint64_t last = 0; // Sequence number of the last message
+        size_t remaining = 0; // Messages still queued after the last one
+      };
 
       /**
-       * Parse the incoming message and execute the corresponding command.
+       * Builds the table of the commands, at compile time.
+       * @return The function executing every message type, null for the unknown ones.
+       */
+      static constexpr std::array<Command, 256> _makeCommands();
+
+      /**
+       * Refuses the connections waiting on the listening socket while the process is out of
+       * file descriptors: the reserved descriptor is released to accept and close them, so
+       * the clients see the refusal instead of hanging in the backlog.
+       */
+      void _shed();
+
+      /**
+       * Creates the Unix listening socket of the local clients, replacing the file left by
+       * a previous process.
+       * @return The listening socket.
+       * @throws ServerException if the socket cannot be created.
+       */
+      int _listenLocal();
+
+      /**
+       * Builds the rate limits of the message types from the configuration.
+       */
+      void _initRateLimits();
+
+      /**
+       * Takes the tokens of a message from the buckets of its client. Over a limit, the
+       * message is dropped and the client is told so, once until a message passes again.
+       * @param client The file descriptor of the client.
+       * @param frame The message, not unpacked yet.
+       * @return false if the message must be dropped.
+       */
+      bool _withinRate(int client, const Frame &frame);
+
+      /**
+       * Execute the command corresponding to a message.
+       * Messages are parsed once by the client's FrameBuffer, handlers receive the parsed frame.
        * @param client The file descriptor of the client sending the message.
-       * @param message The message sent by the client.
+       * @param frame The message sent by the client.
+       * @return The handler of the message, to be awaited, or an empty task if it is dropped.
        */
-      void _interpretMessage(int client, const std::string& message);
+      Task<> _interpretMessage(int client, Frame &frame);
 
       /**
-       * Check if the client is logged in.
-       * @param client The file descriptor of the client to be checked.
-       * @param message The message sent by the client.
-       * @return true if the client is logged in, false otherwise.
+       * Executes the messages of a client one by one, until it sends an invalid one or is removed.
+       * @param client The file descriptor of the client.
+       * @return The root coroutine of the session.
+       */
+      Task<> _session(int client);
+
+      /**
+       * Hands the next buffered message to the coroutine of a client waiting for one.
+       * @param client The file descriptor of the client.
+       * @throws FrameBuffer::FrameBufferException if the message is invalid.
+       */
+      void _deliver(int client);
+
+      /**
+       * Resumes the coroutine of a client where it is suspended, and destroys it if it ended
+       * or if its client was removed meanwhile.
+       * @param client The file descriptor of the client.
+       */
+      void _resume(int client);
+
+      /**
+       * Resumes the coroutine of a session if it still waits for an event.
+       * @param handle The handle of the session, which may be gone.
+       * @param wait The event.
+       */
+      void _wake(SessionTable::Handle handle, Wait wait);
+
+      /**
+       * Creates the event loop selected by the configuration, falling back to epoll
+       * if io_uring is not available.
+       * @return The event loop.
+       */
+      std::unique_ptr<EventLoop> _createLoop();
+
+      /**
+       * Gets the sync policy of the message log selected by the configuration, falling
+       * back to Interval for an unknown one.
+       * @return The sync policy.
+       */
+      MessageLog::Sync _logSync() const;
+
+      /**
+       * Sends the private messages a client received while offline, oldest first, in OFFLINE
+       * messages of up to offlineBatch messages, until offlineDrain messages are sent. The
+       * messages are read from the log on the disk pool, and acknowledged in the log once
+       * handed to the client.
+       * @param client The file descriptor of the client.
+       * @param always true to answer an empty queue with an OFFLINE message.
+       */
+      Task<> _drainOffline(int client, bool always);
+
+      /**
+       * Formats a message of the log for a HISTORY or OFFLINE answer.
+       * @param record The message.
+       * @return "<sequence> <time> <sender> <size> <text>".
+       */
+      static std::string _formatRecord(const MessageLog::RecordView &record);
+
+      /**
+       * Sends a message to the clients of this shard.
+       * @param message The message to be sent.
+       */
+      void _broadcastLocal(const std::string& message);
+
+      /**
+       * Makes every shard send the presence changes to its clients, at the end of the window.
+       */
+      void _presenceChanged();
+
+      /**
+       * Starts the presence window of this shard, if it is not started yet.
        */
-      bool _checkIfLoggedIn(int client, const std::string& message);
+      void _schedulePresence();
 
-      std::map<int, int> _clientsPrivateMessagesIndex; // Map to store who sent private messages to whom
-      std::map<std::string, void (Server::*)(int, const std::string&)> _commands; // Map to store commands and their corresponding functions
-      std::map<int, std::string> _clientsNames; // Map to store client names and their corresponding file descriptors
-      std::vector<std::string> _loggedInClients; // Vector to store logged-in clients
-      std::vector<int> _clients; // Vector to store client file descriptors
+      /**
+       * Checks the deadlines of a session when its timer expires: disconnects it if it did
+       * not log in or stayed silent too long, sends it a PING if it is quiet, and arms its
+       * timer for the next check.
+       * @param client The file descriptor of the client.
+       */
+      void _checkTimeouts(int client);
+
+      /**
+       * Reads the monotonic clock.
+       * @return The time in milliseconds.
+       */
+      static uint64_t _clock();
+
+      /**
+       * Sends the presence changes made since the last call to the clients of this shard:
+       * the changes to the subscribed clients, the whole list of names to the other ones.
+       */
+      void _flushPresence();
+
+      /**
+       * Gets the encoded message for the protocol of a client, encoding it on first use.
+       * @param client The file descriptor of the client.
+       * @param message The message.
+       * @param header The header of the message.
+       * @param bodies The message already encoded, by protocol version.
+       * @return The encoded message.
+       */
+      const EventLoop::Buffer &_encodeFor(int client, const std::string& message, const std::string& header, std::map<int, EventLoop::Buffer>& bodies);
+
+      /**
+       * Sends a message to the members of a channel, on every shard owning some of them.
+       * @param channel The name of the channel.
+       * @param message The message to be sent.
+       */
+      void _sendToChannel(const std::string& channel, const std::string& message);
+
+      /**
+       * Sends a message to the members of a channel owned by this shard.
+       * @param channel The name of the channel.
+       * @param message The message to be sent.
+       */
+      void _sendToChannelLocal(const std::string& channel, const std::string& message);
+
+      /**
+       * Unsubscribes a client from a channel.
+       * @param client The file descriptor of the client.
+       * @param channel The name of the channel.
+       * @return false if the client was not a member.
+       */
+      bool _leaveChannel(int client, const std::string& channel);
+
+      /**
+       * Sends a message to a logged in client, whatever the shard owning it.
+       * @param name The name of the client.
+       * @param message The message to be sent.
+       * @param header The header of the message.
+       * @return false if no client has this name.
+       */
+      bool _sendToName(const std::string& name, const std::string& message, const std::string& header);
+
+
+      static const std::array<Command, 256> _commands; // Function executing every message type, indexed by Frame::type
+      static constexpr uint8_t BYTE_BUCKET = 0; // Index of the token bucket of the payload bytes
+      static constexpr uint8_t NO_BUCKET = UINT8_MAX; // Bucket index of the message types without limit
+      std::array<uint8_t, 256> _rateBuckets; // Token bucket index of every message type
+      std::vector<RateLimit> _rateLimits; // Limit of every token bucket
+      std::string _payload; // Scratch buffer for unpacked v1 payloads, reused across messages
+      SessionTable _sessions; // State of the clients of this shard
+      std::unordered_map<std::string, std::unordered_set<int>> _channels; // Clients of this shard subscribed to each channel
+      std::vector<int> _slowClients; // Slow consumers to disconnect after the current wakeup
+      uint64_t _presenceVersion; // Presence version last sent to the clients of this shard
+      bool _presenceScheduled; // true while the presence window is started
+      std::chrono::steady_clock::time_point _presenceDeadline; // End of the presence window
+      TimerWheel _timers; // Login, heartbeat and idle deadline of every client, one timer per client
+      std::vector<int> _expired; // Clients whose timer expired, reused across wakeups
+      TimerWheel _sleepers; // Deadline of the coroutines in sleep(), one per client
+      std::vector<Coroutine> _coroutines; // Coroutine of every client, indexed by file descriptor
+      int _resumed; // Client whose coroutine is running, -1 if none
+      std::deque<std::function<void()>> _offloads; // Tasks refused by the full disk queue, in submission order
+      std::deque<std::pair<SessionTable::Handle, MessageLog::Record>> _records; // Records refused by the full message log, with their sessions, in order
+      uint64_t _now; // Time of the last wakeup of the loop, in milliseconds
       int _socket; // Socket file descriptor
+      int _localSocket; // Unix listening socket of the local clients, -1 if none
+      bool _paused; // true once paused for a handoff
+      int _reserveFd; // Descriptor kept open to be released when accept runs out of descriptors, -1 if none
       int _maxClients; // Maximum number of clients
       int _serverSocket; // Server socket file descriptor
       int _opt; // Socket option value
       unsigned short _port; // Port number on which the server listens
-      size_t _maxFd; // Maximum file descriptor value
-
-      fd_set _writeFds; // File descriptor set for writing
-      fd_set _readFds; // File descriptor set for reading
-      fd_set _exceptFds; // File descriptor set for exceptions
+      std::unique_ptr<EventLoop> _loop; // Event loop multiplexing the sockets
 
       struct sockaddr_in _serverAddr; // Server address structure
-      struct sockaddr_in _clientAddr; // Client address structure
-      socklen_t _clientAddrLen; // Length of the client address structure
 
       bool _running; // Flag to indicate if the server is running
+      ServerConfig _config; // Settings of the server
+      std::shared_ptr<ShardGroup> _group; // State shared with the other shards
+      size_t _shard; // Index of this shard in the group
 };
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <map>
+#include <sstream>
+
+#include "FrameBuffer.hpp"
+#include "MessageLog.hpp"
+#include "TokenBucket.hpp"
+
+/**
+ * @brief Tunable settings of the server.
+ *
+ * Every setting has a default value, and can be overridden by an environment variable
+ * when the configuration is built with fromEnvironment().
+ */
+struct ServerConfig {
+  size_t maxFrameSize = DEFAULT_MAX_FRAME_SIZE; // Largest payload accepted from a client (CHAT_MAX_FRAME_SIZE)
+  std::string ioBackend = "epoll"; // Event loop implementation, "epoll" or "io_uring" (CHAT_IO_BACKEND)
+  size_t threads = 1; // Number of reactor threads, each with its own listening socket (CHAT_THREADS)
+  bool pinThreads = false; // Pin reactor thread i to CPU i (CHAT_PIN_THREADS)
+  size_t outboundHighWatermark = 4 << 20; // Bytes queued for a client above which it is a slow consumer (CHAT_OUTBOUND_HIGH_WATERMARK)
+  size_t outboundLowWatermark = 1 << 20; // Bytes queued below which a slow consumer receives messages again (CHAT_OUTBOUND_LOW_WATERMARK)
+  std::string slowConsumerPolicy = "drop"; // "drop" the messages of a slow consumer, or "disconnect" it (CHAT_SLOW_CONSUMER)
+  size_t presenceWindow = 50; // Milliseconds during which presence changes are coalesced in one message (CHAT_PRESENCE_WINDOW)
+  size_t listenBacklog = 4096; // Connections waiting to be accepted by each listening socket, capped by net.core.somaxconn (CHAT_LISTEN_BACKLOG)
+  size_t maxSessions = 0; // Connections accepted by the whole server, 0 for no limit (CHAT_MAX_SESSIONS)
+  size_t maxSessionsPerAddress = 0; // Connections accepted from one IP address, 0 for no limit (CHAT_MAX_SESSIONS_PER_IP)
+  size_t loginTimeout = 10; // Seconds a client has to log in after connecting, 0 for no limit (CHAT_LOGIN_TIMEOUT)
+  size_t heartbeatInterval = 30; // Seconds of silence after which a client is sent a PING, 0 to disable (CHAT_HEARTBEAT_INTERVAL)
+  size_t idleTimeout = 90; // Seconds of silence after which a client is disconnected, 0 for no limit (CHAT_IDLE_TIMEOUT)
+  std::map<uint8_t, RateLimit> rateLimits = { // Messages per second and burst of every limited message type (CHAT_RATE_LIMITS)
+    {0, {20, 40}}, // SIMPLE_MESSAGE
+    {2, {5, 10}}, // LIST_USERS
+    {3, {1, 5}}, // LOGIN
+    {4, {5, 10}}, // JOIN_CHANNEL
+    {5, {5, 10}}, // LEAVE_CHANNEL
+    {6, {2, 5}}, // PRESENCE
+    {7, {2, 5}}, // PING
+    {11, {2, 5}}, // HISTORY
+    {12, {2, 5}}, // OFFLINE
+    {13, {20, 40}}, // PRIVATE_MESSAGE
+  };
+  size_t byteRate = 256 << 10; // Payload bytes per second a client can send, 0 for no limit (CHAT_RATE_BYTES)
+  size_t byteBurst = 2 << 20; // Payload bytes a client can send at once, at least maxFrameSize (CHAT_RATE_BYTES_BURST)
+  std::string handoffSocket = ""; // Unix socket through which a new process takes the sessions over, empty to disable (CHAT_HANDOFF_SOCKET)
+  std::string localSocket = ""; // Unix socket accepting the clients running on the host, empty to disable (CHAT_LOCAL_SOCKET)
+  size_t sharedRingSize = 1 << 20; // Bytes of each ring of a shared memory channel, 0 to refuse the channels (CHAT_SHARED_RING_SIZE)
+  size_t diskThreads = 2; // Number of threads running the file operations (CHAT_DISK_THREADS)
+  size_t diskQueue = 1024; // File operations waiting for a disk thread, beyond which the sessions wait to submit theirs (CHAT_DISK_QUEUE)
+  size_t logSegmentSize = 64 << 20; // Bytes of a segment of the message log, beyond which the next one is started (CHAT_LOG_SEGMENT_SIZE)
+  std::string logSync = "interval"; // When the message log is synced to the disk: "none", "interval" or "batch" (CHAT_LOG_SYNC)
+  size_t logSyncInterval = 100; // Milliseconds between two syncs of the "interval" policy (CHAT_LOG_SYNC_INTERVAL)
+  size_t logBuffer = 16 << 20; // Bytes of messages waiting to be written to the log, beyond which the sessions wait (CHAT_LOG_BUFFER)
+  size_t retentionAge = 0; // Seconds a message is kept in the log, unless a rule says otherwise, 0 for ever (CHAT_RETENTION_AGE)
+  size_t retentionBytes = 0; // Bytes of the log beyond which the oldest segments are dropped, 0 for no limit (CHAT_RETENTION_BYTES)
+  std::string retentionRules = ""; // Retention of the conversations, "<conversation>=<age>/<bytes>,..." (CHAT_RETENTION_RULES)
+  size_t retentionInterval = 60; // Seconds between two scans of the log for expired messages (CHAT_RETENTION_INTERVAL)
+  size_t retentionBandwidth = 4 << 20; // Bytes the compaction of the log reads and writes per second, 0 for no limit (CHAT_RETENTION_BANDWIDTH)
+  size_t offlineBatch = 100; // Offline messages sent in one OFFLINE message (CHAT_OFFLINE_BATCH)
+  size_t offlineDrain = 1000; // Offline messages sent at login, or for an OFFLINE message, before the client asks for more (CHAT_OFFLINE_DRAIN)
+
+  /**
+   * @brief Builds a configuration from the environment variables, using the defaults for the missing ones.
+   * @return The configuration.
+   */
+  static ServerConfig fromEnvironment()
+  {
+    ServerConfig config;
+
+    // A message fits in a log record with the names of its sender and target
+    config.maxFrameSize = std::min<size_t>(_get("CHAT_MAX_FRAME_SIZE", config.maxFrameSize), MESSAGE_LOG_MAX_RECORD / 2);
+    config.ioBackend = _getString("CHAT_IO_BACKEND", config.ioBackend);
+    config.threads = std::max<size_t>(1, _get("CHAT_THREADS", config.threads));
+    config.pinThreads = _get("CHAT_PIN_THREADS", config.pinThreads) != 0;
+    config.outboundHighWatermark = _get("CHAT_OUTBOUND_HIGH_WATERMARK", config.outboundHighWatermark);
+    config.outboundLowWatermark = std::min(_get("CHAT_OUTBOUND_LOW_WATERMARK", config.outboundLowWatermark), config.outboundHighWatermark);
+    config.slowConsumerPolicy = _getString("CHAT_SLOW_CONSUMER", config.slowConsumerPolicy);
+    config.presenceWindow = _get("CHAT_PRESENCE_WINDOW", config.presenceWindow);
+    config.listenBacklog = std::max<size_t>(1, _get("CHAT_LISTEN_BACKLOG", config.listenBacklog));
+    config.maxSessions = _get("CHAT_MAX_SESSIONS", config.maxSessions);
+    config.maxSessionsPerAddress = _get("CHAT_MAX_SESSIONS_PER_IP", config.maxSessionsPerAddress);
+    config.loginTimeout = _get("CHAT_LOGIN_TIMEOUT", config.loginTimeout);
+    config.heartbeatInterval = _get("CHAT_HEARTBEAT_INTERVAL", config.heartbeatInterval);
+    config.idleTimeout = _get("CHAT_IDLE_TIMEOUT", config.idleTimeout);
+    config.rateLimits = _getRateLimits("CHAT_RATE_LIMITS", config.rateLimits);
+    config.byteRate = _get("CHAT_RATE_BYTES", config.byteRate);
+    config.byteBurst = std::max(_get("CHAT_RATE_BYTES_BURST", config.byteBurst), config.maxFrameSize);
+    config.handoffSocket = _getString("CHAT_HANDOFF_SOCKET", config.handoffSocket);
+    config.localSocket = _getString("CHAT_LOCAL_SOCKET", config.localSocket);
+    config.sharedRingSize = _get("CHAT_SHARED_RING_SIZE", config.sharedRingSize);
+    config.diskThreads = std::max<size_t>(1, _get("CHAT_DISK_THREADS", config.diskThreads));
+    config.diskQueue = std::max<size_t>(1, _get("CHAT_DISK_QUEUE", config.diskQueue));
+    config.logSegmentSize = std::max<size_t>(1, _get("CHAT_LOG_SEGMENT_SIZE", config.logSegmentSize));
+    config.logSync = _getString("CHAT_LOG_SYNC", config.logSync);
+    config.logSyncInterval = _get("CHAT_LOG_SYNC_INTERVAL", config.logSyncInterval);
+    config.logBuffer = std::max<size_t>(1, _get("CHAT_LOG_BUFFER", config.logBuffer));
+    config.retentionAge = _get("CHAT_RETENTION_AGE", config.retentionAge);
+    config.retentionBytes = _get("CHAT_RETENTION_BYTES", config.retentionBytes);
+    config.retentionRules = _getString("CHAT_RETENTION_RULES", config.retentionRules);
+    config.retentionInterval = std::max<size_t>(1, _get("CHAT_RETENTION_INTERVAL", config.retentionInterval));
+    config.retentionBandwidth = _get("CHAT_RETENTION_BANDWIDTH", config.retentionBandwidth);
+    config.offlineBatch = std::max<size_t>(1, _get("CHAT_OFFLINE_BATCH", config.offlineBatch));
+    config.offlineDrain = std::max<size_t>(1, _get("CHAT_OFFLINE_DRAIN", config.offlineDrain));
+    return config;
+  }
+
+  private:
+    /**
+     * @brief Reads a numeric environment variable.
+     * @param name The name of the variable.
+     * @param fallback The value returned if the variable is not set.
+     * @return The value of the variable, or fallback.
+     */
+    static size_t _get(const char *name, size_t fallback)
+    {
+      const char *value = std::getenv(name);
+
+      return (value != nullptr && *value != '\0') ? std::strtoull(value, nullptr, 10) : fallback;
+    }
+
+    /**
+     * @brief Reads a string environment variable.
+     * @param name The name of the variable.
+     * @param fallback The value returned if the variable is not set.
+     * @return The value of the variable, or fallback.
+     */
+    static std::string _getString(const char *name, const std::string &fallback)
+    {
+      const char *value = std::getenv(name);
+
+      return (value != nullptr && *value != '\0') ? std::string(value) : fallback;
+    }
+
+    /**
+     * @brief Reads rate limits from an environment variable, "<type>=<rate>/<burst>,...".
+     * An empty list, "none", removes every limit.
+     * @param name The name of the variable.
+     * @param fallback The value returned if the variable is not set.
+     * @return The limit of every message type listed.
+     */
+    static std::map<uint8_t, RateLimit> _getRateLimits(const char *name, const std::map<uint8_t, RateLimit> &fallback)
+    {
+      const char *value = std::getenv(name);
+      std::map<uint8_t, RateLimit> limits;
+      std::stringstream list(value != nullptr ? value : "");
+      std::string entry;
+
+      if (value == nullptr || *value == '\0')
+        return fallback;
+      while (std::getline(list, entry, ',')) {
+        unsigned type = 0;
+        RateLimit limit;
+        if (std::sscanf(entry.c_str(), "%u=%lf/%lf", &type, &limit.rate, &limit.burst) == 3 && type < 256)
+          limits[static_cast<uint8_t>(type)] = limit;
+      }
+      return limits;
+    }
+};
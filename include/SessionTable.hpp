@@ -0,0 +1,278 @@
+#pragma once
+
+#include <vector>
+#include <set>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
+
+#include "BinaryProtocol.hpp"
+#include "FrameBuffer.hpp"
+#include "TokenBucket.hpp"
+#include "SharedChannel.hpp"
+
+/**
+ * @brief State of the sessions owned by a shard.
+ *
+ * Sessions are stored in slots indexed by their file descriptor, which the kernel keeps
+ * dense, with one array per field so the hot ones (protocol, congestion, position) stay
+ * packed. The connected clients are also kept in a dense list, removed by swapping with
+ * the last one, and logged in names are indexed by a hash table: adding, finding by
+ * name and removing a session are all O(1).
+ *
+ * A slot is reused when its descriptor is, so every slot has a generation, bumped on
+ * removal. A Handle holds the descriptor and the generation, and stops being valid once
+ * its session is removed.
+ */
+class SessionTable {
+  public:
+    /**
+     * Reference to a session that can be kept after the session is removed.
+     */
+    using Handle = uint64_t;
+
+    /**
+     * Channels joined by a session, searchable by a std::string_view without a copy.
+     */
+    using Channels = std::set<std::string, std::less<>>;
+
+    /**
+     * Creates an empty table.
+     * @param maxFrameSize The maximum payload size accepted from a client.
+     * @param buckets The number of rate limiting token buckets of every session.
+     */
+    SessionTable(size_t maxFrameSize = DEFAULT_MAX_FRAME_SIZE, size_t buckets = 0);
+
+    /**
+     * Adds a connected client, not logged in yet.
+     * @param client The file descriptor of the client.
+     * @param address The IPv4 address of the client, 0 if not tracked.
+     */
+    void add(int client, uint32_t address = 0);
+
+    /**
+     * Removes a client, and its name from the index.
+     * @param client The file descriptor of the client.
+     */
+    void remove(int client);
+
+    /**
+     * Checks if a client is in the table.
+     * @param client The file descriptor of the client.
+     * @return true if the client was added and not removed.
+     */
+    bool contains(int client) const;
+
+    /**
+     * Gets the connected clients, in no particular order.
+     * @return The file descriptors of the clients.
+     */
+    const std::vector<int> &clients() const;
+
+    /**
+     * Gets the number of connected clients.
+     * @return The number of clients.
+     */
+    size_t size() const;
+
+    /**
+     * Gets the address a client was admitted with.
+     * @param client The file descriptor of the client.
+     * @return The IPv4 address, 0 if not tracked.
+     */
+    uint32_t address(int client) const;
+
+    /**
+     * Gets a handle on the current session of a client.
+     * @param client The file descriptor of the client.
+     * @return The handle.
+     */
+    Handle handle(int client) const;
+
+    /**
+     * Checks if the session of a handle is still in the table.
+     * @param handle The handle.
+     * @return false if the session was removed.
+     */
+    bool valid(Handle handle) const;
+
+    /**
+     * Gets the file descriptor of a handle.
+     * @param handle The handle.
+     * @return The file descriptor.
+     */
+    static int client(Handle handle);
+
+    /**
+     * Gives a name to a client, and indexes it.
+     * @param client The file descriptor of the client.
+     * @param name The name.
+     */
+    void setName(int client, const std::string &name);
+
+    /**
+     * Gets the name of a client.
+     * @param client The file descriptor of the client.
+     * @return The name, empty if the client is not logged in.
+     */
+    const std::string &name(int client) const;
+
+    /**
+     * Finds a logged in client by its name.
+     * @param name The name.
+     * @return The file descriptor of the client, -1 if none has this name.
+     */
+    int find(const std::string &name) const;
+
+    /**
+     * Gets the protocol version negotiated by a client.
+     * @param client The file descriptor of the client.
+     * @return The version, PROTOCOL_V1 until the client logged in.
+     */
+    int protocol(int client) const;
+
+    /**
+     * Sets the protocol version negotiated by a client.
+     * @param client The file descriptor of the client.
+     * @param version The version.
+     */
+    void setProtocol(int client, int version);
+
+    /**
+     * Gets the bytes received from a client and not executed yet.
+     * @param client The file descriptor of the client.
+     * @return The buffer.
+     */
+    FrameBuffer &readBuffer(int client);
+
+    /**
+     * Checks if a client is a slow consumer, whose messages are dropped.
+     * @param client The file descriptor of the client.
+     * @return true if the client is a slow consumer.
+     */
+    bool congested(int client) const;
+
+    /**
+     * Marks a client as a slow consumer or not, and resets its count of dropped messages.
+     * @param client The file descriptor of the client.
+     * @param congested true if the client is a slow consumer.
+     */
+    void setCongested(int client, bool congested);
+
+    /**
+     * Counts a message dropped for a slow consumer.
+     * @param client The file descriptor of the client.
+     */
+    void drop(int client);
+
+    /**
+     * Gets the number of messages dropped since the client became a slow consumer.
+     * @param client The file descriptor of the client.
+     * @return The number of messages.
+     */
+    size_t dropped(int client) const;
+
+    /**
+     * Checks if a client receives the presence changes, instead of the whole list of names.
+     * @param client The file descriptor of the client.
+     * @return true if the client asked for the presence changes.
+     */
+    bool subscribed(int client) const;
+
+    /**
+     * Makes a client receive the presence changes.
+     * @param client The file descriptor of the client.
+     */
+    void subscribe(int client);
+
+    /**
+     * Records that a client sent something.
+     * @param client The file descriptor of the client.
+     * @param now The current time in milliseconds.
+     */
+    void touch(int client, uint64_t now);
+
+    /**
+     * Gets the last time a client sent something, or connected.
+     * @param client The file descriptor of the client.
+     * @return The time in milliseconds.
+     */
+    uint64_t lastSeen(int client) const;
+
+    /**
+     * Gets a rate limiting token bucket of a client, full when the client is added.
+     * @param client The file descriptor of the client.
+     * @param index The index of the bucket.
+     * @return The bucket.
+     */
+    TokenBucket &bucket(int client, size_t index);
+
+    /**
+     * Checks if a client was told its messages are dropped for going over a rate limit.
+     * @param client The file descriptor of the client.
+     * @return true until a message of the client is accepted again.
+     */
+    bool throttled(int client) const;
+
+    /**
+     * Marks a client as told its messages are dropped, or not.
+     * @param client The file descriptor of the client.
+     * @param throttled true once the client is told.
+     */
+    void setThrottled(int client, bool throttled);
+
+    /**
+     * Gets the shared memory channel of a client.
+     * @param client The file descriptor of the client.
+     * @return The channel, nullptr if the client uses its socket.
+     */
+    const std::shared_ptr<SharedChannel> &sharedChannel(int client) const;
+
+    /**
+     * Moves a client to a shared memory channel.
+     * @param client The file descriptor of the client.
+     * @param channel The server side of the channel.
+     */
+    void setSharedChannel(int client, const std::shared_ptr<SharedChannel> &channel);
+
+    /**
+     * Gets the channels joined by a client.
+     * @param client The file descriptor of the client.
+     * @return The names of the channels.
+     */
+    Channels &channels(int client);
+
+  private:
+    static constexpr uint32_t NO_POSITION = UINT32_MAX; // Position of a free slot
+
+    /**
+     * Makes room for a file descriptor in every array.
+     * @param client The file descriptor.
+     */
+    void _grow(int client);
+
+    size_t _maxFrameSize; // Maximum payload size accepted from a client
+    size_t _bucketCount; // Number of token buckets of every session
+    std::vector<int> _clients; // Connected clients, dense
+
+    // Hot fields, one entry per slot
+    std::vector<uint32_t> _generations; // Generation of every slot, bumped on removal
+    std::vector<uint32_t> _positions; // Index of every client in _clients, NO_POSITION for a free slot
+    std::vector<uint8_t> _protocols; // Protocol version of every client
+    std::vector<uint8_t> _congested; // 1 for the slow consumers
+    std::vector<uint8_t> _subscribed; // 1 for the clients receiving the presence changes
+    std::vector<uint64_t> _lastSeen; // Last time every client sent something, in milliseconds
+    std::vector<uint8_t> _throttled; // 1 for the clients told their messages are dropped
+    std::vector<TokenBucket> _buckets; // Token buckets of every client, _bucketCount per slot
+
+    // Cold fields, one entry per slot
+    std::vector<std::string> _names; // Name of every client, empty until login
+    std::vector<FrameBuffer> _readBuffers; // Bytes received from every client and not executed yet
+    std::vector<size_t> _dropped; // Messages dropped for every slow consumer
+    std::vector<Channels> _channels; // Channels joined by every client
+    std::vector<uint32_t> _addresses; // IPv4 address of every client, 0 if not tracked
+    std::vector<std::shared_ptr<SharedChannel>> _sharedChannels; // Shared memory channel of every client, nullptr for a socket
+
+    std::unordered_map<std::string, int> _byName; // File descriptor of every logged in name
+};
@@ -0,0 +1,379 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <mutex>
+#include <string>
+#include <functional>
+#include <memory>
+
+#include "SessionTable.hpp"
+#include "DiskPool.hpp"
+#include "MessageLog.hpp"
+#include "HistoryStore.hpp"
+#include "LogCompactor.hpp"
+#include "UserRegistry.hpp"
+
+#define PRESENCE_LOG_SIZE 4096 // Number of presence changes kept for the shards and clients catching up
+
+class Server;
+
+/**
+ * @brief State shared by the shards of the server.
+ *
+ * The server runs one Server instance (a shard) per reactor thread. Every shard has its
+ * own listening socket bound with SO_REUSEPORT, its own event loop, and owns the
+ * sessions accepted on its socket: only its thread touches them. The group holds what
+ * the shards share, the directory of logged in names, and one mailbox per shard through
+ * which the other shards ask it to deliver messages to its sessions.
+ *
+ * The group also holds the index of the channels, from each channel to its members and
+ * to the number of members owned by each shard, so a channel message is only posted to
+ * the shards having members.
+ *
+ * Every login, logout and rename is also recorded as a presence change, numbered by a
+ * presence version that only grows, so the shards send the changes to their clients
+ * instead of the whole list of names.
+ *
+ * The group also holds the DiskPool of the process, on which the sessions offload their
+ * blocking file operations: a task runs on a worker thread, then posts its result back to
+ * the shard that submitted it.
+ *
+ * It holds the MessageLog as well, opened by the first shard, in which every shard
+ * appends the messages of its sessions, and the HistoryStore indexing it.
+ *
+ * Ordering: a mailbox is FIFO, and a shard delivers a broadcast to its own sessions
+ * before posting it to the other shards. So every recipient receives the messages of a
+ * given sender in the order they were sent, but two messages sent at the same time by
+ * senders on different shards can reach recipients on different shards in a different
+ * order.
+ */
+class ShardGroup {
+  public:
+    /**
+     * A message posted to a shard, executed by the thread of that shard.
+     */
+    using Task = std::function<void(Server &)>;
+
+    /**
+     * Creates the group.
+     * @param shards The number of shards.
+     * @param diskThreads The number of threads of the disk pool.
+     * @param diskQueue The number of tasks waiting for the disk pool, beyond which it refuses them.
+     */
+    ShardGroup(size_t shards, size_t diskThreads = 2, size_t diskQueue = 1024);
+
+    /**
+     * Gets the number of shards.
+     * @return The number of shards.
+     */
+    size_t size() const;
+
+    /**
+     * Registers the server of a shard, which receives the tasks posted to it.
+     * @param shard The index of the shard.
+     * @param server The server of the shard, null once it is destroyed.
+     */
+    void attach(size_t shard, Server *server);
+
+    /**
+     * Posts a task to a shard, and wakes the shard up if its mailbox was empty.
+     * @param shard The index of the shard.
+     * @param task The task to execute on the thread of the shard.
+     */
+    void post(size_t shard, Task task);
+
+    /**
+     * Posts a task to every shard except one.
+     * @param from The index of the shard not receiving the task, usually the caller.
+     * @param task The task to execute on the thread of each shard.
+     */
+    void postToOthers(size_t from, const Task &task);
+
+    /**
+     * Takes all the tasks posted to a shard.
+     * @param shard The index of the shard.
+     * @return The tasks, in posting order.
+     */
+    std::vector<Task> take(size_t shard);
+
+    /**
+     * Queues a task for the disk pool, unless its queue is full. The shards refused a task
+     * are told when there is room again, through Server::resumeOffloads().
+     * @param work The task, moved if it is queued. It runs outside of any shard, and reaches
+     * them through post().
+     * @return false if the queue is full.
+     */
+    bool offload(std::function<void()> &work);
+
+    /**
+     * Opens the message log, recovering its segments and indexing them in the history. The shards refused a record are told
+     * when there is room again, through Server::resumeLog().
+     * @param directory The directory of the segments.
+     * @param segmentSize The size beyond which a new segment is started, in bytes.
+     * @param sync The sync policy.
+     * @param syncInterval The minimum time between two syncs of the Interval policy, in milliseconds.
+     * @param bufferSize The bytes waiting to be written beyond which records are refused.
+     * @throws MessageLog::MessageLogException if the log cannot be opened.
+     */
+    void openLog(const std::string &directory, size_t segmentSize, MessageLog::Sync sync, size_t syncInterval, size_t bufferSize);
+
+    /**
+     * Gets the message log.
+     * @return The log, null until openLog() is called.
+     */
+    MessageLog *log();
+
+    /**
+     * Gets the history of the messages.
+     * @return The history, null until openLog() is called.
+     */
+    HistoryStore *history();
+
+    /**
+     * Starts the retention of the log in the background, if it has any limit.
+     * @param age The seconds a message is kept, 0 for ever.
+     * @param logBytes The size of the log beyond which the oldest segments are dropped, 0 for no limit.
+     * @param rules The retention of the conversations, "<conversation>=<age>/<bytes>,...".
+     * @param interval The seconds between two scans of the segments.
+     * @param bandwidth The bytes the compaction reads and writes per second, 0 for no limit.
+     */
+    void compactLog(uint64_t age, uint64_t logBytes, const std::string &rules, size_t interval, size_t bandwidth);
+
+    /**
+     * Stops the compaction, writes the records appended to the log and closes it, before a
+     * new process opens it.
+     */
+    void closeLog();
+
+    /**
+     * Counts a new connection, unless it would go over the limits.
+     * @param address The IPv4 address of the peer, 0 if not limited per address.
+     * @param maxSessions The maximum number of connections of the server, 0 for no limit.
+     * @param maxPerAddress The maximum number of connections from one address, 0 for no limit.
+     * @return false if the connection must be refused.
+     */
+    bool admit(uint32_t address, size_t maxSessions, size_t maxPerAddress);
+
+    /**
+     * Stops counting a connection accepted by admit().
+     * @param address The IPv4 address given to admit().
+     */
+    void release(uint32_t address);
+
+    /**
+     * Opens the registry of the accounts, whose names number the duplicated names.
+     * @param directory The database folder.
+     * @throws UserRegistry::UserRegistryException if the registry cannot be opened.
+     */
+    void openRegistry(const std::string &directory);
+
+    /**
+     * Gets the registry of the accounts.
+     * @return The registry, null until openRegistry() is called.
+     */
+    UserRegistry *registry();
+
+    /**
+     * Logs a session in, renaming it if the name is already used by another session.
+     * @param shard The index of the shard owning the session.
+     * @param handle The handle of the session in the table of its shard.
+     * @param name The requested name.
+     * @return The name given to the session.
+     */
+    std::string login(size_t shard, SessionTable::Handle handle, const std::string &name);
+
+    /**
+     * Logs in a session handed off by a previous process, without recording a presence
+     * change: the clients already know it.
+     * @param shard The index of the shard owning the session.
+     * @param handle The handle of the session in the table of its shard.
+     * @param name The name of the session.
+     * @return The name given to the session, the same unless it is already used.
+     */
+    std::string adopt(size_t shard, SessionTable::Handle handle, const std::string &name);
+
+    /**
+     * Continues the presence versions of a previous process, before any change is recorded.
+     * @param version The presence version known by the clients.
+     */
+    void setPresenceVersion(uint64_t version);
+
+    /**
+     * Logs a session out.
+     * @param name The name of the session.
+     */
+    void logout(const std::string &name);
+
+    /**
+     * Renames a logged in session, numbering the new name if it is already used.
+     * @param shard The index of the shard owning the session.
+     * @param handle The handle of the session in the table of its shard.
+     * @param from The current name of the session.
+     * @param to The requested name.
+     * @return The name given to the session.
+     */
+    std::string rename(size_t shard, SessionTable::Handle handle, const std::string &from, const std::string &to);
+
+    /**
+     * Finds the shard owning a session.
+     * @param name The name of the session.
+     * @param shard The index of the shard owning the session.
+     * @param handle The handle of the session in the table of its shard.
+     * @return false if no session has this name.
+     */
+    bool find(const std::string &name, size_t &shard, SessionTable::Handle &handle);
+
+    /**
+     * Gets the names of the logged in sessions, in no particular order.
+     * @return The names.
+     */
+    std::vector<std::string> names();
+
+    /**
+     * Gets the names of the logged in sessions, and the presence version they match.
+     * @param version The presence version.
+     * @return The names.
+     */
+    std::vector<std::string> names(uint64_t &version);
+
+    /**
+     * Gets the list of names sent to the clients not subscribed to the presence changes,
+     * "<name>,...", built once after every change of the names and shared by the shards.
+     * @return The list.
+     */
+    std::shared_ptr<const std::string> nameList();
+
+    /**
+     * Gets the PRESENCE snapshot of the names, "0,<version>,+<name>,...", built once after
+     * every presence change and shared by the shards.
+     * @return The snapshot.
+     */
+    std::shared_ptr<const std::string> presenceSnapshot();
+
+    /**
+     * Gets the presence changes made after a version.
+     * @param since The last version known by the caller.
+     * @param changes The changes: "+name" for a login, "-name" for a logout, "~old>new" for a rename.
+     * @param version The version after the last change.
+     * @return false if the changes after since are no longer kept, a snapshot is then needed.
+     */
+    bool presenceSince(uint64_t since, std::vector<std::string> &changes, uint64_t &version);
+
+    /**
+     * Subscribes a session to a channel, creating the channel if needed.
+     * @param channel The name of the channel.
+     * @param name The name of the session.
+     * @param shard The index of the shard owning the session.
+     * @return false if the session already was a member.
+     */
+    bool join(const std::string &channel, const std::string &name, size_t shard);
+
+    /**
+     * Unsubscribes a session from a channel, deleting the channel when it becomes empty.
+     * @param channel The name of the channel.
+     * @param name The name of the session.
+     * @param shard The index of the shard owning the session.
+     * @return false if the session was not a member.
+     */
+    bool leave(const std::string &channel, const std::string &name, size_t shard);
+
+    /**
+     * Gets the members of a channel.
+     * @param channel The name of the channel.
+     * @return The names of the members, empty if the channel does not exist.
+     */
+    std::vector<std::string> members(const std::string &channel);
+
+    /**
+     * Gets the shards owning at least one member of a channel.
+     * @param channel The name of the channel.
+     * @return The indexes of the shards.
+     */
+    std::vector<size_t> channelShards(const std::string &channel);
+
+  private:
+    /**
+     * Logs a session in, the lock being held.
+     * @param shard The index of the shard owning the session.
+     * @param handle The handle of the session in the table of its shard.
+     * @param name The requested name.
+     * @return The name given to the session.
+     */
+    std::string _login(size_t shard, SessionTable::Handle handle, const std::string &name);
+
+    /**
+     * Logs a session out, the lock being held.
+     * @param name The name of the session.
+     * @return false if no session has this name.
+     */
+    bool _logout(const std::string &name);
+
+    /**
+     * Records a presence change, the lock being held.
+     * @param change The change.
+     */
+    void _record(const std::string &change);
+
+    /**
+     * Gets the number of times a name was seen in the registry and the logins, the lock
+     * being held.
+     * @param name The name.
+     * @return The number of times.
+     */
+    size_t _knownCount(const std::string &name);
+
+    /**
+     * @brief Members of a channel.
+     * Members are kept in a dense vector, removed by swapping with the last one, so joining
+     * and leaving are O(1) and listing the members is a single pass.
+     */
+    struct Channel {
+      std::vector<std::string> members; // Names of the members
+      std::unordered_map<std::string, size_t> positions; // Index of every member in members
+      std::vector<size_t> shardMembers; // Number of members owned by each shard
+    };
+
+    /**
+     * @brief A logged in session.
+     */
+    struct Session {
+      size_t shard; // Index of the shard owning the session
+      SessionTable::Handle handle; // Handle of the session in the table of its shard
+      size_t position; // Index of the name in _names
+    };
+
+    /**
+     * @brief Tasks posted to a shard.
+     */
+    struct Mailbox {
+      std::mutex mutex; // Protects tasks
+      std::vector<Task> tasks; // Tasks not executed yet, in posting order
+    };
+
+    std::vector<Server *> _servers; // Server of every shard
+    std::vector<std::unique_ptr<Mailbox>> _mailboxes; // Mailbox of every shard
+
+
+    std::mutex _admissionMutex; // Protects the connection counts
+    size_t _connections = 0; // Number of admitted connections
+    std::unordered_map<uint32_t, size_t> _addresses; // Number of admitted connections from every limited address
+
+    std::mutex _mutex; // Protects the names
+    std::unordered_map<std::string, Session> _sessions; // Every logged in name
+    std::vector<std::string> _names; // Logged in names, dense
+    std::unordered_map<std::string, size_t> _knownNames; // Number of times every name was seen in the logins, counting its account
+    std::unique_ptr<UserRegistry> _registry; // Accounts of the clients, null until opened
+    std::unordered_map<std::string, Channel> _channels; // Members of every channel
+    std::deque<std::string> _presence; // Last presence changes, the last one being at _presenceVersion
+    uint64_t _presenceVersion = 0; // Number of presence changes so far
+    std::shared_ptr<const std::string> _nameList; // List of the names, built on demand, reset when they change
+    std::shared_ptr<const std::string> _presenceSnapshot; // Snapshot of the names at _presenceVersion, built on demand, reset when they change
+
+    DiskPool _disk; // Workers of the file operations, destroyed first as their tasks post to the mailboxes
+    std::unique_ptr<HistoryStore> _history; // Index of the log by conversation, fed by its writer
+    std::unique_ptr<MessageLog> _log; // Log of the messages, destroyed before the mailboxes and the history its writer uses
+    std::unique_ptr<LogCompactor> _compactor; // Retention of the log, null without limits, destroyed before the log
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+#define SHARED_CHANNEL_MAGIC 0x43484154 // "CHAT", first bytes of the shared memory of a channel
+#define SHARED_CHANNEL_FAILED "Failed to set up the shared memory channel" // Error message for a channel setup failure
+
+/**
+ * @brief Two single-producer single-consumer byte rings in shared memory, one per direction,
+ * between the server and a client running on the same host.
+ *
+ * The memory is a memfd, mapped by both processes, and each side has an eventfd the other
+ * one writes to wake it up: the server waits on the server signal, the client on the
+ * client signal. The bytes are the same framed messages as on a socket.
+ *
+ * Signals are only sent when needed: a consumer marks itself asleep (sleep()) before
+ * waiting for its signal, and a producer signals it once after writing (notify()); a
+ * producer finding the ring full marks itself blocked, and the consumer signals it once
+ * after making room. A consumer that keeps reading never receives a signal, so a client
+ * polling its ring exchanges messages without any system call on its side.
+ *
+ * Memory layout: a Header, then the Ring of each direction (client to server first), then
+ * the bytes of each ring. Positions only grow, the offset in a ring is the position modulo
+ * its capacity, a power of two.
+ */
+class SharedChannel {
+  public:
+    /**
+     * @brief Exception class for channel errors.
+     */
+    class SharedChannelException : public std::exception {
+      public:
+        /**
+         * Constructor that takes an error message.
+         * @param message The error message to be associated with the exception.
+         */
+        SharedChannelException(const std::string& message) : _message(message) {}
+
+        /**
+         * Returns the error message associated with the exception.
+         * @return A C-style string containing the error message.
+         */
+        const char* what() const noexcept override {
+            return _message.c_str();
+        }
+      private:
+        std::string _message; ///< The error message associated with the exception.
+    };
+
+    /**
+     * @brief End of the channel a process holds.
+     */
+    enum class Side {
+      Server, // Reads what the client writes, waits on the server signal
+      Client // Reads what the server writes, waits on the client signal
+    };
+
+    /**
+     * Creates a channel, for the server side.
+     * @param capacity The size of each ring in bytes, rounded up to a power of two.
+     * @throws SharedChannelException if the memory or the signals cannot be created.
+     */
+    SharedChannel(size_t capacity);
+
+    /**
+     * Maps an existing channel, received from the server or handed off by a previous process.
+     * The channel takes the file descriptors over, and closes them.
+     * @param memory The memfd of the channel.
+     * @param serverSignal The eventfd waking the server up.
+     * @param clientSignal The eventfd waking the client up.
+     * @param side The end of the channel of this process.
+     * @throws SharedChannelException if the memory is not a channel.
+     */
+    SharedChannel(int memory, int serverSignal, int clientSignal, Side side);
+
+    /**
+     * Unmaps the memory and closes the file descriptors.
+     */
+    ~SharedChannel();
+
+    SharedChannel(const SharedChannel &) = delete;
+    SharedChannel &operator=(const SharedChannel &) = delete;
+
+    /**
+     * Copies bytes to the ring of the other side, as many as fit. Marks this side blocked
+     * when they do not all fit, so the other side signals it once it made room.
+     * @param data The bytes.
+     * @param size The number of bytes.
+     * @return The number of bytes written.
+     */
+    size_t write(const char *data, size_t size);
+
+    /**
+     * Signals the other side if it sleeps, after writing.
+     */
+    void notify();
+
+    /**
+     * Copies the bytes available in the ring of this side, and signals the other side if
+     * it was blocked by a full ring.
+     * @param data The buffer receiving the bytes.
+     * @param size The size of the buffer.
+     * @return The number of bytes read, 0 if the ring is empty.
+     */
+    size_t read(char *data, size_t size);
+
+    /**
+     * Marks this side asleep, to be signaled by the next write of the other side.
+     * @return false if bytes arrived meanwhile, to be read before waiting.
+     */
+    bool sleep();
+
+    /**
+     * Marks this side asleep when a process starts waiting on the channel, and signals it
+     * right away if bytes are already waiting: the previous owner may have been reading
+     * them, in which case the other side does not signal again.
+     */
+    void resume();
+
+    /**
+     * Resets the signal of this side, after it woke the process up.
+     */
+    void clearSignal();
+
+    /**
+     * Gets the size of each ring.
+     * @return The number of bytes.
+     */
+    size_t capacity() const;
+
+    /**
+     * Gets the memfd of the channel.
+     * @return The file descriptor.
+     */
+    int memory() const;
+
+    /**
+     * Gets the eventfd waking the server up.
+     * @return The file descriptor.
+     */
+    int serverSignal() const;
+
+    /**
+     * Gets the eventfd waking the client up.
+     * @return The file descriptor.
+     */
+    int clientSignal() const;
+
+    /**
+     * Gets the eventfd this side waits on.
+     * @return The file descriptor.
+     */
+    int signal() const;
+
+  private:
+    /**
+     * @brief First bytes of the shared memory.
+     */
+    struct Header {
+      uint32_t magic; // SHARED_CHANNEL_MAGIC
+      uint32_t reserved; // Zero
+      uint64_t capacity; // Size of each ring
+    };
+
+    /**
+     * @brief Positions and flags of one direction, each written by one side on its own cache line.
+     */
+    struct Ring {
+      alignas(64) std::atomic<uint64_t> head; // Bytes read by the consumer
+      alignas(64) std::atomic<uint64_t> tail; // Bytes written by the producer
+      alignas(64) std::atomic<uint32_t> sleeping; // 1 while the consumer waits for a signal
+      std::atomic<uint32_t> blocked; // 1 while the producer waits for room
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the rings need lock-free atomics to be shared between processes");
+
+    /**
+     * Maps the memory and points the rings into it.
+     * @param size The size of the memory.
+     */
+    void _map(size_t size);
+
+    /**
+     * Writes the signal of the other side.
+     */
+    void _wakePeer();
+
+    /**
+     * Closes the file descriptors.
+     */
+    void _close();
+
+    int _memory; // memfd of the channel
+    int _serverSignal; // eventfd waking the server up
+    int _clientSignal; // eventfd waking the client up
+    Side _side; // End of the channel of this process
+    void *_mapping; // Mapped memory
+    size_t _size; // Size of the mapping
+    size_t _capacity; // Size of each ring
+    Ring *_in; // Ring read by this side
+    Ring *_out; // Ring written by this side
+    char *_inData; // Bytes of _in
+    char *_outData; // Bytes of _out
+};
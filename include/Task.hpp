@@ -0,0 +1,181 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "FramePool.hpp"
+
+template <typename T = void>
+class Task;
+
+/**
+ * @brief Part of the promise of a Task shared by every result type.
+ */
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation; // Coroutine awaiting this one, resumed when it ends, null for a root
+  std::exception_ptr exception; // Exception thrown out of the coroutine, rethrown to the one awaiting it
+
+  /**
+   * @brief Resumes the awaiting coroutine when the task ends, without going through the
+   * event loop, or returns to whoever resumed a root.
+   */
+  struct FinalAwaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> self) noexcept
+    {
+      std::coroutine_handle<> continuation = self.promise().continuation;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  static void *operator new(size_t size) { return FramePool::allocate(size); }
+  static void operator delete(void *frame, size_t size) noexcept { FramePool::deallocate(frame, size); }
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  FinalAwaiter final_suspend() const noexcept { return {}; }
+  void unhandled_exception() noexcept { exception = std::current_exception(); }
+};
+
+/**
+ * @brief Promise of a Task returning a value.
+ */
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value; // Value returned by the coroutine
+
+  Task<T> get_return_object() noexcept;
+
+  template <typename U>
+  void return_value(U &&result) { value.emplace(std::forward<U>(result)); }
+
+  T result()
+  {
+    if (exception)
+      std::rethrow_exception(exception);
+    return std::move(*value);
+  }
+};
+
+/**
+ * @brief Promise of a Task returning nothing.
+ */
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object() noexcept;
+
+  void return_void() const noexcept {}
+
+  void result()
+  {
+    if (exception)
+      std::rethrow_exception(exception);
+  }
+};
+
+/**
+ * @brief Coroutine returning a T to the coroutine awaiting it.
+ *
+ * A task is lazy: it starts when it is awaited, and when it ends it resumes the coroutine
+ * awaiting it directly (symmetric transfer), so a chain of handlers awaiting each other
+ * costs no trip through the event loop and no stack depth. An exception thrown out of a
+ * task is rethrown where it is awaited.
+ *
+ * The task owns its frame, allocated from the FramePool of the thread. Destroying a task
+ * destroys its frame, and with it the tasks it was awaiting: the whole chain below it.
+ *
+ * The root of a chain (the session of a client) is awaited by nobody, it is started with
+ * handle().resume() and resumes whoever started it when it suspends or ends.
+ */
+template <typename T>
+class Task {
+  public:
+    using promise_type = TaskPromise<T>;
+
+    /**
+     * Creates an empty task, which is done already.
+     */
+    Task() noexcept : _handle(nullptr) {}
+
+    /**
+     * Takes the frame of a coroutine over.
+     * @param handle The coroutine.
+     */
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : _handle(handle) {}
+
+    Task(Task &&other) noexcept : _handle(std::exchange(other._handle, nullptr)) {}
+
+    Task &operator=(Task &&other) noexcept
+    {
+      if (this != &other) {
+        _destroy();
+        _handle = std::exchange(other._handle, nullptr);
+      }
+      return *this;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    /**
+     * Destroys the frame of the coroutine, wherever it is suspended.
+     */
+    ~Task() { _destroy(); }
+
+    /**
+     * Checks if the coroutine ended.
+     * @return true if it ended, or if the task is empty.
+     */
+    bool done() const noexcept { return !_handle || _handle.done(); }
+
+    /**
+     * Gets the coroutine, to start a root task.
+     * @return The handle of the coroutine, null for an empty task.
+     */
+    std::coroutine_handle<> handle() const noexcept { return _handle; }
+
+    bool await_ready() const noexcept { return done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+    {
+      _handle.promise().continuation = caller;
+      return _handle;
+    }
+
+    T await_resume()
+    {
+      if constexpr (std::is_void_v<T>) {
+        if (_handle)
+          _handle.promise().result();
+      } else {
+        return _handle.promise().result();
+      }
+    }
+
+  private:
+    void _destroy() noexcept
+    {
+      if (_handle)
+        _handle.destroy();
+      _handle = nullptr;
+    }
+
+    std::coroutine_handle<promise_type> _handle; // Frame of the coroutine, null for an empty task
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() noexcept
+{
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() noexcept
+{
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#define TIMER_WHEEL_BITS 6 // A level has 2^TIMER_WHEEL_BITS slots
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS) // Number of slots of a level
+#define TIMER_WHEEL_LEVELS 4 // Number of levels, the last one covering TIMER_WHEEL_SLOTS^4 ticks
+#define TIMER_TICK_MS 100 // Resolution of the timers in milliseconds
+
+/**
+ * @brief Hierarchical timing wheel, holding at most one timer per id.
+ *
+ * Timers are kept in TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots. A slot of level
+ * 0 holds the timers expiring on one tick, a slot of level n the timers expiring within
+ * TIMER_WHEEL_SLOTS^n ticks, which are moved down to the lower levels when their time
+ * comes. Arming, cancelling and expiring a timer are O(1).
+ *
+ * The ids are small integers (the file descriptors of the sessions) indexing a vector of
+ * nodes linked into the slots, so once the vector has grown to the largest id, arming and
+ * cancelling allocate nothing.
+ *
+ * Times are in milliseconds on any monotonic clock, and are rounded up to a tick.
+ */
+class TimerWheel {
+  public:
+    /**
+     * Creates an empty wheel.
+     * @param now The current time.
+     */
+    TimerWheel(uint64_t now = 0);
+
+    /**
+     * Arms the timer of an id, replacing the one it had.
+     * @param id The id, a non-negative integer.
+     * @param deadline The time at which the timer expires.
+     */
+    void arm(int id, uint64_t deadline);
+
+    /**
+     * Cancels the timer of an id, if armed.
+     * @param id The id.
+     */
+    void cancel(int id);
+
+    /**
+     * Checks if the timer of an id is armed.
+     * @param id The id.
+     * @return true if the timer is armed.
+     */
+    bool armed(int id) const;
+
+    /**
+     * Moves the wheel to the current time, and disarms the timers that expired.
+     * @param now The current time.
+     * @param expired The ids whose timer expired are appended to it, in expiry order.
+     */
+    void advance(uint64_t now, std::vector<int> &expired);
+
+    /**
+     * Gets the time to wait before the next call to advance() has something to do.
+     * @param now The current time.
+     * @return The time in milliseconds, -1 if no timer is armed.
+     */
+    int timeout(uint64_t now) const;
+
+  private:
+    static constexpr int NONE = -1; // End of a list, or a node not in any slot
+
+    /**
+     * @brief Timer of an id, linked in the list of its slot.
+     */
+    struct Node {
+      int previous = NONE; // Previous node in the slot
+      int next = NONE; // Next node in the slot
+      int slot = NONE; // Index of the slot in _slots, NONE if not armed
+      uint64_t expiry = 0; // Tick at which the timer expires
+    };
+
+    /**
+     * Links a node in the slot matching its expiry.
+     * @param id The id of the node.
+     */
+    void _insert(int id);
+
+    /**
+     * Unlinks a node from its slot.
+     * @param id The id of the node.
+     */
+    void _unlink(int id);
+
+    /**
+     * Moves the nodes of a slot of a level down to the lower levels.
+     * @param level The level.
+     * @param index The index of the slot in the level.
+     */
+    void _cascade(int level, size_t index);
+
+    std::vector<Node> _nodes; // Node of every id
+    std::vector<int> _slots; // First node of every slot, level by level
+    uint64_t _occupied[TIMER_WHEEL_LEVELS]; // Bit i set when slot i of the level is not empty
+    uint64_t _current; // Last tick processed
+    size_t _armed; // Number of armed timers
+};
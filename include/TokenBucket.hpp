@@ -0,0 +1,44 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+
+/**
+ * @brief Rate allowed by a token bucket.
+ */
+struct RateLimit {
+  double rate = 0; // Tokens added per second
+  double burst = 0; // Maximum number of tokens, what can be spent at once
+};
+
+/**
+ * @brief Token bucket, refilled at a constant rate up to its burst size.
+ *
+ * The bucket only stores its tokens and the time of its last refill, the limit is given
+ * on every call, so a bucket per session costs 16 bytes whatever the limits.
+ */
+struct TokenBucket {
+  double tokens = 0; // Tokens left at the last refill
+  uint64_t updated = 0; // Time of the last refill in milliseconds, 0 for a full bucket
+
+  /**
+   * Refills the bucket, then takes tokens from it if there are enough.
+   * @param cost The number of tokens to take.
+   * @param limit The rate and burst size of the bucket.
+   * @param now The current time in milliseconds.
+   * @return false if there are not enough tokens, none is taken then.
+   */
+  bool take(double cost, const RateLimit &limit, uint64_t now)
+  {
+    if (updated == 0)
+      tokens = limit.burst;
+    else if (now > updated)
+      tokens = std::min(limit.burst, tokens + (now - updated) * limit.rate / 1000.0);
+    updated = std::max(updated, now);
+
+    if (tokens < cost)
+      return false;
+    tokens -= cost;
+    return true;
+  }
+};
@@ -0,0 +1,214 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+#include "EventLoop.hpp"
+
+#define URING_ENTRIES 4096 // Size of the submission queue
+#define URING_BUFFER_COUNT 1024 // Number of receive buffers provided to the kernel, a power of two
+#define URING_BUFFER_SIZE 16384 // Size of each receive buffer
+#define URING_BUFFER_GROUP 0 // Identifier of the provided buffer group
+
+/**
+ * @brief io_uring implementation of the EventLoop, using the raw system calls.
+ *
+ * The listening socket gets one multishot accept, and every client one multishot
+ * recv picking its buffer from a ring of buffers provided to the kernel, so reading
+ * needs no system call per message. Sends are queued per client with at most one in
+ * flight, to keep them in order, and every send gathers up to SEND_BATCH_SIZE of the
+ * queued buffers. Everything queued while handling the completions is
+ * submitted in one io_uring_enter call, together with the wait for the next ones.
+ *
+ * A client moved to a shared memory channel gets a multishot poll on the signal of the
+ * channel. Its bytes are copied to the ring by flush(), once per wakeup.
+ *
+ * Requires Linux 6.0 or later (multishot recv, provided buffer rings).
+ */
+class UringLoop : public EventLoop {
+  public:
+    /**
+     * Creates the ring and registers the receive buffers.
+     * @param handler The receiver of the events.
+     * @throws EventLoopException if io_uring is not available.
+     */
+    UringLoop(Handler &handler);
+
+    /**
+     * Unmaps the rings and closes the io_uring instance.
+     */
+    ~UringLoop() override;
+
+    void listen(int socket) override;
+    void add(int client) override;
+    void share(int client, const std::shared_ptr<SharedChannel> &channel) override;
+    void remove(int client) override;
+    void pause() override;
+    std::string detach(int client) override;
+    void send(int client, const Buffer &data) override;
+    void flush() override;
+    size_t pending(int client) const override;
+    void wake() override;
+    void poll(int timeout) override;
+
+  private:
+    /**
+     * @brief Buffers of a send in flight, read by the kernel until its completion.
+     * Allocated on its own so its address does not change while the kernel uses it.
+     */
+    struct Batch {
+      std::vector<Buffer> buffers; // Buffers sent, kept alive until the completion
+      std::vector<struct iovec> iov; // Gather list of the bytes not sent yet
+      struct msghdr header = {}; // Message pointing to iov
+    };
+
+    /**
+     * @brief State of a client socket.
+     */
+    struct Connection {
+      uint32_t generation = 0; // Bumped on removal, to recognize the completions of a previous client
+      bool registered = false; // true between add and remove
+      bool receiving = false; // true while the multishot receive is armed
+      bool sending = false; // true while a send is submitted and not completed
+      bool detaching = false; // true while detach waits for the send in flight
+      bool dirty = false; // true while the client is in _dirty
+      size_t pending = 0; // Bytes queued and not sent yet
+      size_t sent = 0; // Bytes of the first queued buffer already copied to the shared memory channel
+      std::deque<Buffer> outbound; // Buffers waiting for the send in flight to complete
+      std::unique_ptr<Batch> inflight; // Send in flight, nullptr if none
+      std::shared_ptr<SharedChannel> shared; // Shared memory channel the bytes go through, nullptr for the socket
+    };
+
+    /**
+     * Unmaps the rings and closes the io_uring instance.
+     */
+    void _release();
+
+    /**
+     * Gets a free submission queue entry, submitting the queued ones until the queue has
+     * room if it is full.
+     * @return The entry, zeroed.
+     */
+    struct io_uring_sqe *_getSqe();
+
+    /**
+     * Submits the queued entries and optionally waits for completions.
+     * @param wait The number of completions to wait for, none if some were set aside by _defer().
+     * @param timeout The maximum time to wait in milliseconds, -1 to wait forever.
+     * @return false if the wait was interrupted or timed out.
+     */
+    bool _enter(unsigned wait, int timeout);
+
+    /**
+     * Queues the multishot accept of a listening socket.
+     * @param listener The listening socket.
+     */
+    void _armAccept(int listener);
+
+    /**
+     * Queues the read of the wake up eventfd.
+     */
+    void _armWake();
+
+    /**
+     * Queues the multishot receive of a client.
+     * @param client The file descriptor of the client.
+     */
+    void _armRecv(int client);
+
+    /**
+     * Queues the multishot poll of the signal of the shared memory channel of a client.
+     * @param client The file descriptor of the client.
+     */
+    void _armSignal(int client);
+
+    /**
+     * Reads the shared memory channel of a client until it is empty or the client is removed.
+     * @param client The file descriptor of the client.
+     */
+    void _readShared(int client);
+
+    /**
+     * Copies the queued bytes of a client to its shared memory channel, until the queue is
+     * empty or the ring is full.
+     * @param client The file descriptor of the client.
+     */
+    void _writeShared(int client);
+
+    /**
+     * Stops watching the shared memory channel of a client, if it has one.
+     * @param client The file descriptor of the client.
+     */
+    void _unshare(int client);
+
+    /**
+     * Queues the send of the rest of the batch in flight of a client, or of a new batch
+     * made of up to SEND_BATCH_SIZE of its waiting buffers.
+     * @param client The file descriptor of the client.
+     */
+    void _armSend(int client);
+
+    /**
+     * Gives a receive buffer back to the kernel.
+     * @param id The identifier of the buffer.
+     */
+    void _recycle(uint16_t id);
+
+    /**
+     * Cancels the operation tagged with some user data.
+     * @param tag The user data of the operation.
+     */
+    void _cancel(uint64_t tag);
+
+    /**
+     * Handles the completions available, without waiting, the ones set aside first.
+     */
+    void _reap();
+
+    /**
+     * Takes the completions available off the ring without handling them, making room for
+     * the next ones: _getSqe() cannot run the handlers under its caller.
+     */
+    void _defer();
+
+    /**
+     * Handles one completion.
+     * @param cqe The completion, copied out of the ring.
+     */
+    void _complete(const struct io_uring_cqe &cqe);
+
+    Handler &_handler; // Receiver of the events
+    int _ring; // io_uring file descriptor
+    std::vector<int> _listeners; // Listening sockets
+    size_t _accepting; // Number of listening sockets with their multishot accept armed
+    bool _paused; // true once pause() stopped the accepts and receives
+    unsigned _toSubmit; // Entries queued and not submitted yet
+    int _wakeFd; // eventfd written by wake()
+    uint64_t _wakeValue; // Buffer of the read of _wakeFd
+
+    void *_sqRing; // Mapped submission ring
+    size_t _sqRingSize; // Size of the submission ring mapping
+    void *_cqRing; // Mapped completion ring, same as _sqRing with IORING_FEAT_SINGLE_MMAP
+    size_t _cqRingSize; // Size of the completion ring mapping
+    struct io_uring_sqe *_sqes; // Mapped submission entries
+    size_t _sqesSize; // Size of the submission entries mapping
+    unsigned *_sqHead, *_sqTail, *_sqMask, *_sqEntries; // Submission ring fields
+    unsigned *_cqHead, *_cqTail, *_cqMask; // Completion ring fields
+    struct io_uring_cqe *_cqes; // Completion entries
+    std::deque<struct io_uring_cqe> _deferred; // Completions set aside by _defer(), oldest first
+
+    struct io_uring_buf_ring *_bufferRing; // Ring of receive buffers shared with the kernel
+    uint16_t _bufferTail; // Local copy of the tail of the buffer ring
+    std::vector<char> _buffers; // Memory of the receive buffers
+    std::vector<char> _sharedBuffer; // Buffer receiving the bytes read from the shared memory channels
+
+    std::vector<Connection> _connections; // State of every client, indexed by file descriptor
+    std::vector<int> _dirty; // Clients with a shared memory channel and bytes queued since the last flush
+    std::map<uint64_t, std::unique_ptr<Batch>> _orphans; // Sends in flight of removed clients, kept until their completion
+};
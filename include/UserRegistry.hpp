@@ -0,0 +1,173 @@
+#pragma once
+
+#include <cstdint>
+#include <exception>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#define USER_REGISTRY_FAILED "Failed to open the user registry" // Error message for a registry that cannot be opened
+#define USER_REGISTRY_FILE "users.db" // Snapshot of the registry, in the database folder
+#define USER_JOURNAL_FILE "users.log" // Accounts created since the snapshot, in the database folder
+#define USER_REGISTRY_COMPACT_MIN 4096 // Accounts in the journal below which it is never merged into the snapshot
+
+/**
+ * @brief Accounts of the clients: name, id, creation and last login times.
+ *
+ * The registry is two files of the database folder. The snapshot holds the accounts
+ * sorted by name:
+ *
+ *     magic "CHATUSR1" (8) | count (8) | next id (8) | reserved (8)
+ *     count entries: id (8) | created (8) | last login (8) | name offset (4) | name size (4)
+ *     names
+ *
+ * in big-endian, the times in milliseconds since the epoch. It is mapped at startup and
+ * searched in place, so opening it costs the same with a thousand or a million accounts.
+ * The journal holds the accounts created since, each record carrying its length and a
+ * CRC-32C of everything but its last login:
+ *
+ *     length (4) | crc32c (4) | last login (8) | id (8) | created (8) | name
+ *
+ * A login writes the last login time of the account in place, in either file, and a new
+ * account is appended to the journal. When the journal holds many accounts at startup, it
+ * is merged into a new snapshot, written aside and renamed over the old one.
+ *
+ * Without any file, the registry is built from the legacy layout, one folder per client.
+ */
+class UserRegistry {
+  public:
+    /**
+     * @brief Exception class for registry errors.
+     */
+    class UserRegistryException : public std::exception {
+      public:
+        /**
+         * Constructor that takes an error message.
+         * @param message The error message to be associated with the exception.
+         */
+        UserRegistryException(const std::string& message) : _message(message) {}
+
+        /**
+         * Returns the error message associated with the exception.
+         * @return A C-style string containing the error message.
+         */
+        const char* what() const noexcept override {
+            return _message.c_str();
+        }
+      private:
+        std::string _message; ///< The error message associated with the exception.
+    };
+
+    /**
+     * @brief An account.
+     */
+    struct User {
+      uint64_t id = 0; // Number of the account, from 1
+      uint64_t created = 0; // Time of the creation, in milliseconds since the epoch
+      uint64_t lastLogin = 0; // Time of the last login, in milliseconds since the epoch
+    };
+
+    /**
+     * Creates a closed registry.
+     * @param directory The database folder holding its files.
+     */
+    UserRegistry(const std::string &directory);
+
+    /**
+     * Unmaps the snapshot and closes the journal.
+     */
+    ~UserRegistry();
+
+    UserRegistry(const UserRegistry &) = delete;
+    UserRegistry &operator=(const UserRegistry &) = delete;
+
+    /**
+     * Maps the snapshot and reads the journal, truncating its torn tail. Builds the
+     * registry from the legacy folders if it has no file yet.
+     * @throws UserRegistryException if a file cannot be read or written.
+     */
+    void open();
+
+    /**
+     * Finds an account.
+     * @param name The name of the account.
+     * @param user The account, filled if found.
+     * @return false if no account has this name.
+     */
+    bool find(std::string_view name, User &user);
+
+    /**
+     * Checks if an account exists.
+     * @param name The name of the account.
+     * @return true if it exists.
+     */
+    bool contains(std::string_view name);
+
+    /**
+     * Records a login, creating the account if needed.
+     * @param name The name of the account.
+     * @param time The time of the login, in milliseconds since the epoch.
+     * @return The account.
+     */
+    User login(const std::string &name, uint64_t time);
+
+    /**
+     * Gets the number of accounts.
+     * @return The number of accounts.
+     */
+    size_t size();
+
+  private:
+    /**
+     * @brief An account of the journal.
+     */
+    struct Added {
+      User user; // The account
+      uint64_t offset; // Offset of its record in the journal
+    };
+
+    /**
+     * Searches the snapshot, the lock being held.
+     * @param name The name of the account.
+     * @return The index of its entry, or the number of entries if it is not there.
+     */
+    size_t _search(std::string_view name) const;
+
+    /**
+     * Maps the snapshot file, if it exists.
+     * @return false if there is no snapshot.
+     */
+    bool _mapSnapshot();
+
+    /**
+     * Reads the journal, truncating it after its last valid record.
+     */
+    void _readJournal();
+
+    /**
+     * Builds the journal from the legacy folders, one per client.
+     */
+    void _import();
+
+    /**
+     * Writes the accounts of the snapshot and of the journal to a new snapshot, then
+     * empties the journal.
+     */
+    void _compact();
+
+    /**
+     * Unmaps the snapshot.
+     */
+    void _unmapSnapshot();
+
+    std::string _directory; // Database folder, ending with a slash
+    std::shared_mutex _mutex; // Protects the fields below
+    char *_snapshot; // Mapping of the snapshot, null if there is none
+    size_t _snapshotSize; // Size of the mapping
+    uint64_t _count; // Number of accounts in the snapshot
+    uint64_t _nextId; // Id of the next account created
+    int _journal; // Journal file, -1 until opened
+    uint64_t _journalSize; // Size of the journal
+    std::unordered_map<std::string, Added> _added; // Accounts of the journal, by name
+};
@@ -4,19 +4,78 @@
 #include <string>
 #include <vector>
 #include <bitset>
+#include <cstdint>
+#include <string_view>
+
+#include "BitCodec.hpp"
 
 #define SIMPLE_MESSAGE "00000000"
 #define COMMAND_MESSAGE "00000001"
 #define LIST_USERS "00000010"
 #define LOGIN "00000011"
+#define JOIN_CHANNEL "00000100"
+#define LEAVE_CHANNEL "00000101"
+#define PRESENCE "00000110" // Presence changes, "<base>,<version>,<change>,..." (see README)
+#define PING "00000111" // Heartbeat, answered by a PONG with the same payload
+#define PONG "00001000" // Answer to a PING
+#define RATE_LIMITED "00001001" // Messages of the type in the payload are dropped for going over a rate limit
+#define SHARED_MEMORY "00001010" // Moves a local session to a shared memory channel, see SharedChannel
+#define HISTORY "00001011" // Past messages of a conversation, "<conversation> [<count> [<before>]]" (see README)
+#define OFFLINE "00001100" // Private messages received while offline, "<remaining>" then one line per message (see README)
+#define PRIVATE_MESSAGE "00001101" // Message to one user, "<name> <message>"
+
+#define PROTOCOL_V1 1 // Legacy format, every bit is sent as an ASCII '0'/'1' character
+#define PROTOCOL_V2 2 // Compact format, raw bytes
+#define V1_HEADER_SIZE 40 // Size of the legacy header (8 type characters + 32 size characters)
+#define V2_HEADER_SIZE 5 // Size of the compact header (1 type byte + 4 size bytes)
+
+/**
+ * @brief MessageType
+ * The message types as numbers, the value of Frame::type. Matches the headers above.
+ */
+enum class MessageType : uint8_t {
+  Simple = 0, // SIMPLE_MESSAGE
+  Command = 1, // COMMAND_MESSAGE
+  ListUsers = 2, // LIST_USERS
+  Login = 3, // LOGIN
+  JoinChannel = 4, // JOIN_CHANNEL
+  LeaveChannel = 5, // LEAVE_CHANNEL
+  Presence = 6, // PRESENCE
+  Ping = 7, // PING
+  Pong = 8, // PONG
+  RateLimited = 9, // RATE_LIMITED
+  SharedMemory = 10, // SHARED_MEMORY
+  History = 11, // HISTORY
+  Offline = 12, // OFFLINE
+  Private = 13, // PRIVATE_MESSAGE
+};
+
+/**
+ * @brief Frame
+ * A lightweight view over one message, filled by BinaryProtocol::parse without any
+ * allocation. The payload points into the parsed buffer, which must outlive the frame.
+ */
+struct Frame {
+  uint8_t type = 0; // Type of the message (the header as a number)
+  uint8_t version = PROTOCOL_V1; // Wire format of the message
+  uint32_t length = 0; // Size of the payload in bytes
+  bool bitString = false; // true while the payload still holds the v1 '0'/'1' characters
+  std::string_view payload; // Payload of the message
+};
 
 /**
  * @brief BinaryProtocol class
  * This class is used to encode and decode messages in binary format.
- * The messages are encoded in the following format:
- * - Header: 8 bits
- * - Size: 32 bits
- * - Payload: variable size
+ * Two wire formats are supported:
+ * - v1 (legacy): Header as 8 '0'/'1' characters, size as 32 '0'/'1' characters,
+ *   then every payload byte as 8 '0'/'1' characters.
+ * - v2 (compact): Header as 1 byte, size as 4 bytes in network byte order,
+ *   then the raw payload bytes.
+ *
+ * A v1 message always starts with '0' or '1', while v2 type bytes are kept below
+ * '0' (0x30), so the format of any message can be told from its first byte.
+ * The version of a session is negotiated by the LOGIN message: the server answers
+ * in the format used by the client for its LOGIN, and keeps using it afterwards.
  */
 class BinaryProtocol {
   public:
@@ -27,15 +86,166 @@ class BinaryProtocol {
      * @param header The header of the message.
      * @return The encoded message.
      */
-    static std::string encode(const std::string &message, const std::string &header)
+    static std::string encode(const std::string &message, const std::string &header, int version = PROTOCOL_V1)
+    {
+      if (version == PROTOCOL_V2)
+        return encodeV2(message, header);
+
+      std::string encoded = header + std::bitset<32>(message.size()).to_string();
+
+      encoded.resize(V1_HEADER_SIZE + message.size() * 8);
+      BitCodec::pack(message.data(), message.size(), &encoded[V1_HEADER_SIZE]);
+
+      return encoded;
+    }
+
+    /**
+     * @brief encodeV2
+     * This function encodes a message in the compact v2 format.
+     * @param message The message to encode.
+     * @param header The header of the message.
+     * @return The encoded message.
+     */
+    static std::string encodeV2(const std::string &message, const std::string &header)
+    {
+      uint32_t size = message.size();
+      std::string encoded;
+
+      encoded.reserve(V2_HEADER_SIZE + message.size());
+      encoded += static_cast<char>(toType(header));
+      encoded += static_cast<char>((size >> 24) & 0xFF);
+      encoded += static_cast<char>((size >> 16) & 0xFF);
+      encoded += static_cast<char>((size >> 8) & 0xFF);
+      encoded += static_cast<char>(size & 0xFF);
+      encoded += message;
+
+      return encoded;
+    }
+
+    /**
+     * @brief parse
+     * This function parses the message at the start of a buffer in place.
+     * For v1 messages the payload is left as '0'/'1' characters, see unpack.
+     * @param buffer The buffer to parse.
+     * @param frame The frame to fill.
+     * @return The size of the message on the wire, 0 if the buffer does not hold a
+     * whole message yet, -1 if the message is malformed.
+     */
+    static long parse(std::string_view buffer, Frame &frame)
+    {
+      if (buffer.empty())
+        return 0;
+
+      if (getVersion(buffer) == PROTOCOL_V2) {
+        if (buffer.size() < V2_HEADER_SIZE)
+          return 0;
+        uint64_t total = V2_HEADER_SIZE + static_cast<uint64_t>(getSizeV2(buffer));
+        if (buffer.size() < total)
+          return 0;
+        frame.type = static_cast<uint8_t>(buffer[0]);
+        frame.version = PROTOCOL_V2;
+        frame.length = getSizeV2(buffer);
+        frame.bitString = false;
+        frame.payload = buffer.substr(V2_HEADER_SIZE, frame.length);
+        return static_cast<long>(total);
+      }
+
+      if (buffer.size() < V1_HEADER_SIZE)
+        return 0;
+      uint64_t type = 0;
+      uint64_t size = 0;
+      if (!readBits(buffer.substr(0, 8), type) || !readBits(buffer.substr(8, 32), size))
+        return -1;
+      uint64_t total = V1_HEADER_SIZE + size * 8;
+      if (buffer.size() < total)
+        return 0;
+      frame.type = static_cast<uint8_t>(type);
+      frame.version = PROTOCOL_V1;
+      frame.length = static_cast<uint32_t>(size);
+      frame.bitString = true;
+      frame.payload = buffer.substr(V1_HEADER_SIZE, size * 8);
+      return static_cast<long>(total);
+    }
+
+    /**
+     * @brief peekSize
+     * This function reads the payload size of the message at the start of a buffer,
+     * without waiting for the payload.
+     * @param buffer The buffer to read.
+     * @param size The payload size.
+     * @return false if the buffer does not hold a whole and valid header yet.
+     */
+    static bool peekSize(std::string_view buffer, uint32_t &size)
     {
-      std::string size = std::bitset<32>(message.size()).to_string();
-      std::string payload = "";
+      if (getVersion(buffer) == PROTOCOL_V2) {
+        if (buffer.size() < V2_HEADER_SIZE)
+          return false;
+        size = getSizeV2(buffer);
+        return true;
+      }
 
-      for (char c : message)
-        payload += std::bitset<8>(c).to_string();
+      uint64_t bits = 0;
+      if (buffer.size() < V1_HEADER_SIZE || !readBits(buffer.substr(8, 32), bits))
+        return false;
+      size = static_cast<uint32_t>(bits);
+      return true;
+    }
+
+    /**
+     * @brief unpack
+     * This function turns the '0'/'1' payload of a v1 frame into bytes.
+     * The bytes are written in a caller-owned buffer, so reusing the same buffer
+     * avoids allocating once its capacity is large enough. v2 frames are left untouched.
+     * @param frame The frame to unpack, its payload then points into out.
+     * @param out The buffer receiving the payload bytes.
+     * @return false if the payload contains anything else than '0' and '1'.
+     */
+    static bool unpack(Frame &frame, std::string &out)
+    {
+      if (!frame.bitString)
+        return true;
+
+      out.resize(frame.length);
+      if (!BitCodec::unpack(frame.payload.data(), frame.length, out.data()))
+        return false;
+      frame.payload = std::string_view(out.data(), out.size());
+      frame.bitString = false;
+      return true;
+    }
+
+    /**
+     * @brief toType
+     * This function converts a header to a message type.
+     * @param header The header, as 8 '0'/'1' characters.
+     * @return The message type.
+     */
+    static uint8_t toType(const std::string &header)
+    {
+      return static_cast<uint8_t>(std::bitset<8>(header).to_ulong());
+    }
 
-      return header + size + payload;
+    /**
+     * @brief toHeader
+     * This function converts a message type to a header.
+     * @param type The message type.
+     * @return The header, as 8 '0'/'1' characters.
+     */
+    static std::string toHeader(uint8_t type)
+    {
+      return std::bitset<8>(type).to_string();
+    }
+
+    /**
+     * @brief getVersion
+     * This function gets the wire format version of the message.
+     * @param message The message to get the version from.
+     * @return PROTOCOL_V1 or PROTOCOL_V2.
+     */
+    static int getVersion(std::string_view message)
+    {
+      if (message.empty() || message[0] == '0' || message[0] == '1')
+        return PROTOCOL_V1;
+      return PROTOCOL_V2;
     }
 
     /**
@@ -46,6 +256,8 @@ class BinaryProtocol {
      */
     static std::string getSize(const std::string &message)
     {
+      if (getVersion(message) == PROTOCOL_V2)
+        return std::bitset<32>(getSizeV2(message)).to_string();
       return message.substr(8, 32);
     }
 
@@ -58,25 +270,12 @@ class BinaryProtocol {
      */
     static std::string decode(const std::string &message)
     {
-        if (message.size() < 40) {
-            return "";
-        }
+        Frame frame;
+        std::string payload;
 
-        std::string header = message.substr(0, 8);
-        std::string sizeBits = message.substr(8, 32);
-        int messageSize = std::bitset<32>(sizeBits).to_ulong();
-
-        if (message.size() < 40 + messageSize * 8) {
+        if (parse(message, frame) <= 0 || !unpack(frame, payload))
             return "";
-        }
-
-        std::string payload = "";
-        for (int i = 40; i < 40 + messageSize * 8; i += 8) {
-            std::string byte = message.substr(i, 8);
-            payload += static_cast<char>(std::bitset<8>(byte).to_ulong());
-        }
-
-        return payload;
+        return std::string(frame.payload);
     }
 
     /**
@@ -87,6 +286,43 @@ class BinaryProtocol {
      */
     static std::string getHeader(const std::string &message)
     {
+      if (getVersion(message) == PROTOCOL_V2)
+        return toHeader(static_cast<uint8_t>(message[0]));
       return message.substr(0, 8);
     }
+
+  private:
+    /**
+     * @brief getSizeV2
+     * This function reads the size field of a v2 message.
+     * @param message The message to get the size from.
+     * @return The size of the payload.
+     */
+    static uint32_t getSizeV2(std::string_view message)
+    {
+      if (message.size() < V2_HEADER_SIZE)
+        return 0;
+      return (static_cast<uint32_t>(static_cast<unsigned char>(message[1])) << 24)
+           | (static_cast<uint32_t>(static_cast<unsigned char>(message[2])) << 16)
+           | (static_cast<uint32_t>(static_cast<unsigned char>(message[3])) << 8)
+           | static_cast<uint32_t>(static_cast<unsigned char>(message[4]));
+    }
+
+    /**
+     * @brief readBits
+     * This function reads a number written as '0'/'1' characters, most significant bit first.
+     * @param bits The characters to read.
+     * @param value The number read.
+     * @return false if a character is neither '0' nor '1'.
+     */
+    static bool readBits(std::string_view bits, uint64_t &value)
+    {
+      value = 0;
+      for (char c : bits) {
+        if (c != '0' && c != '1')
+          return false;
+        value = (value << 1) | static_cast<uint64_t>(c - '0');
+      }
+      return true;
+    }
 };
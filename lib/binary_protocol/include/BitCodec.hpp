@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/**
+ * @brief BitCodec class
+ * This class converts bytes to and from the '0'/'1' characters of the legacy (v1)
+ * wire format, most significant bit first, like std::bitset<8>::to_string.
+ *
+ * The conversion is done 8 bytes (64 characters) per step with SSE2 or AVX2 when the
+ * CPU supports it, the implementation being picked once at runtime. The remaining
+ * bytes, and CPUs without these instructions, use a scalar implementation giving the
+ * exact same output.
+ */
+class BitCodec {
+  public:
+    /**
+     * @brief pack
+     * This function writes every byte as 8 '0'/'1' characters.
+     * @param bytes The bytes to convert.
+     * @param count The number of bytes.
+     * @param bits The output, at least 8 * count characters long.
+     */
+    static void pack(const char *bytes, size_t count, char *bits);
+
+    /**
+     * @brief unpack
+     * This function reads every group of 8 '0'/'1' characters as a byte.
+     * @param bits The characters to convert, 8 * count characters long.
+     * @param count The number of bytes to produce.
+     * @param bytes The output, at least count bytes long.
+     * @return false if the input contains anything else than '0' and '1'.
+     */
+    static bool unpack(const char *bits, size_t count, char *bytes);
+
+    /**
+     * @brief implementation
+     * This function gets the name of the implementation picked for this CPU.
+     * @return "avx2", "sse2" or "scalar".
+     */
+    static std::string implementation();
+
+    /**
+     * @brief select
+     * This function replaces the implementation picked for this CPU, so the sample can
+     * compare them. It must not run while other threads convert.
+     * @param name "avx2", "sse2" or "scalar".
+     * @return false if the CPU does not support it, the implementation being left as it was.
+     */
+    static bool select(const std::string &name);
+};
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <exception>
+
+#include "BinaryProtocol.hpp"
+
+#define DEFAULT_MAX_FRAME_SIZE (1 << 20) // Default maximum payload size of a message, in bytes
+
+/**
+ * @brief FrameBuffer class
+ * Reassembly buffer for a stream of messages. Bytes are appended as they are read from
+ * the socket, whatever the boundaries of the reads, and every complete message is then
+ * extracted in order. An incomplete message stays in the buffer until the rest arrives.
+ */
+class FrameBuffer {
+  public:
+    /**
+     * @brief Exception class for malformed or oversized messages.
+     * The stream cannot be resynchronized after it, the connection should be closed.
+     */
+    class FrameBufferException : public std::exception {
+      public:
+        /**
+         * @brief Constructor for FrameBufferException.
+         * @param message The error message.
+         */
+        FrameBufferException(const std::string &message) : _message(message) {}
+
+        /**
+         * @brief Get the error message.
+         */
+        const char *what() const noexcept override {
+          return _message.c_str();
+        }
+
+      private:
+        std::string _message; // Error message
+    };
+
+    /**
+     * @brief Constructor for FrameBuffer.
+     * @param maxFrameSize The maximum payload size accepted, in bytes.
+     */
+    FrameBuffer(size_t maxFrameSize = DEFAULT_MAX_FRAME_SIZE) : _maxFrameSize(maxFrameSize), _offset(0) {}
+
+    /**
+     * @brief append
+     * This function appends bytes read from the stream.
+     * @param data The bytes read.
+     * @param size The number of bytes.
+     */
+    void append(const char *data, size_t size)
+    {
+      _buffer.append(data, size);
+    }
+
+    /**
+     * @brief next
+     * This function extracts the next complete message.
+     * The payload of the frame points into the buffer, it stays valid until the next
+     * call to append or next.
+     * @param frame The frame to fill.
+     * @return false if no complete message is buffered.
+     * @throws FrameBufferException if the message is malformed or larger than the maximum size.
+     */
+    bool next(Frame &frame)
+    {
+      std::string_view pending(_buffer.data() + _offset, _buffer.size() - _offset);
+      long size = BinaryProtocol::parse(pending, frame);
+      uint32_t length = 0;
+
+      if (size < 0)
+        throw FrameBufferException("Malformed message");
+      if (size == 0) {
+        if (BinaryProtocol::peekSize(pending, length) && length > _maxFrameSize)
+          throw FrameBufferException("Message too large: " + std::to_string(length) + " bytes");
+        _compact();
+        return false;
+      }
+      if (frame.length > _maxFrameSize)
+        throw FrameBufferException("Message too large: " + std::to_string(frame.length) + " bytes");
+
+      _offset += size;
+      return true;
+    }
+
+    /**
+     * @brief pending
+     * This function gets the bytes not extracted yet.
+     * @return A view over the buffered bytes.
+     */
+    std::string_view pending() const
+    {
+      return std::string_view(_buffer.data() + _offset, _buffer.size() - _offset);
+    }
+
+  private:
+    /**
+     * @brief Drops the extracted messages from the front of the buffer.
+     */
+    void _compact()
+    {
+      if (_offset == 0)
+        return;
+      _buffer.erase(0, _offset);
+      _offset = 0;
+    }
+
+    std::string _buffer; // Bytes read and not extracted yet, starting at _offset
+    size_t _maxFrameSize; // Maximum payload size accepted
+    size_t _offset; // Start of the first message not extracted yet
+};
@@ -1,14 +1,80 @@
 #include "BinaryProtocol.hpp"
 
+#include <random>
+
+/**
+ * @brief checkCodec
+ * This function compares an implementation of BitCodec with std::bitset, for every
+ * length of 0 to 63 bytes, then longer ones, so every tail after the 8 byte steps is
+ * covered, with random payloads.
+ * @param name The implementation, "avx2", "sse2" or "scalar".
+ * @return The number of mismatches.
+ */
+static int checkCodec(const std::string &name)
+{
+  std::mt19937 random(42);
+  int failures = 0;
+
+  for (size_t count = 0; count < 64 + 64 * 8; count += (count < 64) ? 1 : 61) {
+    for (int round = 0; round < 16; round++) {
+      std::string bytes(count, '\0');
+      for (char &byte : bytes)
+        byte = static_cast<char>(random());
+
+      std::string expected;
+      for (char byte : bytes)
+        expected += std::bitset<8>(static_cast<unsigned char>(byte)).to_string();
+
+      std::string bits(count * 8, '\0');
+      BitCodec::pack(bytes.data(), count, bits.data());
+      std::string decoded(count, '\0');
+      bool valid = BitCodec::unpack(expected.data(), count, decoded.data());
+      if (bits != expected || !valid || decoded != bytes) {
+        std::cout << name << ": mismatch for " << count << " bytes" << std::endl;
+        failures++;
+      }
+
+      // Any character but '0' and '1' is refused, wherever it is
+      if (count > 0) {
+        expected[random() % expected.size()] = '2';
+        if (BitCodec::unpack(expected.data(), count, decoded.data())) {
+          std::cout << name << ": invalid character accepted for " << count << " bytes" << std::endl;
+          failures++;
+        }
+      }
+    }
+  }
+  return failures;
+}
+
 int main(void)
 {
   std::string data = "Hello World!";
 
-  std::string encoded = BinaryProtocol::encode(data);
+  std::string encoded = BinaryProtocol::encode(data, SIMPLE_MESSAGE);
   std::string decoded = BinaryProtocol::decode(encoded);
 
   std::cout << "Encoded: " << encoded << std::endl;
   std::cout << "Decoded: " << decoded << std::endl;
 
-  return 0;
+  std::string compact = BinaryProtocol::encode(data, SIMPLE_MESSAGE, PROTOCOL_V2);
+
+  std::cout << "Compact size: " << compact.size() << " (legacy: " << encoded.size() << ")" << std::endl;
+  std::cout << "Compact decoded: " << BinaryProtocol::decode(compact) << std::endl;
+
+  // Every implementation this CPU supports must match std::bitset
+  std::string picked = BitCodec::implementation();
+  int failures = 0;
+  for (const std::string name : {"scalar", "sse2", "avx2"}) {
+    if (!BitCodec::select(name)) {
+      std::cout << "BitCodec " << name << ": not supported" << std::endl;
+      continue;
+    }
+    int mismatches = checkCodec(name);
+    std::cout << "BitCodec " << name << ": " << (mismatches == 0 ? "ok" : std::to_string(mismatches) + " mismatches") << std::endl;
+    failures += mismatches;
+  }
+  BitCodec::select(picked);
+
+  return failures == 0 ? 0 : 1;
 }
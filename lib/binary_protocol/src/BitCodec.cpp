@@ -0,0 +1,218 @@
+#include "BitCodec.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <immintrin.h>
+  #define BIT_CODEC_X86
+#endif
+
+namespace {
+
+struct Kernels {
+  void (*pack)(const char *, size_t, char *);
+  bool (*unpack)(const char *, size_t, char *);
+  const char *name;
+};
+
+void packScalar(const char *bytes, size_t count, char *bits)
+{
+  for (size_t i = 0; i < count; i++) {
+    unsigned char byte = static_cast<unsigned char>(bytes[i]);
+    for (int j = 0; j < 8; j++)
+      bits[i * 8 + j] = static_cast<char>('0' + ((byte >> (7 - j)) & 1));
+  }
+}
+
+bool unpackScalar(const char *bits, size_t count, char *bytes)
+{
+  unsigned invalid = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned byte = 0;
+    for (int j = 0; j < 8; j++) {
+      unsigned bit = static_cast<unsigned char>(bits[i * 8 + j] - '0');
+      invalid |= bit & ~1u;
+      byte = (byte << 1) | (bit & 1u);
+    }
+    bytes[i] = static_cast<char>(byte);
+  }
+  return invalid == 0;
+}
+
+#ifdef BIT_CODEC_X86
+
+// movemask puts the first character in the lowest bit, the wire format wants it in the highest
+inline uint64_t reverseBitsInBytes(uint64_t x)
+{
+  x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+  x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+  x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  return x;
+}
+
+__attribute__((target("sse2")))
+void packSse2(const char *bytes, size_t count, char *bits)
+{
+  const __m128i weights = _mm_setr_epi8(
+      (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
+      (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01);
+  const __m128i zero = _mm_set1_epi8('0');
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    // Spread every byte over 8 lanes: b0 x8 | b1 x8, b2 x8 | b3 x8, ...
+    __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(bytes + i));
+    x = _mm_unpacklo_epi8(x, x);
+    __m128i lo = _mm_unpacklo_epi16(x, x);
+    __m128i hi = _mm_unpackhi_epi16(x, x);
+    __m128i spread[4] = {
+      _mm_unpacklo_epi32(lo, lo), _mm_unpackhi_epi32(lo, lo),
+      _mm_unpacklo_epi32(hi, hi), _mm_unpackhi_epi32(hi, hi)
+    };
+
+    for (int k = 0; k < 4; k++) {
+      __m128i set = _mm_cmpeq_epi8(_mm_and_si128(spread[k], weights), weights);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(bits + i * 8 + k * 16), _mm_sub_epi8(zero, set));
+    }
+  }
+  packScalar(bytes + i, count - i, bits + i * 8);
+}
+
+__attribute__((target("sse2")))
+bool unpackSse2(const char *bits, size_t count, char *bytes)
+{
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i one = _mm_set1_epi8('1');
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    uint64_t ones = 0;
+    unsigned valid = 0xFFFF;
+
+    for (int k = 0; k < 4; k++) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(bits + i * 8 + k * 16));
+      __m128i isOne = _mm_cmpeq_epi8(v, one);
+      valid &= static_cast<unsigned>(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, zero), isOne)));
+      ones |= static_cast<uint64_t>(static_cast<unsigned>(_mm_movemask_epi8(isOne))) << (k * 16);
+    }
+    if (valid != 0xFFFF)
+      return false;
+    ones = reverseBitsInBytes(ones);
+    std::memcpy(bytes + i, &ones, sizeof(ones));
+  }
+  return unpackScalar(bits + i * 8, count - i, bytes + i);
+}
+
+__attribute__((target("avx2")))
+void packAvx2(const char *bytes, size_t count, char *bits)
+{
+  // vpshufb works per 128-bit lane, the low lane spreads bytes 0-1 and the high lane bytes 2-3
+  const __m256i spreadLow = _mm256_setr_epi8(
+      0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+      2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+  const __m256i spreadHigh = _mm256_setr_epi8(
+      4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+      6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7);
+  const __m256i weights = _mm256_set1_epi64x(0x0102040810204080LL);
+  const __m256i zero = _mm256_set1_epi8('0');
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    int64_t word;
+    std::memcpy(&word, bytes + i, sizeof(word));
+    __m256i x = _mm256_set1_epi64x(word);
+    __m256i first = _mm256_shuffle_epi8(x, spreadLow);
+    __m256i second = _mm256_shuffle_epi8(x, spreadHigh);
+
+    first = _mm256_cmpeq_epi8(_mm256_and_si256(first, weights), weights);
+    second = _mm256_cmpeq_epi8(_mm256_and_si256(second, weights), weights);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bits + i * 8), _mm256_sub_epi8(zero, first));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(bits + i * 8 + 32), _mm256_sub_epi8(zero, second));
+  }
+  packScalar(bytes + i, count - i, bits + i * 8);
+}
+
+__attribute__((target("avx2")))
+bool unpackAvx2(const char *bits, size_t count, char *bytes)
+{
+  const __m256i zero = _mm256_set1_epi8('0');
+  const __m256i one = _mm256_set1_epi8('1');
+  size_t i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    __m256i first = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bits + i * 8));
+    __m256i second = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(bits + i * 8 + 32));
+    __m256i firstOne = _mm256_cmpeq_epi8(first, one);
+    __m256i secondOne = _mm256_cmpeq_epi8(second, one);
+    __m256i valid = _mm256_and_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(first, zero), firstOne),
+        _mm256_or_si256(_mm256_cmpeq_epi8(second, zero), secondOne));
+
+    if (static_cast<unsigned>(_mm256_movemask_epi8(valid)) != 0xFFFFFFFFu)
+      return false;
+    uint64_t ones = static_cast<uint64_t>(static_cast<unsigned>(_mm256_movemask_epi8(firstOne)))
+                  | (static_cast<uint64_t>(static_cast<unsigned>(_mm256_movemask_epi8(secondOne))) << 32);
+    ones = reverseBitsInBytes(ones);
+    std::memcpy(bytes + i, &ones, sizeof(ones));
+  }
+  return unpackScalar(bits + i * 8, count - i, bytes + i);
+}
+
+#endif
+
+Kernels selectKernels()
+{
+#ifdef BIT_CODEC_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return {packAvx2, unpackAvx2, "avx2"};
+  if (__builtin_cpu_supports("sse2"))
+    return {packSse2, unpackSse2, "sse2"};
+#endif
+  return {packScalar, unpackScalar, "scalar"};
+}
+
+Kernels &kernels()
+{
+  static Kernels selected = selectKernels();
+  return selected;
+}
+
+}
+
+void BitCodec::pack(const char *bytes, size_t count, char *bits)
+{
+  kernels().pack(bytes, count, bits);
+}
+
+bool BitCodec::unpack(const char *bits, size_t count, char *bytes)
+{
+  return kernels().unpack(bits, count, bytes);
+}
+
+std::string BitCodec::implementation()
+{
+  return kernels().name;
+}
+
+bool BitCodec::select(const std::string &name)
+{
+  if (name == "scalar") {
+    kernels() = {packScalar, unpackScalar, "scalar"};
+    return true;
+  }
+#ifdef BIT_CODEC_X86
+  __builtin_cpu_init();
+  if (name == "avx2" && __builtin_cpu_supports("avx2")) {
+    kernels() = {packAvx2, unpackAvx2, "avx2"};
+    return true;
+  }
+  if (name == "sse2" && __builtin_cpu_supports("sse2")) {
+    kernels() = {packSse2, unpackSse2, "sse2"};
+    return true;
+  }
+#endif
+  return false;
+}
@@ -3,12 +3,13 @@
 #include <iostream>
 #include <string>
 #include <ctime>
+#include <mutex>
 
 /**
 * @brief Logging class for logging messages with timestamps.
 *
 * This class provides static methods to log messages with different severity levels
-* (info, error, warning) along with a timestamp.
+* (info, error, warning) along with a timestamp. They can be called from several threads.
 */
 class Logging
 {
@@ -19,13 +20,7 @@ class Logging
       */
       static void Log(const std::string& message)
       {
-        time_t now = time(0);
-        char* dt = ctime(&now);
-
-        std::string dateTime(dt);
-        dateTime.pop_back();
-
-        std::cout << "\033[1;34m" << "[" << dateTime << "]: " << "\033[0m" << message << std::endl;
+        _write("\033[1;34m", message);
       }
 
       /**
@@ -34,13 +29,7 @@ class Logging
       */
       static void LogError(const std::string& message)
       {
-        time_t now = time(0);
-        char* dt = ctime(&now);
-
-        std::string dateTime(dt);
-        dateTime.pop_back();
-
-        std::cout << "\033[1;31m" << "[" << dateTime << "]: " << "\033[0m" << message << std::endl;
+        _write("\033[1;31m", message);
       }
 
       /**
@@ -48,15 +37,28 @@ class Logging
       * @param message The message to log.
       */
       static void LogWarning(const std::string& message)
+      {
+        _write("\033[1;33m", message);
+      }
+  private:
+      /**
+      * @brief Writes a line with a timestamp, one thread at a time.
+      * @param color The escape sequence coloring the timestamp.
+      * @param message The message to log.
+      */
+      static void _write(const char *color, const std::string& message)
       {
         time_t now = time(0);
-        char* dt = ctime(&now);
+        char dt[26];
 
+        ctime_r(&now, dt);
         std::string dateTime(dt);
         dateTime.pop_back();
 
-        std::cout << "\033[1;33m" << "[" << dateTime << "]: " << "\033[0m" << message << std::endl;
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::cout << color << "[" << dateTime << "]: " << "\033[0m" << message << std::endl;
       }
-  private:
+
+      inline static std::mutex _mutex; // Serializes the output of the threads
       time_t timestamp; // Timestamp for logging
 };
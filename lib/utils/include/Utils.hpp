@@ -2,6 +2,7 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <sstream>
 #include <ctime>
@@ -28,6 +29,21 @@ class Utils {
       return result;
     }
 
+    /**
+     * @brief Takes the first token of a string, without copying it.
+     * @param s The string, left pointing after the delimiter following the token.
+     * @param delim The delimiter character.
+     * @return The token, a view into s.
+     */
+    static std::string_view nextToken(std::string_view &s, char delim)
+    {
+      size_t end = s.find(delim);
+      std::string_view token = s.substr(0, end);
+
+      s.remove_prefix(end == std::string_view::npos ? s.size() : end + 1);
+      return token;
+    }
+
     /**
      * @brief Joins a vector of strings into a single string with a delimiter.
      * @param v The vector of strings to join.
@@ -2,8 +2,10 @@
 #include "BinaryProtocol.hpp"
 #include "Logging.hpp"
 
+#include <charconv>
+
 Client::Client(const std::string &serverIp, unsigned short port, const std::string &title)
-    : _serverIp(serverIp), _port(port), _running(true), _message(NULL), _windowInitialized(false)
+    : _serverIp(serverIp), _port(port), _running(true), _windowInitialized(false), _message(NULL), _protocolVersion(PROTOCOL_V2), _presenceVersion(0)
 {
 #ifdef _WIN32
     WSAStartup(MAKEWORD(2, 2), &_wsa);
@@ -56,7 +58,8 @@ Client::Client(const std::string &serverIp, unsigned short port, const std::stri
       Logging::Log("Connected to server!");
       // Send login message
       login();
-      std::string loginMessage = BinaryProtocol::encode(_username, LOGIN);
+      // The server answers in the format of the LOGIN message, this negotiates the protocol version
+      std::string loginMessage = BinaryProtocol::encode(_username, LOGIN, _protocolVersion);
       send(_socket, loginMessage.c_str(), loginMessage.size(), 0);
       Logging::Log("Login message sent!");
       break;
@@ -154,11 +157,28 @@ Client::~Client()
 
 void Client::sendMessage(const std::string &message)
 {
-  std::string messageType = (message[0] == '/') ? COMMAND_MESSAGE : SIMPLE_MESSAGE;
-  std::string binaryMessage = BinaryProtocol::encode((messageType == SIMPLE_MESSAGE) ? std::string("/msg ") + std::to_string(0) + " " + message : message, messageType);
-
   if (message.empty())
     return;
+
+  std::string messageType = (message[0] == '/') ? COMMAND_MESSAGE : SIMPLE_MESSAGE;
+  std::string payload = (messageType == SIMPLE_MESSAGE) ? std::string("/msg ") + std::to_string(0) + " " + message : message;
+
+  // Channel commands: "/join <channel>", "/part <channel>" or "/leave <channel>", "/msg <#channel> <message>",
+  // and "/msg <name> <message>" for a private message
+  if (message.rfind("/join ", 0) == 0) {
+    messageType = JOIN_CHANNEL;
+    payload = message.substr(6);
+  } else if (message.rfind("/part ", 0) == 0 || message.rfind("/leave ", 0) == 0) {
+    messageType = LEAVE_CHANNEL;
+    payload = message.substr(message.find(' ') + 1);
+  } else if (message.rfind("/msg #", 0) == 0) {
+    messageType = SIMPLE_MESSAGE;
+  } else if (message.rfind("/msg ", 0) == 0) {
+    messageType = PRIVATE_MESSAGE;
+    payload = message.substr(5);
+  }
+
+  std::string binaryMessage = BinaryProtocol::encode(payload, messageType, _protocolVersion);
   send(_socket, binaryMessage.c_str(), binaryMessage.size(), 0);
 }
 
@@ -190,6 +210,68 @@ void Client::_displayConnectedUsers(const std::string &message, const std::strin
   }, Qt::QueuedConnection);
 }
 
+/**
+ * @brief Read a presence version, the whole field being a number.
+ * @param field The field.
+ * @param version The version read.
+ * @return false if the field is not a number.
+ */
+static bool parseVersion(const std::string &field, uint64_t &version)
+{
+  auto [end, error] = std::from_chars(field.data(), field.data() + field.size(), version);
+  return error == std::errc() && end == field.data() + field.size();
+}
+
+void Client::_applyPresence(const std::string &message)
+{
+  std::vector<std::string> fields = Utils::split(message, ',');
+  uint64_t base = 0;
+  uint64_t version = 0;
+
+  // Read on the receive thread, an invalid message must not throw: the list is asked again
+  if (fields.size() < 2 || !parseVersion(fields[0], base) || !parseVersion(fields[1], version)) {
+    Logging::LogWarning("Invalid presence message, asking for the list of users");
+    _requestPresence();
+    return;
+  }
+
+  // A base of 0 is a snapshot, otherwise the changes follow base
+  if (base == 0) {
+    _users.clear();
+    _presenceVersion = 0;
+  } else if (base > _presenceVersion) {
+    Logging::LogWarning("Missed presence changes, asking for the list of users");
+    _requestPresence();
+    return;
+  }
+  if (version <= _presenceVersion)
+    return;
+
+  // Skip the changes already applied
+  size_t first = 2 + ((base == 0) ? 0 : _presenceVersion - base);
+  for (size_t i = first; i < fields.size(); i++) {
+    const std::string &change = fields[i];
+    if (change.empty())
+      continue;
+    if (change[0] == '+') {
+      _users.push_back(change.substr(1));
+    } else if (change[0] == '-') {
+      _users.erase(std::remove(_users.begin(), _users.end(), change.substr(1)), _users.end());
+    } else if (change[0] == '~') {
+      size_t arrow = change.find('>');
+      std::replace(_users.begin(), _users.end(), change.substr(1, arrow - 1), change.substr(arrow + 1));
+    }
+  }
+  _presenceVersion = version;
+  _displayConnectedUsers(Utils::join(_users, ","), LIST_USERS);
+}
+
+void Client::_requestPresence()
+{
+  std::string presenceMessage = BinaryProtocol::encode("", PRESENCE, _protocolVersion);
+  send(_socket, presenceMessage.c_str(), presenceMessage.size(), 0);
+}
+
 void Client::onUserClick(QListWidgetItem *item)
 {
   if (item == nullptr) {
@@ -203,7 +285,7 @@ void Client::onUserClick(QListWidgetItem *item)
   _currentPrivateUser = new char[cmd.size() + 1];
   memcpy(_currentPrivateUser, cmd.c_str(), cmd.size());
 
-  std::string encodedCmd = BinaryProtocol::encode(cmd, SIMPLE_MESSAGE);
+  std::string encodedCmd = BinaryProtocol::encode(cmd, SIMPLE_MESSAGE, _protocolVersion);
   send(_socket, encodedCmd.c_str(), encodedCmd.size(), 0);
 
   Logging::Log("Private message sent to: " + item->text().toStdString());
@@ -226,35 +308,65 @@ void Client::receiveMessage()
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
 
   while (_running) {
-    _message = new char[1024];
-    memset(buffer, 0, sizeof(buffer));
-    int bytesReceived = recv(_socket, buffer, sizeof(buffer) - 1, 0);
-    std::string header = BinaryProtocol::getHeader(buffer);
-    std::string message = BinaryProtocol::decode(buffer);
+    int bytesReceived = recv(_socket, buffer, sizeof(buffer), 0);
 
     if (bytesReceived == 0) {
       Logging::LogError("Server closed the connection");
       _running = false;
       break;
     }
+    if (bytesReceived < 0)
+      continue;
+
+    // v2 messages contain NUL bytes, so the buffer must not be read as a C string
+    std::string data(buffer, bytesReceived);
+    try {
+      processIncomingData(data);
+    } catch (FrameBuffer::FrameBufferException &e) {
+      Logging::LogError(std::string("Invalid message from the server: ") + e.what());
+      _running = false;
+      break;
+    }
+  }
+}
+
+void Client::processIncomingData(std::string &buffer)
+{
+  Frame frame;
+  std::string payload;
+
+  // A read can hold several messages, or only a part of one
+  _readBuffer.append(buffer.data(), buffer.size());
+  while (_readBuffer.next(frame)) {
+    if (!BinaryProtocol::unpack(frame, payload))
+      continue;
+
+    std::string header = BinaryProtocol::toHeader(frame.type);
+    std::string message(frame.payload);
 
     if (header == LOGIN) {
       _username = message;
       Logging::Log("Logged in as: " + _username);
-      // send to serv
-      std::string loginMessage = BinaryProtocol::encode("", LIST_USERS);
-      send(_socket, loginMessage.c_str(), loginMessage.size(), 0);
+      _requestPresence();
     } else if (header == LIST_USERS) {
       _displayConnectedUsers(message, header);
+    } else if (header == PRESENCE) {
+      _applyPresence(message);
     } else if (header == SIMPLE_MESSAGE) {
       QMetaObject::invokeMethod(_chatContentEdit, [this, message]() {
           _chatContentEdit->append(QString::fromStdString(message));
       }, Qt::QueuedConnection);
     } else if (header == COMMAND_MESSAGE) {
       _displayMessage(message);
+    } else if (header == PING) {
+      // The server disconnects the clients that stay silent
+      std::string pongMessage = BinaryProtocol::encode(message, PONG, _protocolVersion);
+      send(_socket, pongMessage.c_str(), pongMessage.size(), 0);
+    } else if (header == RATE_LIMITED) {
+      QMetaObject::invokeMethod(_chatContentEdit, [this]() {
+          _chatContentEdit->append("You are sending too fast, some messages were dropped");
+      }, Qt::QueuedConnection);
     }
-    delete[] _message;
-    _message = NULL;
   }
 }
 
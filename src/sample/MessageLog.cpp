@@ -0,0 +1,178 @@
+#include "MessageLog.hpp"
+
+#include <filesystem>
+#include <fstream>
+#include <algorithm>
+#include <csignal>
+#include <iostream>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#define SAMPLE_SEGMENT_SIZE 400 // Bytes of a segment, small enough for a few records each
+
+/**
+ * @brief Recovered
+ * The records a log observed while opening, and the sequence number it continues from.
+ */
+struct Recovered {
+  std::vector<uint64_t> sequences; // Sequence numbers of the records recovered, in order
+  std::vector<std::string> texts; // Texts of the records recovered
+  uint64_t next = 0; // Sequence number of the next record appended
+};
+
+/**
+ * @brief reopen
+ * This function opens the log of a directory, appends some records, and closes it.
+ * @param directory The directory of the segments.
+ * @param appended The number of records appended after the recovery.
+ * @return The records recovered.
+ */
+static Recovered reopen(const std::string &directory, int appended)
+{
+  MessageLog log(directory, SAMPLE_SEGMENT_SIZE, MessageLog::Sync::Batch, 0, 1 << 20, []() {});
+  Recovered recovered;
+
+  log.observe([&recovered](const MessageLog::RecordView &record, uint64_t, uint64_t) {
+    recovered.sequences.push_back(record.sequence);
+    recovered.texts.emplace_back(record.text);
+  });
+  log.open();
+  recovered.next = log.nextSequence();
+  // The writer thread observes the records appended below, once they are written
+  size_t count = recovered.sequences.size();
+  for (int i = 0; i < appended; i++) {
+    MessageLog::Record record;
+    record.kind = MessageLog::Kind::Channel;
+    record.sender = "sample";
+    record.target = "#room";
+    record.text = "message " + std::to_string(recovered.next + i);
+    log.append(record);
+  }
+  log.close();
+  recovered.sequences.resize(count);
+  recovered.texts.resize(count);
+  return recovered;
+}
+
+/**
+ * @brief check
+ * This function prints the result of a check.
+ * @param what The property checked.
+ * @param ok true if it holds.
+ * @return ok.
+ */
+static bool check(const std::string &what, bool ok)
+{
+  std::cout << (ok ? "ok: " : "FAILED: ") << what << std::endl;
+  return ok;
+}
+
+/**
+ * @brief contiguous
+ * This function checks that the records recovered are numbered from 1, without a gap,
+ * and carry the text they were appended with.
+ * @param recovered The records recovered.
+ * @param count The number of records expected.
+ * @return true if they match.
+ */
+static bool contiguous(const Recovered &recovered, uint64_t count)
+{
+  if (recovered.sequences.size() != count || recovered.next != count + 1)
+    return false;
+  for (uint64_t i = 0; i < count; i++) {
+    if (recovered.sequences[i] != i + 1 || recovered.texts[i] != "message " + std::to_string(i + 1))
+      return false;
+  }
+  return true;
+}
+
+int main(void)
+{
+  std::string directory = std::filesystem::temp_directory_path() / ("message_log_sample_" + std::to_string(getpid()) + "/");
+  std::filesystem::remove_all(directory);
+  bool ok = true;
+
+  // Records survive a close, spread over several segments
+  reopen(directory, 40);
+  MessageLog log(directory, SAMPLE_SEGMENT_SIZE, MessageLog::Sync::Batch, 0, 1 << 20, []() {});
+  std::error_code error;
+  std::vector<uint64_t> segments = log.segments(error);
+  ok &= check("the records fill " + std::to_string(segments.size()) + " segments", !error && segments.size() > 3);
+  ok &= check("every record is recovered, in order", contiguous(reopen(directory, 0), 40));
+
+  // A record cut by a crash ends the log, and its segment is truncated before it
+  std::string last = log.segmentPath(segments.back());
+  uintmax_t size = std::filesystem::file_size(last);
+  std::filesystem::resize_file(last, size - 5);
+  Recovered torn = reopen(directory, 1);
+  ok &= check("a torn record is dropped", contiguous(torn, 39));
+  ok &= check("the next record takes its sequence number", contiguous(reopen(directory, 0), 40));
+
+  // A checksum failure in an older segment drops everything after it, the later segments too
+  std::string middle = log.segmentPath(segments[1]);
+  {
+    std::fstream file(middle, std::ios::in | std::ios::out | std::ios::binary);
+    file.seekg(MESSAGE_LOG_HEADER_SIZE + 30);
+    char byte = static_cast<char>(file.get() ^ 0x20);
+    file.seekp(MESSAGE_LOG_HEADER_SIZE + 30);
+    file.put(byte);
+  }
+  Recovered corrupted = reopen(directory, 0);
+  uint64_t kept = corrupted.sequences.size();
+  ok &= check("a corrupted record ends the log", kept > 0 && kept < 40 && contiguous(corrupted, kept));
+  ok &= check("its segment is truncated before it", std::filesystem::file_size(middle) == 0);
+  ok &= check("the later segments are removed", log.segments(error).back() == segments[1]);
+  ok &= check("the log goes on after the truncation", contiguous(reopen(directory, 3), kept) && contiguous(reopen(directory, 0), kept + 3));
+
+  // A record too large to be read back is refused, without taking a sequence number
+  {
+    MessageLog large(directory, SAMPLE_SEGMENT_SIZE, MessageLog::Sync::Batch, 0, 1 << 20, []() {});
+    large.open();
+    MessageLog::Record record;
+    record.sender = "sample";
+    record.text.assign(MESSAGE_LOG_MAX_RECORD, 'x');
+    bool refused = !large.append(record);
+    ok &= check("a record larger than MESSAGE_LOG_MAX_RECORD is refused", refused && large.nextSequence() == kept + 4);
+  }
+
+  // A record that cannot be written is dropped, the records before it and after it are kept
+  std::filesystem::remove_all(directory);
+  {
+    MessageLog limited(directory, SAMPLE_SEGMENT_SIZE, MessageLog::Sync::Batch, 0, 1 << 20, []() {});
+    limited.open();
+    struct rlimit unlimited;
+    getrlimit(RLIMIT_FSIZE, &unlimited);
+    struct rlimit small = unlimited;
+    small.rlim_cur = SAMPLE_SEGMENT_SIZE / 2;
+    signal(SIGXFSZ, SIG_IGN);
+    setrlimit(RLIMIT_FSIZE, &small);
+    // The writes beyond the limit fail, so every segment loses its records past the first half
+    std::vector<bool> written;
+    for (int i = 1; i <= 20; i++) {
+      MessageLog::Record record;
+      record.kind = MessageLog::Kind::Channel;
+      record.sender = "sample";
+      record.target = "#room";
+      record.text = "message " + std::to_string(i);
+      limited.append(record);
+      written.push_back(limited.waitWritten(record.sequence + 1));
+    }
+    setrlimit(RLIMIT_FSIZE, &unlimited);
+    limited.close();
+
+    // Records 1 to first are written, the next one is not, and waitWritten() fails from then on
+    size_t first = std::find(written.begin(), written.end(), false) - written.begin();
+    bool reported = first > 0 && first < written.size() && std::find(written.begin() + first, written.end(), true) == written.end();
+    Recovered recovered = reopen(directory, 0);
+    bool kept = recovered.sequences.size() > first + 1 && recovered.next == recovered.sequences.back() + 1;
+    for (size_t i = 0; kept && i < recovered.sequences.size(); i++) {
+      uint64_t sequence = recovered.sequences[i];
+      kept = (i < first) ? sequence == i + 1 : sequence > first + 1 && sequence > recovered.sequences[i - 1];
+      kept = kept && recovered.texts[i] == "message " + std::to_string(sequence);
+    }
+    ok &= check("a record that cannot be written is dropped and reported, the log goes on", reported && kept && recovered.sequences.size() < 20);
+  }
+
+  std::filesystem::remove_all(directory);
+  return ok ? 0 : 1;
+}
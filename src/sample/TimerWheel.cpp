@@ -0,0 +1,98 @@
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <random>
+
+/**
+ * @brief checkWheel
+ * This function arms, cancels and expires random timers, from a tick to beyond the last
+ * level, and compares the wheel with a sorted map of the deadlines after every advance().
+ * @param seed The seed of the random operations.
+ * @return false at the first difference.
+ */
+static bool checkWheel(uint64_t seed)
+{
+  std::mt19937_64 random(seed);
+  uint64_t now = random() % 1000000;
+  TimerWheel wheel(now);
+  std::map<int, uint64_t> deadlines; // Tick at which every armed timer expires, by id
+
+  for (int step = 0; step < 3000; step++) {
+    int id = random() % 50;
+
+    switch (random() % 4) {
+      case 0: {
+        // Mostly short timers, some cascading down from the upper levels
+        uint64_t deadline = now + ((random() % 3 == 0) ? random() % 600000 : random() % 5000);
+        wheel.arm(id, deadline);
+        deadlines[id] = std::max<uint64_t>((deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS, now / TIMER_TICK_MS + 1);
+        break;
+      }
+      case 1:
+        wheel.cancel(id);
+        deadlines.erase(id);
+        break;
+      default: {
+        int timeout = wheel.timeout(now);
+        now += (timeout >= 0 && random() % 2) ? timeout : random() % 3000;
+
+        std::vector<int> expired;
+        wheel.advance(now, expired);
+        std::vector<int> expected;
+        for (auto deadline = deadlines.begin(); deadline != deadlines.end(); ) {
+          if (deadline->second <= now / TIMER_TICK_MS) {
+            expected.push_back(deadline->first);
+            deadline = deadlines.erase(deadline);
+          } else {
+            ++deadline;
+          }
+        }
+        std::sort(expired.begin(), expired.end());
+        if (expired != expected) {
+          std::cout << "Seed " << seed << ", step " << step << ": " << expired.size() << " timers expired, " << expected.size() << " expected" << std::endl;
+          return false;
+        }
+
+        // Waiting for timeout() never oversleeps the next deadline
+        if (!deadlines.empty()) {
+          uint64_t next = UINT64_MAX;
+          for (const auto &deadline : deadlines)
+            next = std::min(next, deadline.second * TIMER_TICK_MS);
+          timeout = wheel.timeout(now);
+          if (timeout < 0 || now + timeout > next) {
+            std::cout << "Seed " << seed << ", step " << step << ": timeout " << timeout << " beyond the next deadline" << std::endl;
+            return false;
+          }
+        }
+        for (int other = 0; other < 50; other++) {
+          if (wheel.armed(other) != (deadlines.count(other) > 0)) {
+            std::cout << "Seed " << seed << ", step " << step << ": timer " << other << " armed state differs" << std::endl;
+            return false;
+          }
+        }
+      }
+    }
+  }
+  return true;
+}
+
+int main(void)
+{
+  TimerWheel wheel(0);
+  std::vector<int> expired;
+
+  wheel.arm(3, 250);
+  wheel.arm(4, 90000);
+  std::cout << "Next timer in " << wheel.timeout(0) << " ms" << std::endl;
+  wheel.advance(300, expired);
+  std::cout << "Expired at 300 ms: " << expired.size() << " (armed: 3 " << wheel.armed(3) << ", 4 " << wheel.armed(4) << ")" << std::endl;
+
+  for (uint64_t seed = 0; seed < 200; seed++) {
+    if (!checkWheel(seed))
+      return 1;
+  }
+  std::cout << "TimerWheel: ok" << std::endl;
+  return 0;
+}
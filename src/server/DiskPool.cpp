@@ -0,0 +1,59 @@
+#include "DiskPool.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <exception>
+
+DiskPool::DiskPool(size_t workers, size_t capacity, std::function<void()> onRoom)
+  : _workerCount(std::max<size_t>(1, workers)), _capacity(std::max<size_t>(1, capacity)), _onRoom(std::move(onRoom)), _stopping(false)
+{
+}
+
+DiskPool::~DiskPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _ready.notify_all();
+  for (auto &worker : _workers)
+    worker.join();
+}
+
+bool DiskPool::submit(std::function<void()> &work)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_tasks.size() >= _capacity)
+      return false;
+    _tasks.push_back(std::move(work));
+    while (_workers.size() < _workerCount)
+      _workers.emplace_back(&DiskPool::_run, this);
+  }
+  _ready.notify_one();
+  return true;
+}
+
+void DiskPool::_run()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (true) {
+    _ready.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+    if (_tasks.empty())
+      return;
+    bool wasFull = _tasks.size() >= _capacity;
+    std::function<void()> work = std::move(_tasks.front());
+    _tasks.pop_front();
+    lock.unlock();
+    // The tasks refused meanwhile are submitted again by their shards
+    if (wasFull && _onRoom)
+      _onRoom();
+    try {
+      work();
+    } catch (std::exception &e) {
+      Logging::LogError(std::string("Disk task failed: ") + e.what());
+    }
+    lock.lock();
+  }
+}
@@ -0,0 +1,341 @@
+#include "EpollLoop.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+EpollLoop::EpollLoop(Handler &handler)
+  : _handler(handler), _paused(false), _events(EPOLL_MAX_EVENTS), _buffer(READ_CHUNK_SIZE), _iov(SEND_BATCH_SIZE)
+{
+  _epoll = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll == -1)
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": ") + strerror(errno));
+
+  struct epoll_event event = {};
+  _wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = static_cast<uint32_t>(_wakeFd);
+  if (_wakeFd == -1 || epoll_ctl(_epoll, EPOLL_CTL_ADD, _wakeFd, &event) == -1) {
+    int error = errno;
+    close(_epoll);
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": ") + strerror(error));
+  }
+}
+
+EpollLoop::~EpollLoop()
+{
+  close(_wakeFd);
+  close(_epoll);
+}
+
+uint64_t EpollLoop::_tag(int fd) const
+{
+  return (static_cast<uint64_t>(_generations[fd]) << 32) | static_cast<uint32_t>(fd);
+}
+
+void EpollLoop::listen(int socket)
+{
+  struct epoll_event event = {};
+
+  _listeners.push_back(socket);
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = static_cast<uint32_t>(socket);
+  if (epoll_ctl(_epoll, EPOLL_CTL_ADD, socket, &event) == -1)
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": ") + strerror(errno));
+}
+
+void EpollLoop::add(int client)
+{
+  struct epoll_event event = {};
+
+  if (static_cast<size_t>(client) >= _generations.size()) {
+    _generations.resize(client + 1, 0);
+    _connections.resize(client + 1);
+  }
+  _connections[client].registered = true;
+
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.u64 = _tag(client);
+  if (epoll_ctl(_epoll, EPOLL_CTL_ADD, client, &event) == -1)
+    Logging::LogError("Failed to register client " + std::to_string(client) + ": " + strerror(errno));
+}
+
+void EpollLoop::share(int client, const std::shared_ptr<SharedChannel> &channel)
+{
+  struct epoll_event event = {};
+
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered)
+    return;
+  _connections[client].shared = channel;
+  event.events = EPOLLIN | EPOLLET;
+  event.data.u64 = _tag(client) | SHARED_EVENT;
+  if (epoll_ctl(_epoll, EPOLL_CTL_ADD, channel->signal(), &event) == -1)
+    Logging::LogError("Failed to register the channel of client " + std::to_string(client) + ": " + strerror(errno));
+  channel->resume();
+}
+
+void EpollLoop::_unshare(int client)
+{
+  Connection &connection = _connections[client];
+
+  // The descriptor may stay open elsewhere (handed off), remove it explicitly
+  if (connection.shared)
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, connection.shared->signal(), nullptr);
+  connection.shared.reset();
+}
+
+void EpollLoop::remove(int client)
+{
+  epoll_ctl(_epoll, EPOLL_CTL_DEL, client, nullptr);
+  if (static_cast<size_t>(client) >= _generations.size())
+    return;
+  _generations[client]++;
+  _unshare(client);
+
+  // The client stays in _dirty if it is there, flush skips it as it is no longer registered
+  Connection &connection = _connections[client];
+  connection.registered = false;
+  connection.sent = 0;
+  connection.pending = 0;
+  connection.outbound.clear();
+}
+
+void EpollLoop::pause()
+{
+  // Reading only happens in poll, nothing is read once the flag is set
+  for (int listener : _listeners)
+    epoll_ctl(_epoll, EPOLL_CTL_DEL, listener, nullptr);
+  _paused = true;
+}
+
+std::string EpollLoop::detach(int client)
+{
+  std::string unsent;
+
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered)
+    return unsent;
+
+  Connection &connection = _connections[client];
+  unsent.reserve(connection.pending);
+  for (size_t i = 0; i < connection.outbound.size(); i++)
+    unsent.append(*connection.outbound[i], (i == 0) ? connection.sent : 0, std::string::npos);
+  remove(client);
+  return unsent;
+}
+
+void EpollLoop::send(int client, const Buffer &data)
+{
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered || data->empty())
+    return;
+
+  Connection &connection = _connections[client];
+  connection.outbound.push_back(data);
+  connection.pending += data->size();
+  if (!connection.dirty) {
+    connection.dirty = true;
+    _dirty.push_back(client);
+  }
+}
+
+void EpollLoop::flush()
+{
+  // _write calls the handler, which may queue more bytes: swap the list out first
+  std::vector<int> dirty;
+
+  dirty.swap(_dirty);
+  for (int client : dirty) {
+    _connections[client].dirty = false;
+    if (_connections[client].registered)
+      _write(client);
+  }
+  // Keep the capacity of the list, unless the handler queued bytes meanwhile
+  dirty.clear();
+  if (_dirty.empty())
+    _dirty.swap(dirty);
+}
+
+size_t EpollLoop::pending(int client) const
+{
+  if (static_cast<size_t>(client) >= _connections.size())
+    return 0;
+  return _connections[client].pending;
+}
+
+void EpollLoop::wake()
+{
+  uint64_t one = 1;
+
+  if (write(_wakeFd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    Logging::LogError("Failed to wake the event loop: " + std::string(strerror(errno)));
+}
+
+void EpollLoop::poll(int timeout)
+{
+  int ready = epoll_wait(_epoll, _events.data(), _events.size(), timeout);
+
+  if (ready == -1) {
+    if (errno == EINTR)
+      return;
+    throw EventLoopException(EVENT_LOOP_WAIT_FAILED + std::string(": ") + strerror(errno));
+  }
+
+  for (int i = 0; i < ready; i++) {
+    int fd = static_cast<int>(_events[i].data.u64 & (SHARED_EVENT - 1));
+    bool shared = _events[i].data.u64 & SHARED_EVENT;
+
+    if (std::find(_listeners.begin(), _listeners.end(), fd) != _listeners.end()) {
+      if (!_paused)
+        _accept(fd);
+    } else if (fd == _wakeFd) {
+      uint64_t count;
+      while (read(_wakeFd, &count, sizeof(count)) > 0)
+        ;
+      _handler.onWake();
+    } else if (shared && static_cast<size_t>(fd) < _generations.size() && (_events[i].data.u64 & ~SHARED_EVENT) == _tag(fd)) {
+      // The client wrote to its ring, or made room in the ring of the server
+      if (!_paused)
+        _readShared(fd);
+      if (_events[i].data.u64 == (_tag(fd) | SHARED_EVENT) && _connections[fd].shared)
+        _write(fd);
+    } else if (static_cast<size_t>(fd) < _generations.size() && _events[i].data.u64 == _tag(fd)) {
+      if ((_events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !_paused)
+        _read(fd);
+      // Reading may have removed the client
+      if ((_events[i].events & EPOLLOUT) && _events[i].data.u64 == _tag(fd))
+        _write(fd);
+    }
+  }
+}
+
+void EpollLoop::_accept(int listener)
+{
+  while (true) {
+    int client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (client == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        _handler.onAcceptError(errno);
+      return;
+    }
+
+    _handler.onAccept(client);
+  }
+}
+
+void EpollLoop::_read(int client)
+{
+  while (true) {
+    ssize_t result = read(client, _buffer.data(), _buffer.size());
+
+    if (result > 0) {
+      if (!_handler.onData(client, _buffer.data(), result))
+        return;
+    } else if (result == 0) {
+      _handler.onClose(client);
+      return;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return;
+    } else if (errno != EINTR) {
+      _handler.onClose(client);
+      return;
+    }
+  }
+}
+
+void EpollLoop::_readShared(int client)
+{
+  // The handler may remove the client, which releases its reference
+  std::shared_ptr<SharedChannel> channel = _connections[client].shared;
+
+  channel->clearSignal();
+  while (true) {
+    size_t result = channel->read(_buffer.data(), _buffer.size());
+
+    if (result > 0) {
+      if (!_handler.onData(client, _buffer.data(), result))
+        return;
+    } else if (channel->sleep()) {
+      return;
+    }
+  }
+}
+
+void EpollLoop::_writeShared(int client)
+{
+  Connection &connection = _connections[client];
+  size_t pending = connection.pending;
+
+  while (!connection.outbound.empty()) {
+    const std::string &data = *connection.outbound.front();
+    size_t written = connection.shared->write(data.data() + connection.sent, data.size() - connection.sent);
+
+    connection.pending -= written;
+    connection.sent += written;
+    if (connection.sent < data.size())
+      break;
+    connection.outbound.pop_front();
+    connection.sent = 0;
+  }
+  if (connection.pending != pending)
+    connection.shared->notify();
+  _handler.onFlushed(client);
+}
+
+void EpollLoop::_write(int client)
+{
+  Connection &connection = _connections[client];
+
+  if (connection.shared) {
+    _writeShared(client);
+    return;
+  }
+  while (!connection.outbound.empty()) {
+    size_t count = std::min<size_t>(connection.outbound.size(), _iov.size());
+
+    for (size_t i = 0; i < count; i++) {
+      const std::string &data = *connection.outbound[i];
+      size_t offset = (i == 0) ? connection.sent : 0;
+      _iov[i].iov_base = const_cast<char *>(data.data() + offset);
+      _iov[i].iov_len = data.size() - offset;
+    }
+
+    struct msghdr message = {};
+    message.msg_iov = _iov.data();
+    message.msg_iovlen = count;
+
+    // sendmsg rather than writev, for MSG_NOSIGNAL
+    ssize_t result = ::sendmsg(client, &message, MSG_NOSIGNAL);
+
+    if (result >= 0) {
+      size_t written = result;
+      connection.pending -= written;
+      // Drop the buffers written entirely, and remember how much of the next one was
+      while (written > 0) {
+        size_t left = connection.outbound.front()->size() - connection.sent;
+        if (written < left) {
+          connection.sent += written;
+          break;
+        }
+        written -= left;
+        connection.outbound.pop_front();
+        connection.sent = 0;
+      }
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      // The connection is broken, reading it reports the close
+      connection.outbound.clear();
+      connection.sent = 0;
+      connection.pending = 0;
+      return;
+    }
+  }
+  _handler.onFlushed(client);
+}
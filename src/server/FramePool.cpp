@@ -0,0 +1,59 @@
+#include "FramePool.hpp"
+
+#include <new>
+
+namespace {
+
+// Class n holds the frames of (n, n + 1] granules, FRAME_POOL_CLASSES for the larger ones
+size_t sizeClass(size_t size)
+{
+  return (size == 0) ? 0 : (size - 1) / FRAME_POOL_GRANULE;
+}
+
+}
+
+thread_local FramePool::Lists FramePool::_lists;
+
+void *FramePool::allocate(size_t size)
+{
+  size_t index = sizeClass(size);
+
+  if (index >= FRAME_POOL_CLASSES)
+    return ::operator new(size);
+  FreeList &list = _lists.classes[index];
+  if (list.head == nullptr)
+    return ::operator new((index + 1) * FRAME_POOL_GRANULE);
+  Block *block = list.head;
+  list.head = block->next;
+  list.count--;
+  return block;
+}
+
+void FramePool::deallocate(void *frame, size_t size) noexcept
+{
+  size_t index = sizeClass(size);
+
+  if (index >= FRAME_POOL_CLASSES) {
+    ::operator delete(frame);
+    return;
+  }
+  FreeList &list = _lists.classes[index];
+  if (list.count >= FRAME_POOL_KEEP) {
+    ::operator delete(frame);
+    return;
+  }
+  list.head = new (frame) Block{list.head};
+  list.count++;
+}
+
+FramePool::Lists::~Lists()
+{
+  for (FreeList &list : classes) {
+    while (list.head != nullptr) {
+      Block *block = list.head;
+      list.head = block->next;
+      ::operator delete(block);
+    }
+    list.count = 0;
+  }
+}
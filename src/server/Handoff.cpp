@@ -0,0 +1,348 @@
+#include "Handoff.hpp"
+#include "Server.hpp"
+#include "Logging.hpp"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+/**
+ * Counts the shards done with a step, and lets the handoff thread wait for all of them.
+ */
+class Latch {
+  public:
+    Latch(size_t count) : _count(count) {}
+
+    void arrive()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (--_count == 0)
+        _done.notify_all();
+    }
+
+    void wait()
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _done.wait(lock, [this]() { return _count == 0; });
+    }
+
+  private:
+    std::mutex _mutex;
+    std::condition_variable _done;
+    size_t _count;
+};
+
+void putInteger(std::string &out, uint64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    out += static_cast<char>((value >> (8 * (size - 1 - i))) & 0xFF);
+}
+
+void putString(std::string &out, const std::string &value)
+{
+  putInteger(out, value.size(), 4);
+  out += value;
+}
+
+/**
+ * Reads the fields of a serialized state, failing on truncated data.
+ */
+class Reader {
+  public:
+    Reader(const std::string &data) : _data(data), _offset(0) {}
+
+    uint64_t integer(size_t size)
+    {
+      uint64_t value = 0;
+
+      _need(size);
+      for (size_t i = 0; i < size; i++)
+        value = (value << 8) | static_cast<uint8_t>(_data[_offset++]);
+      return value;
+    }
+
+    std::string string()
+    {
+      size_t size = integer(4);
+
+      _need(size);
+      _offset += size;
+      return _data.substr(_offset - size, size);
+    }
+
+  private:
+    void _need(size_t size)
+    {
+      if (_data.size() - _offset < size)
+        throw Handoff::HandoffException(HANDOFF_FAILED + std::string(": truncated state"));
+    }
+
+    const std::string &_data;
+    size_t _offset;
+};
+
+struct sockaddr_un unixAddress(const std::string &path)
+{
+  struct sockaddr_un address = {};
+
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+  return address;
+}
+
+}
+
+int Handoff::_listen(const std::string &path)
+{
+  struct sockaddr_un address = unixAddress(path);
+  int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (listener == -1)
+    return -1;
+  unlink(path.c_str());
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || ::listen(listener, 1) == -1) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+int Handoff::connect(const std::string &path)
+{
+  struct sockaddr_un address = unixAddress(path);
+  int predecessor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (predecessor == -1)
+    return -1;
+  if (::connect(predecessor, (struct sockaddr *)&address, sizeof(address)) == -1) {
+    close(predecessor);
+    return -1;
+  }
+  return predecessor;
+}
+
+void Handoff::serve(const std::string &path, ShardGroup &group)
+{
+  int listener = _listen(path);
+  int successor = -1;
+
+  if (listener == -1) {
+    Logging::LogError("Failed to listen for a handoff on " + path + ": " + strerror(errno));
+    return;
+  }
+  Logging::Log("Waiting for a handoff on " + path);
+  while ((successor = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) == -1) {
+    if (errno != EINTR && errno != ECONNABORTED) {
+      Logging::LogError("Failed to accept a handoff: " + std::string(strerror(errno)));
+      close(listener);
+      return;
+    }
+  }
+  close(listener);
+  Logging::Log("Handing the sessions off to a new process");
+
+  // Every shard stops reading before any of them exports its sessions, so the messages
+  // posted between shards are all delivered before the sessions are taken
+  State state;
+  std::mutex mutex;
+  Latch paused(group.size());
+  Latch exported(group.size());
+
+  for (size_t shard = 0; shard < group.size(); shard++)
+    group.post(shard, [&paused](Server &server) { server.pause(); paused.arrive(); });
+  paused.wait();
+  group.names(state.presenceVersion);
+  for (size_t shard = 0; shard < group.size(); shard++) {
+    group.post(shard, [&](Server &server) {
+      State part;
+      server.handOff(part);
+      std::lock_guard<std::mutex> lock(mutex);
+      state.listeners.insert(state.listeners.end(), part.listeners.begin(), part.listeners.end());
+      if (part.localListener != -1)
+        state.localListener = part.localListener;
+      for (auto &session : part.sessions)
+        state.sessions.push_back(std::move(session));
+      exported.arrive();
+    });
+  }
+  exported.wait();
+  // The sessions are paused, the new process recovers a log nobody appends to anymore
+  group.closeLog();
+
+  try {
+    send(successor, state);
+    Logging::Log("Handed off " + std::to_string(state.sessions.size()) + " sessions");
+  } catch (HandoffException &e) {
+    Logging::LogError(e.what());
+  }
+  close(successor);
+}
+
+void Handoff::send(int socket, const State &state)
+{
+  std::string data;
+  std::vector<int> fds(state.listeners);
+
+  // Descriptors: the listeners, the local listener, then every session with its channel
+  putInteger(data, state.presenceVersion, 8);
+  putInteger(data, state.listeners.size(), 4);
+  putInteger(data, (state.localListener != -1) ? 1 : 0, 1);
+  if (state.localListener != -1)
+    fds.push_back(state.localListener);
+  putInteger(data, state.sessions.size(), 4);
+  for (const auto &session : state.sessions) {
+    bool shared = session.sharedMemory != -1;
+
+    fds.push_back(session.fd);
+    if (shared)
+      fds.insert(fds.end(), {session.sharedMemory, session.serverSignal, session.clientSignal});
+    putInteger(data, shared ? 1 : 0, 1);
+    putInteger(data, session.address, 4);
+    putInteger(data, session.protocol, 1);
+    putInteger(data, session.subscribed ? 1 : 0, 1);
+    putString(data, session.name);
+    putInteger(data, session.channels.size(), 4);
+    for (const auto &channel : session.channels)
+      putString(data, channel);
+    putString(data, session.readBuffer);
+    putString(data, session.unsent);
+  }
+
+  std::string header;
+  putInteger(header, data.size(), 8);
+  _write(socket, header.data(), header.size());
+  _write(socket, data.data(), data.size());
+
+  // The descriptors follow, each message carrying up to HANDOFF_MAX_FDS of them on one byte
+  for (size_t first = 0; first < fds.size(); first += HANDOFF_MAX_FDS) {
+    size_t count = std::min<size_t>(HANDOFF_MAX_FDS, fds.size() - first);
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * count), 0);
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr message = {};
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+    rights->cmsg_level = SOL_SOCKET;
+    rights->cmsg_type = SCM_RIGHTS;
+    rights->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(rights), fds.data() + first, sizeof(int) * count);
+
+    while (sendmsg(socket, &message, MSG_NOSIGNAL) == -1) {
+      if (errno != EINTR)
+        throw HandoffException(HANDOFF_FAILED + std::string(": ") + strerror(errno));
+    }
+  }
+}
+
+Handoff::State Handoff::receive(int socket)
+{
+  State state;
+  std::string header(8, '\0');
+
+  _read(socket, &header[0], header.size());
+  std::string data(Reader(header).integer(8), '\0');
+  _read(socket, &data[0], data.size());
+
+  Reader reader(data);
+  state.presenceVersion = reader.integer(8);
+  state.listeners.resize(reader.integer(4), -1);
+  bool local = reader.integer(1) != 0;
+  size_t expected = state.listeners.size() + (local ? 1 : 0);
+  std::vector<bool> shared;
+  state.sessions.resize(reader.integer(4));
+  for (auto &session : state.sessions) {
+    shared.push_back(reader.integer(1) != 0);
+    expected += shared.back() ? 4 : 1;
+    session.address = reader.integer(4);
+    session.protocol = reader.integer(1);
+    session.subscribed = reader.integer(1) != 0;
+    session.name = reader.string();
+    session.channels.resize(reader.integer(4));
+    for (auto &channel : session.channels)
+      channel = reader.string();
+    session.readBuffer = reader.string();
+    session.unsent = reader.string();
+  }
+
+  std::vector<int> fds;
+  while (fds.size() < expected) {
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS), 0);
+    char byte = 0;
+    struct iovec iov = {&byte, 1};
+    struct msghdr message = {};
+
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data();
+    message.msg_controllen = control.size();
+    ssize_t result = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0 || (message.msg_flags & MSG_CTRUNC))
+      throw HandoffException(HANDOFF_FAILED + std::string(": missing file descriptors"));
+
+    for (struct cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != nullptr; rights = CMSG_NXTHDR(&message, rights)) {
+      if (rights->cmsg_level != SOL_SOCKET || rights->cmsg_type != SCM_RIGHTS)
+        continue;
+      size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      size_t offset = fds.size();
+      fds.resize(offset + count);
+      std::memcpy(fds.data() + offset, CMSG_DATA(rights), sizeof(int) * count);
+    }
+  }
+  if (fds.size() != expected)
+    throw HandoffException(HANDOFF_FAILED + std::string(": unexpected file descriptors"));
+
+  size_t next = 0;
+  for (auto &listener : state.listeners)
+    listener = fds[next++];
+  if (local)
+    state.localListener = fds[next++];
+  for (size_t i = 0; i < state.sessions.size(); i++) {
+    state.sessions[i].fd = fds[next++];
+    if (shared[i]) {
+      state.sessions[i].sharedMemory = fds[next++];
+      state.sessions[i].serverSignal = fds[next++];
+      state.sessions[i].clientSignal = fds[next++];
+    }
+  }
+  return state;
+}
+
+void Handoff::_write(int socket, const char *data, size_t size)
+{
+  while (size > 0) {
+    ssize_t result = ::send(socket, data, size, MSG_NOSIGNAL);
+
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      throw HandoffException(HANDOFF_FAILED + std::string(": ") + strerror(errno));
+    data += result;
+    size -= result;
+  }
+}
+
+void Handoff::_read(int socket, char *data, size_t size)
+{
+  while (size > 0) {
+    ssize_t result = ::recv(socket, data, size, 0);
+
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0)
+      throw HandoffException(HANDOFF_FAILED + std::string(": connection lost"));
+    data += result;
+    size -= result;
+  }
+}
@@ -0,0 +1,310 @@
+#include "HistoryStore.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+HistoryStore::HistoryStore(const MessageLog &log) : _log(log)
+{
+}
+
+HistoryStore::~HistoryStore()
+{
+  for (auto &mapping : _mappings)
+    munmap(const_cast<char *>(mapping.second.data), mapping.second.size);
+  _unmapRetired();
+}
+
+std::string HistoryStore::conversation(MessageLog::Kind kind, std::string_view sender, std::string_view target)
+{
+  if (kind == MessageLog::Kind::Broadcast)
+    return "*";
+  if (kind == MessageLog::Kind::Channel)
+    return std::string(target);
+  // The same conversation for both clients, whoever sent the message
+  std::string_view first = std::min(sender, target);
+  std::string_view second = std::max(sender, target);
+  return "@" + std::string(first) + " " + std::string(second);
+}
+
+void HistoryStore::add(const MessageLog::RecordView &record, uint64_t segment, uint64_t offset)
+{
+  if (record.kind == MessageLog::Kind::Delivered) {
+    _delivered(record);
+    return;
+  }
+
+  std::string key = conversation(record.kind, record.sender, record.target);
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  _unmapRetired();
+  uint64_t &bytes = _textBytes[key];
+  Entry entry{record.sequence, segment, offset, bytes};
+
+  bytes += record.text.size();
+  _conversations[key].push_back(entry);
+  if (record.kind == MessageLog::Kind::Offline)
+    _offline[std::string(record.target)].push_back(entry);
+}
+
+bool HistoryStore::read(const std::string &conversation, uint64_t before, size_t count, const std::function<bool(const MessageLog::RecordView &)> &visit)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _conversations.find(conversation);
+
+  if (found == _conversations.end())
+    return false;
+  const std::vector<Entry> &entries = found->second;
+  size_t end = entries.size();
+  if (before != 0) {
+    auto cursor = std::lower_bound(entries.begin(), entries.end(), before, [](const Entry &entry, uint64_t sequence) {
+      return entry.sequence < sequence;
+    });
+    end = cursor - entries.begin();
+  }
+
+  size_t taken = 0;
+  while (taken < count && taken < end) {
+    MessageLog::RecordView record;
+    if (!_read(entries[end - 1 - taken], record))
+      return false;
+    if (!visit(record))
+      break;
+    taken++;
+  }
+  return taken < end;
+}
+
+uint64_t HistoryStore::floor(const std::string &conversation, uint64_t bytes)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _conversations.find(conversation);
+
+  if (found == _conversations.end())
+    return 0;
+  // The text of a record and the newer ones is the total less the text before the record
+  uint64_t total = _textBytes.find(conversation)->second;
+  if (total <= bytes)
+    return 0;
+  const std::vector<Entry> &entries = found->second;
+  auto kept = std::lower_bound(entries.begin(), entries.end(), total - bytes, [](const Entry &entry, uint64_t before) {
+    return entry.before < before;
+  });
+  return (kept == entries.begin()) ? 0 : std::prev(kept)->sequence;
+}
+
+size_t HistoryStore::readOffline(const std::string &name, uint64_t after, size_t count, const std::function<bool(const MessageLog::RecordView &)> &visit)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _offline.find(name);
+
+  if (found == _offline.end())
+    return 0;
+  const std::deque<Entry> &entries = found->second;
+  auto cursor = std::upper_bound(entries.begin(), entries.end(), after, [](uint64_t sequence, const Entry &entry) {
+    return sequence < entry.sequence;
+  });
+
+  size_t taken = 0;
+  for (; cursor != entries.end() && taken < count; ++cursor) {
+    MessageLog::RecordView record;
+    if (!_read(*cursor, record))
+      break;
+    if (!visit(record))
+      break;
+    taken++;
+  }
+  return entries.end() - cursor;
+}
+
+size_t HistoryStore::offlineCount(const std::string &name)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _offline.find(name);
+
+  return (found == _offline.end()) ? 0 : found->second.size();
+}
+
+void HistoryStore::_delivered(const MessageLog::RecordView &record)
+{
+  uint64_t sequence = 0;
+  std::from_chars(record.text.data(), record.text.data() + record.text.size(), sequence);
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  auto found = _offline.find(std::string(record.target));
+
+  if (found == _offline.end())
+    return;
+  std::deque<Entry> &entries = found->second;
+  std::set<uint64_t> &acknowledged = _acknowledged[found->first];
+  while (!entries.empty() && entries.front().sequence <= sequence) {
+    acknowledged.insert(entries.front().sequence);
+    entries.pop_front();
+  }
+  if (entries.empty())
+    _offline.erase(found);
+}
+
+bool HistoryStore::queued(const std::string &name, uint64_t sequence)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _offline.find(name);
+
+  if (found == _offline.end())
+    return false;
+  auto entry = std::lower_bound(found->second.begin(), found->second.end(), sequence, [](const Entry &entry, uint64_t sequence) {
+    return entry.sequence < sequence;
+  });
+  return entry != found->second.end() && entry->sequence == sequence;
+}
+
+bool HistoryStore::acknowledges(const std::string &name, uint64_t sequence)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  auto found = _acknowledged.find(name);
+
+  return found != _acknowledged.end() && !found->second.empty() && *found->second.begin() <= sequence;
+}
+
+bool HistoryStore::compact(uint64_t segment, const std::vector<Relocation> &relocations, const std::function<bool()> &replace)
+{
+  std::unordered_map<std::string, std::vector<const Relocation *>> conversations;
+
+  for (const Relocation &relocation : relocations) {
+    if (relocation.kind != MessageLog::Kind::Delivered)
+      conversations[conversation(relocation.kind, relocation.sender, relocation.target)].push_back(&relocation);
+  }
+
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  if (!replace())
+    return false;
+  _unmapRetired();
+  {
+    std::lock_guard<std::mutex> mappingLock(_mappingMutex);
+    auto mapping = _mappings.find(segment);
+    if (mapping != _mappings.end()) {
+      munmap(const_cast<char *>(mapping->second.data), mapping->second.size);
+      _mappings.erase(mapping);
+    }
+  }
+
+  // The records of a segment are consecutive in every conversation
+  for (const auto &moved : conversations) {
+    auto found = _conversations.find(moved.first);
+    if (found == _conversations.end())
+      continue;
+    std::vector<Entry> &entries = found->second;
+    auto first = std::lower_bound(entries.begin(), entries.end(), moved.second.front()->sequence, [](const Entry &entry, uint64_t sequence) {
+      return entry.sequence < sequence;
+    });
+    auto kept = first;
+    auto next = moved.second.begin();
+    auto entry = first;
+    for (; entry != entries.end() && entry->segment == segment; ++entry) {
+      while (next != moved.second.end() && (*next)->sequence < entry->sequence)
+        ++next;
+      if (next != moved.second.end() && (*next)->sequence == entry->sequence) {
+        if ((*next)->offset == Relocation::DROPPED)
+          continue;
+        entry->offset = (*next)->offset;
+      }
+      *kept++ = *entry;
+    }
+    entries.erase(kept, entry);
+    if (entries.empty())
+      _conversations.erase(found);
+  }
+
+  for (const Relocation &relocation : relocations) {
+    if (relocation.kind != MessageLog::Kind::Offline)
+      continue;
+    auto queue = _offline.find(relocation.target);
+    if (queue != _offline.end()) {
+      auto entry = std::lower_bound(queue->second.begin(), queue->second.end(), relocation.sequence, [](const Entry &entry, uint64_t sequence) {
+        return entry.sequence < sequence;
+      });
+      if (entry != queue->second.end() && entry->sequence == relocation.sequence) {
+        entry->offset = relocation.offset;
+        continue;
+      }
+    }
+    // Delivered, the record no longer needs its acknowledgement once rewritten or dropped
+    auto acknowledged = _acknowledged.find(relocation.target);
+    if (relocation.offline || acknowledged == _acknowledged.end())
+      continue;
+    acknowledged->second.erase(relocation.sequence);
+    if (acknowledged->second.empty())
+      _acknowledged.erase(acknowledged);
+  }
+  return true;
+}
+
+bool HistoryStore::_read(const Entry &entry, MessageLog::RecordView &record)
+{
+  // Indexed records were written whole and checked: one the mapping does not cover was
+  // written after the segment was mapped, and the file holds it now
+  Mapping mapping = _map(entry.segment, entry.offset + MESSAGE_LOG_HEADER_SIZE);
+  if (mapping.data == nullptr)
+    return false;
+  long size = MessageLog::parse(std::string_view(mapping.data + entry.offset, mapping.size - entry.offset), record, false);
+  if (size == 0) {
+    mapping = _map(entry.segment, mapping.size + 1);
+    if (mapping.data == nullptr)
+      return false;
+    size = MessageLog::parse(std::string_view(mapping.data + entry.offset, mapping.size - entry.offset), record, false);
+  }
+  return size > 0;
+}
+
+HistoryStore::Mapping HistoryStore::_map(uint64_t segment, size_t size)
+{
+  std::lock_guard<std::mutex> lock(_mappingMutex);
+  auto found = _mappings.find(segment);
+
+  if (found != _mappings.end() && found->second.size >= size)
+    return found->second;
+
+  std::string path = _log.segmentPath(segment);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat status;
+  if (fd == -1 || fstat(fd, &status) == -1) {
+    Logging::LogError("History: failed to open " + path + ": " + strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return Mapping{nullptr, 0};
+  }
+  // Only up to the end of the file, reading a page past it would raise SIGBUS
+  if (static_cast<size_t>(status.st_size) < size) {
+    Logging::LogError("History: " + path + " is shorter than its records");
+    close(fd);
+    return Mapping{nullptr, 0};
+  }
+  void *data = mmap(nullptr, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    Logging::LogError("History: failed to map " + path + ": " + strerror(errno));
+    return Mapping{nullptr, 0};
+  }
+  Mapping mapping{static_cast<const char *>(data), static_cast<size_t>(status.st_size)};
+  if (found != _mappings.end()) {
+    // Other readers may still read the smaller mapping, it is unmapped by the next writer
+    _retired.push_back(found->second);
+    found->second = mapping;
+  } else {
+    _mappings.emplace(segment, mapping);
+  }
+  return mapping;
+}
+
+void HistoryStore::_unmapRetired()
+{
+  std::lock_guard<std::mutex> lock(_mappingMutex);
+
+  for (const Mapping &mapping : _retired)
+    munmap(const_cast<char *>(mapping.data), mapping.size);
+  _retired.clear();
+}
@@ -0,0 +1,400 @@
+#include "LogCompactor.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+uint64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+uint64_t steadyNow()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// A removal or a rename is durable once the directory is synced
+void syncDirectory(const std::string &path)
+{
+  int directory = open(std::filesystem::path(path).parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (directory != -1) {
+    fsync(directory);
+    close(directory);
+  }
+}
+
+}
+
+LogCompactor::LogCompactor(MessageLog &log, HistoryStore &history, uint64_t age, uint64_t logBytes, std::map<std::string, Retention> rules, size_t interval, size_t bandwidth)
+  : _log(log), _history(history), _default{age, 0}, _logBytes(logBytes), _rules(std::move(rules)), _interval(std::max<size_t>(1, interval)),
+    _bandwidth{static_cast<double>(bandwidth), LOG_COMPACTOR_CHUNK}, _byteRules(false), _stopping(false)
+{
+  for (const auto &rule : _rules)
+    _byteRules = _byteRules || rule.second.bytes > 0;
+}
+
+LogCompactor::~LogCompactor()
+{
+  stop();
+}
+
+std::map<std::string, LogCompactor::Retention> LogCompactor::parseRules(const std::string &rules)
+{
+  std::map<std::string, Retention> parsed;
+  std::stringstream list(rules);
+  std::string entry;
+
+  while (std::getline(list, entry, ',')) {
+    size_t equal = entry.rfind('=');
+    unsigned long long age = 0;
+    unsigned long long bytes = 0;
+    if (equal == std::string::npos || equal == 0 || std::sscanf(entry.c_str() + equal + 1, "%llu/%llu", &age, &bytes) != 2) {
+      Logging::LogWarning("Log compaction: invalid retention rule " + entry);
+      continue;
+    }
+    parsed[entry.substr(0, equal)] = Retention{age, bytes};
+  }
+  return parsed;
+}
+
+bool LogCompactor::enabled() const
+{
+  return _default.age > 0 || _logBytes > 0 || !_rules.empty();
+}
+
+void LogCompactor::start()
+{
+  std::error_code error;
+  std::filesystem::path directory = std::filesystem::path(_log.segmentPath(0)).parent_path();
+
+  for (const auto &entry : std::filesystem::directory_iterator(directory, error)) {
+    if (entry.path().extension() == LOG_COMPACTOR_SUFFIX) {
+      std::error_code ignored;
+      std::filesystem::remove(entry.path(), ignored);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = false;
+  }
+  _thread = std::thread(&LogCompactor::_run, this);
+}
+
+void LogCompactor::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _stopped.notify_all();
+  if (_thread.joinable())
+    _thread.join();
+}
+
+void LogCompactor::_run()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (!_stopping) {
+    lock.unlock();
+    _pass();
+    _floors.clear();
+    lock.lock();
+    _stopped.wait_for(lock, std::chrono::seconds(_interval), [this]() { return _stopping; });
+  }
+}
+
+void LogCompactor::_pass()
+{
+  std::error_code error;
+  std::vector<uint64_t> segments = _log.segments(error);
+
+  if (error) {
+    Logging::LogError("Log compaction: failed to list the segments: " + error.message());
+    return;
+  }
+
+  uint64_t sealed = _log.sealed();
+  std::map<uint64_t, Hint> hints;
+  for (uint64_t segment : segments) {
+    auto hint = _hints.find(segment);
+    if (hint != _hints.end())
+      hints.insert(std::move(*hint));
+  }
+  _hints.swap(hints);
+
+  std::vector<uint64_t> sizes;
+  uint64_t total = 0;
+  for (uint64_t segment : segments) {
+    std::error_code ignored;
+    uintmax_t size = std::filesystem::file_size(_log.segmentPath(segment), ignored);
+    sizes.push_back(ignored ? 0 : size);
+    total += sizes.back();
+  }
+
+  // Beyond the size of the log, the oldest segments go first
+  uint64_t excess = (_logBytes > 0 && total > _logBytes) ? total - _logBytes : 0;
+  uint64_t time = now();
+  for (size_t i = 0; i < segments.size() && segments[i] < sealed; i++) {
+    bool evicted = excess > 0;
+    excess -= std::min<uint64_t>(excess, sizes[i]);
+    if (!_compactSegment(segments[i], evicted, time))
+      return;
+  }
+}
+
+bool LogCompactor::_compactSegment(uint64_t segment, bool evicted, uint64_t now)
+{
+  // Until its next message expires, scanning the segment again would find nothing to drop
+  auto previous = _hints.find(segment);
+  if (!evicted && !_byteRules && previous != _hints.end() && now < previous->second.expiry && !_released(previous->second))
+    return true;
+
+  std::string path = _log.segmentPath(segment);
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat status;
+
+  if (fd == -1 || fstat(fd, &status) == -1) {
+    Logging::LogError("Log compaction: failed to open " + path + ": " + strerror(errno));
+    if (fd != -1)
+      close(fd);
+    return true;
+  }
+  size_t size = status.st_size;
+  void *mapping = (size > 0) ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapping == MAP_FAILED)
+    return true;
+  const char *data = static_cast<const char *>(mapping);
+
+  // The segment is read at the pace of the bandwidth limit
+  std::vector<Decision> decisions;
+  size_t kept = 0;
+  Hint hint;
+  size_t offset = 0;
+  size_t unpaced = 0;
+  long length;
+  MessageLog::RecordView record;
+  while (offset < size && (length = MessageLog::parse(std::string_view(data + offset, size - offset), record)) > 0) {
+    for (unpaced += length; unpaced >= LOG_COMPACTOR_CHUNK; unpaced -= LOG_COMPACTOR_CHUNK) {
+      if (!_throttle(LOG_COMPACTOR_CHUNK)) {
+        munmap(mapping, size);
+        return false;
+      }
+    }
+    Decision decision{offset, static_cast<size_t>(length), {}};
+    if (_decide(record, evicted, now, decision, hint))
+      kept += length;
+    else
+      decision.relocation.offset = HistoryStore::Relocation::DROPPED;
+    decisions.push_back(std::move(decision));
+    offset += length;
+  }
+  if (unpaced > 0 && !_throttle(unpaced)) {
+    munmap(mapping, size);
+    return false;
+  }
+  if (offset < size) {
+    Logging::LogWarning("Log compaction: skipping " + path + ", invalid record at " + std::to_string(offset));
+    munmap(mapping, size);
+    return true;
+  }
+
+  // Rewriting a segment for a few expired records would cost more than it frees
+  size_t dropped = size - kept;
+  if (dropped == 0 || (kept > 0 && dropped * 2 < size)) {
+    munmap(mapping, size);
+    _hints[segment] = std::move(hint);
+    return true;
+  }
+
+  std::vector<HistoryStore::Relocation> relocations;
+  relocations.reserve(decisions.size());
+  if (kept == 0) {
+    for (Decision &decision : decisions)
+      relocations.push_back(std::move(decision.relocation));
+    munmap(mapping, size);
+    bool removed = _history.compact(segment, relocations, [&path]() {
+      if (unlink(path.c_str()) == -1) {
+        Logging::LogError("Log compaction: failed to remove " + path + ": " + strerror(errno));
+        return false;
+      }
+      return true;
+    });
+    if (removed) {
+      _hints.erase(segment);
+      syncDirectory(path);
+      Logging::Log("Log compaction: removed " + path + ", " + std::to_string(size) + " bytes");
+    }
+    return true;
+  }
+
+  // The records kept are copied aside, then the copy replaces the segment
+  std::string copy = path + LOG_COMPACTOR_SUFFIX;
+  int out = open(copy.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (out == -1) {
+    Logging::LogError("Log compaction: failed to create " + copy + ": " + strerror(errno));
+    munmap(mapping, size);
+    return true;
+  }
+  std::string buffer;
+  uint64_t written = 0;
+  bool complete = true;
+  for (Decision &decision : decisions) {
+    HistoryStore::Relocation &relocation = decision.relocation;
+    if (relocation.offset == HistoryStore::Relocation::DROPPED) {
+      relocations.push_back(std::move(relocation));
+      continue;
+    }
+    relocation.offset = written + buffer.size();
+    if (relocation.kind == MessageLog::Kind::Offline && !relocation.offline) {
+      // Delivered, the message stays in the history as a private one
+      MessageLog::RecordView view;
+      MessageLog::parse(std::string_view(data + decision.offset, decision.size), view, false);
+      MessageLog::Record converted{view.sequence, view.time, MessageLog::Kind::Private, std::string(view.sender), std::string(view.target), std::string(view.text)};
+      MessageLog::encode(converted, buffer);
+    } else {
+      buffer.append(data + decision.offset, decision.size);
+    }
+    relocations.push_back(std::move(relocation));
+    if (buffer.size() >= LOG_COMPACTOR_CHUNK) {
+      if (!(complete = _write(out, buffer)))
+        break;
+      written += buffer.size();
+      buffer.clear();
+    }
+  }
+  munmap(mapping, size);
+  if (complete && !buffer.empty())
+    complete = _write(out, buffer);
+  if (complete && fsync(out) == -1) {
+    Logging::LogError("Log compaction: failed to sync " + copy + ": " + strerror(errno));
+    complete = false;
+  }
+  close(out);
+
+  bool replaced = complete && _history.compact(segment, relocations, [&copy, &path]() {
+    if (rename(copy.c_str(), path.c_str()) == -1) {
+      Logging::LogError("Log compaction: failed to replace " + path + ": " + strerror(errno));
+      return false;
+    }
+    return true;
+  });
+  if (!replaced) {
+    unlink(copy.c_str());
+    std::lock_guard<std::mutex> lock(_mutex);
+    return !_stopping;
+  }
+  _hints[segment] = std::move(hint);
+  syncDirectory(path);
+  Logging::Log("Log compaction: rewrote " + path + ", " + std::to_string(kept) + " of " + std::to_string(size) + " bytes kept");
+  return true;
+}
+
+bool LogCompactor::_decide(const MessageLog::RecordView &record, bool evicted, uint64_t now, Decision &decision, Hint &hint)
+{
+  HistoryStore::Relocation &relocation = decision.relocation;
+  std::string target(record.target);
+
+  relocation = HistoryStore::Relocation{record.sequence, record.kind, std::string(record.sender), target, 0, false};
+  // The log keeps what its recovery needs: the messages waiting, and their acknowledgements
+  if (record.kind == MessageLog::Kind::Delivered) {
+    uint64_t acknowledged = 0;
+    std::from_chars(record.text.data(), record.text.data() + record.text.size(), acknowledged);
+    if (!_history.acknowledges(target, acknowledged))
+      return false;
+    hint.pins.push_back(Pin{target, acknowledged, true});
+    return true;
+  }
+  relocation.offline = record.kind == MessageLog::Kind::Offline && _history.queued(target, record.sequence);
+
+  std::string conversation = HistoryStore::conversation(record.kind, record.sender, record.target);
+  const Retention &retention = _retention(conversation);
+  bool expired = evicted || (retention.age > 0 && record.time + retention.age * 1000 <= now)
+    || (retention.bytes > 0 && record.sequence <= _floor(conversation, retention.bytes));
+  if (!expired) {
+    if (retention.age > 0)
+      hint.expiry = std::min(hint.expiry, record.time + retention.age * 1000);
+    return true;
+  }
+  if (relocation.offline)
+    hint.pins.push_back(Pin{target, record.sequence, false});
+  return relocation.offline;
+}
+
+bool LogCompactor::_released(const Hint &hint)
+{
+  for (const Pin &pin : hint.pins) {
+    if (pin.acknowledgement ? !_history.acknowledges(pin.name, pin.sequence) : !_history.queued(pin.name, pin.sequence))
+      return true;
+  }
+  return false;
+}
+
+const LogCompactor::Retention &LogCompactor::_retention(const std::string &conversation) const
+{
+  auto rule = _rules.find(conversation);
+
+  if (rule == _rules.end() && (conversation[0] == '#' || conversation[0] == '@'))
+    rule = _rules.find(conversation.substr(0, 1));
+  return (rule != _rules.end()) ? rule->second : _default;
+}
+
+uint64_t LogCompactor::_floor(const std::string &conversation, uint64_t bytes)
+{
+  auto found = _floors.find(conversation);
+
+  if (found != _floors.end())
+    return found->second;
+  uint64_t floor = _history.floor(conversation, bytes);
+  _floors.emplace(conversation, floor);
+  return floor;
+}
+
+bool LogCompactor::_write(int fd, const std::string &data)
+{
+  size_t done = 0;
+
+  while (done < data.size()) {
+    size_t size = std::min<size_t>(data.size() - done, LOG_COMPACTOR_CHUNK);
+    if (!_throttle(size))
+      return false;
+    ssize_t result = write(fd, data.data() + done, size);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      Logging::LogError(std::string("Log compaction: failed to write: ") + strerror(errno));
+      return false;
+    }
+    done += result;
+  }
+  return true;
+}
+
+bool LogCompactor::_throttle(size_t bytes)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  while (!_stopping) {
+    if (_bandwidth.rate <= 0 || _bucket.take(bytes, _bandwidth, steadyNow()))
+      return true;
+    // Sleeps until the bucket holds enough tokens, or the compactor is stopped
+    uint64_t wait = std::max<uint64_t>(1, (bytes - _bucket.tokens) * 1000 / _bandwidth.rate);
+    _stopped.wait_for(lock, std::chrono::milliseconds(wait), [this]() { return _stopping; });
+  }
+  return false;
+}
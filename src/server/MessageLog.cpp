@@ -0,0 +1,448 @@
+#include "MessageLog.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define MESSAGE_LOG_FIELDS_SIZE 21 // Bytes of the fixed fields after the header: sequence, time, kind and sizes
+#define MESSAGE_LOG_SUFFIX ".log" // Extension of the segment files
+
+namespace {
+
+// Table of the reflected CRC-32C (Castagnoli) polynomial, one entry per byte value
+constexpr std::array<uint32_t, 256> crcTable()
+{
+  std::array<uint32_t, 256> table = {};
+
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+    table[i] = crc;
+  }
+  return table;
+}
+
+constexpr std::array<uint32_t, 256> CRC_TABLE = crcTable();
+
+void putInteger(std::string &out, uint64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    out += static_cast<char>((value >> (8 * (size - 1 - i))) & 0xFF);
+}
+
+uint64_t getInteger(const char *data, size_t size)
+{
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < size; i++)
+    value = (value << 8) | static_cast<uint8_t>(data[i]);
+  return value;
+}
+
+uint64_t now()
+{
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
+
+MessageLog::MessageLog(const std::string &directory, size_t segmentSize, Sync sync, size_t syncInterval, size_t bufferSize, std::function<void()> onRoom)
+  : _directory(directory), _segmentSize(std::max<size_t>(1, segmentSize)), _sync(sync), _syncInterval(syncInterval),
+    _bufferSize(std::max<size_t>(1, bufferSize)), _onRoom(std::move(onRoom)), _pendingBytes(0), _sequence(1), _written(1), _lost(0), _segment(0),
+    _segmentBytes(0), _sealed(0), _open(false), _stopping(false), _fd(-1), _fdSegment(0), _broken(false), _unsynced(false)
+{
+  if (!_directory.empty() && _directory.back() != '/')
+    _directory += '/';
+}
+
+MessageLog::~MessageLog()
+{
+  close();
+}
+
+std::string MessageLog::segmentPath(uint64_t index) const
+{
+  std::string number = std::to_string(index);
+
+  return _directory + std::string(20 - std::min<size_t>(20, number.size()), '0') + number + MESSAGE_LOG_SUFFIX;
+}
+
+void MessageLog::observe(Observer observer)
+{
+  _observer = std::move(observer);
+}
+
+std::vector<uint64_t> MessageLog::segments(std::error_code &error) const
+{
+  std::vector<uint64_t> segments;
+
+  for (const auto &entry : std::filesystem::directory_iterator(_directory, error)) {
+    std::string name = entry.path().filename().string();
+    size_t digits = name.size() - std::strlen(MESSAGE_LOG_SUFFIX);
+
+    if (name.size() <= std::strlen(MESSAGE_LOG_SUFFIX) || name.compare(digits, std::string::npos, MESSAGE_LOG_SUFFIX) != 0)
+      continue;
+    if (!std::all_of(name.begin(), name.begin() + digits, [](char c) { return c >= '0' && c <= '9'; }))
+      continue;
+    segments.push_back(std::stoull(name.substr(0, digits)));
+  }
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
+
+uint64_t MessageLog::sealed()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  return _sealed;
+}
+
+void MessageLog::open()
+{
+  std::error_code error;
+
+  std::filesystem::create_directories(_directory, error);
+  if (error)
+    throw MessageLogException(MESSAGE_LOG_FAILED + std::string(": ") + error.message());
+  std::vector<uint64_t> segments = this->segments(error);
+  if (error)
+    throw MessageLogException(MESSAGE_LOG_FAILED + std::string(": ") + error.message());
+
+  // The log is the records up to the first invalid one, whatever follows it is dropped
+  size_t valid = 0;
+  while (valid < segments.size() && _recover(segments[valid]))
+    valid++;
+  if (valid < segments.size()) {
+    for (size_t i = valid + 1; i < segments.size(); i++) {
+      Logging::LogWarning("Message log: dropping segment " + segmentPath(segments[i]) + " after a torn record");
+      std::filesystem::remove(segmentPath(segments[i]), error);
+    }
+    valid++;
+  }
+  _segment = (valid > 0) ? segments[valid - 1] : 0;
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _open = true;
+    _stopping = false;
+    _written = _sequence;
+    _sealed = _segment;
+  }
+  _writer = std::thread(&MessageLog::_run, this);
+  Logging::Log("Message log: " + std::to_string(valid) + " segments, next record " + std::to_string(_sequence));
+}
+
+bool MessageLog::_recover(uint64_t index)
+{
+  std::string path = segmentPath(index);
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  struct stat status;
+
+  if (fd == -1 || fstat(fd, &status) == -1) {
+    std::string reason = strerror(errno);
+    if (fd != -1)
+      ::close(fd);
+    throw MessageLogException(MESSAGE_LOG_FAILED + std::string(": ") + path + ": " + reason);
+  }
+
+  size_t size = status.st_size;
+  size_t offset = 0;
+  const char *data = nullptr;
+  if (size > 0) {
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+      std::string reason = strerror(errno);
+      ::close(fd);
+      throw MessageLogException(MESSAGE_LOG_FAILED + std::string(": ") + path + ": " + reason);
+    }
+    data = static_cast<const char *>(mapping);
+  }
+
+  RecordView record;
+  long length;
+  while (offset < size && (length = parse(std::string_view(data + offset, size - offset), record)) > 0) {
+    if (record.sequence < _sequence)
+      break;
+    if (_observer)
+      _observer(record, index, offset);
+    _sequence = record.sequence + 1;
+    offset += length;
+  }
+  if (data != nullptr)
+    munmap(const_cast<char *>(data), size);
+
+  bool complete = offset == size;
+  if (!complete) {
+    Logging::LogWarning("Message log: truncating " + path + " from " + std::to_string(size) + " to " + std::to_string(offset) + " bytes");
+    if (ftruncate(fd, offset) == -1 || fsync(fd) == -1)
+      Logging::LogError("Message log: failed to truncate " + path + ": " + strerror(errno));
+  }
+  ::close(fd);
+  _segmentBytes = offset;
+  return complete;
+}
+
+void MessageLog::close()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_open)
+      return;
+    _open = false;
+    _stopping = true;
+  }
+  _appended.notify_one();
+  _wrote.notify_all();
+  _writer.join();
+}
+
+bool MessageLog::append(Record &record)
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    size_t size = MessageLog::size(record);
+    if (!_open || _pendingBytes >= _bufferSize || size > MESSAGE_LOG_HEADER_SIZE + MESSAGE_LOG_MAX_RECORD)
+      return false;
+
+    record.sequence = _sequence++;
+    record.time = now();
+
+    // A record larger than a segment gets one of its own
+    if (_segmentBytes > 0 && _segmentBytes + size > _segmentSize) {
+      _segment++;
+      _segmentBytes = 0;
+    }
+    if (_pending.empty() || _pending.back().segment != _segment)
+      _pending.push_back(Chunk{_segment, _segmentBytes, record.sequence, std::string()});
+    encode(record, _pending.back().bytes);
+    _segmentBytes += size;
+    _pendingBytes += size;
+  }
+  _appended.notify_one();
+  return true;
+}
+
+uint64_t MessageLog::nextSequence()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  return _sequence;
+}
+
+bool MessageLog::waitWritten(uint64_t sequence)
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+
+  _wrote.wait(lock, [this, sequence]() { return _written >= sequence || _stopping; });
+  return _written >= sequence && (_lost == 0 || _lost >= sequence);
+}
+
+size_t MessageLog::size(const Record &record)
+{
+  // The names are cut to the size their fields can hold, as encode() does
+  return MESSAGE_LOG_HEADER_SIZE + MESSAGE_LOG_FIELDS_SIZE + std::min<size_t>(record.sender.size(), UINT16_MAX) + std::min<size_t>(record.target.size(), UINT16_MAX) + record.text.size();
+}
+
+void MessageLog::encode(const Record &record, std::string &out)
+{
+  size_t start = out.size();
+  uint16_t senderSize = std::min<size_t>(record.sender.size(), UINT16_MAX);
+  uint16_t targetSize = std::min<size_t>(record.target.size(), UINT16_MAX);
+
+  out.append(MESSAGE_LOG_HEADER_SIZE, '\0');
+  putInteger(out, record.sequence, 8);
+  putInteger(out, record.time, 8);
+  putInteger(out, static_cast<uint8_t>(record.kind), 1);
+  putInteger(out, senderSize, 2);
+  putInteger(out, targetSize, 2);
+  out.append(record.sender, 0, senderSize);
+  out.append(record.target, 0, targetSize);
+  out += record.text;
+
+  // The header is filled once the fields it covers are written
+  size_t length = out.size() - start - MESSAGE_LOG_HEADER_SIZE;
+  uint32_t crc = checksum(out.data() + start + MESSAGE_LOG_HEADER_SIZE, length);
+  std::string header;
+  putInteger(header, length, 4);
+  putInteger(header, crc, 4);
+  out.replace(start, MESSAGE_LOG_HEADER_SIZE, header);
+}
+
+long MessageLog::parse(std::string_view data, RecordView &record, bool verify)
+{
+  if (data.size() < MESSAGE_LOG_HEADER_SIZE)
+    return 0;
+  size_t length = getInteger(data.data(), 4);
+  if (length < MESSAGE_LOG_FIELDS_SIZE || length > MESSAGE_LOG_MAX_RECORD)
+    return -1;
+  if (data.size() - MESSAGE_LOG_HEADER_SIZE < length)
+    return 0;
+  const char *fields = data.data() + MESSAGE_LOG_HEADER_SIZE;
+  if (verify && checksum(fields, length) != getInteger(data.data() + 4, 4))
+    return -1;
+
+  size_t senderSize = getInteger(fields + 17, 2);
+  size_t targetSize = getInteger(fields + 19, 2);
+  if (MESSAGE_LOG_FIELDS_SIZE + senderSize + targetSize > length)
+    return -1;
+  record.sequence = getInteger(fields, 8);
+  record.time = getInteger(fields + 8, 8);
+  record.kind = static_cast<Kind>(fields[16]);
+  record.sender = std::string_view(fields + MESSAGE_LOG_FIELDS_SIZE, senderSize);
+  record.target = std::string_view(fields + MESSAGE_LOG_FIELDS_SIZE + senderSize, targetSize);
+  record.text = std::string_view(fields + MESSAGE_LOG_FIELDS_SIZE + senderSize + targetSize, length - MESSAGE_LOG_FIELDS_SIZE - senderSize - targetSize);
+  return MESSAGE_LOG_HEADER_SIZE + length;
+}
+
+uint32_t MessageLog::checksum(const char *data, size_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i = 0; i < size; i++)
+    crc = CRC_TABLE[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+  return crc ^ 0xFFFFFFFF;
+}
+
+void MessageLog::_run()
+{
+  std::unique_lock<std::mutex> lock(_mutex);
+  auto lastSync = std::chrono::steady_clock::now();
+
+  while (true) {
+    auto ready = [this]() { return _stopping || !_pending.empty(); };
+    if (_sync == Sync::Interval && _unsynced)
+      _appended.wait_until(lock, lastSync + std::chrono::milliseconds(_syncInterval), ready);
+    else
+      _appended.wait(lock, ready);
+    if (_pending.empty() && _stopping)
+      break;
+
+    // Everything appended while the previous batch was written goes out together
+    std::vector<Chunk> batch;
+    batch.swap(_pending);
+    uint64_t written = _sequence;
+    bool wasFull = _pendingBytes >= _bufferSize;
+    _pendingBytes = 0;
+    lock.unlock();
+
+    uint64_t lost = 0;
+    for (const Chunk &chunk : batch) {
+      if (!_write(chunk) && lost == 0)
+        lost = chunk.sequence;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (_sync == Sync::Batch || (_sync == Sync::Interval && now - lastSync >= std::chrono::milliseconds(_syncInterval))) {
+      _syncSegment();
+      lastSync = now;
+    }
+    // The records refused meanwhile are appended again by their shards
+    if (wasFull && _onRoom)
+      _onRoom();
+    lock.lock();
+    _written = written;
+    if (_lost == 0)
+      _lost = lost;
+    _wrote.notify_all();
+  }
+  lock.unlock();
+
+  if (_sync != Sync::None)
+    _syncSegment();
+  if (_fd != -1)
+    ::close(_fd);
+  _fd = -1;
+}
+
+bool MessageLog::_write(const Chunk &chunk)
+{
+  // The chunks appended behind a failed one start past the bytes lost, they are dropped too
+  if (_broken && _fdSegment == chunk.segment)
+    return false;
+  if (_fd == -1 || _fdSegment != chunk.segment) {
+    // The previous segment is complete, it is synced before being closed
+    if (_fd != -1) {
+      if (_sync != Sync::None)
+        _syncSegment();
+      ::close(_fd);
+    }
+    _fdSegment = chunk.segment;
+    _broken = false;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      _sealed = chunk.segment;
+    }
+    _fd = ::open(segmentPath(chunk.segment).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_fd == -1) {
+      Logging::LogError("Message log: failed to open " + segmentPath(chunk.segment) + ": " + strerror(errno));
+      return _drop(chunk);
+    }
+    if (_sync != Sync::None) {
+      int directory = ::open(_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      if (directory != -1) {
+        fsync(directory);
+        ::close(directory);
+      }
+    }
+  }
+
+  const char *data = chunk.bytes.data();
+  size_t size = chunk.bytes.size();
+  while (size > 0) {
+    ssize_t result = ::write(_fd, data, size);
+
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      Logging::LogError("Message log: failed to write " + segmentPath(chunk.segment) + ": " + strerror(result == 0 ? EIO : errno));
+      // A record cut in the middle of the log would end it at the next recovery
+      if (ftruncate(_fd, chunk.offset) == -1)
+        Logging::LogError("Message log: failed to truncate " + segmentPath(chunk.segment) + ": " + strerror(errno));
+      return _drop(chunk);
+    }
+    data += result;
+    size -= result;
+  }
+  _unsynced = true;
+
+  // The records can be read from the segment now
+  if (!_observer)
+    return true;
+  RecordView record;
+  size_t offset = 0;
+  long length;
+  while (offset < chunk.bytes.size() && (length = parse(std::string_view(chunk.bytes).substr(offset), record, false)) > 0) {
+    _observer(record, chunk.segment, chunk.offset + offset);
+    offset += length;
+  }
+  return true;
+}
+
+bool MessageLog::_drop(const Chunk &chunk)
+{
+  Logging::LogError("Message log: dropping the records from " + std::to_string(chunk.sequence) + " of " + segmentPath(chunk.segment));
+  _broken = true;
+  std::lock_guard<std::mutex> lock(_mutex);
+  if (_segment == chunk.segment) {
+    _segment++;
+    _segmentBytes = 0;
+  }
+  return false;
+}
+
+void MessageLog::_syncSegment()
+{
+  if (_fd == -1 || !_unsynced)
+    return;
+  if (fdatasync(_fd) == -1)
+    Logging::LogError("Message log: failed to sync " + segmentPath(_fdSegment) + ": " + strerror(errno));
+  _unsynced = false;
+}
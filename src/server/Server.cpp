@@ -2,13 +2,35 @@
 #include "Logging.hpp"
 #include "BinaryProtocol.hpp"
 #include "Utils.hpp"
+#include "EpollLoop.hpp"
+#include "UringLoop.hpp"
 #include <vector>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
+#include <cctype>
+#include <climits>
 
 Server::Server()
 {
   Logging::Log("Server created with default port 8080");
   _port = 8080;
   _running = false;
+  _presenceVersion = 0;
+  _presenceScheduled = false;
+  _paused = false;
+  _reserveFd = -1;
+  _localSocket = -1;
+  _now = _clock();
+  _timers = TimerWheel(_now);
+  _sleepers = TimerWheel(_now);
+  _resumed = -1;
+  _initRateLimits();
+  _sessions = SessionTable(_config.maxFrameSize, _rateLimits.size());
+  _group = std::make_shared<ShardGroup>(1);
+  _shard = 0;
 }
 
 Server::Server(unsigned short port)
@@ -16,229 +38,658 @@ Server::Server(unsigned short port)
   Logging::Log("Server created with port " + std::to_string(port));
   _port = port;
   _running = false;
+  _presenceVersion = 0;
+  _presenceScheduled = false;
+  _paused = false;
+  _reserveFd = -1;
+  _localSocket = -1;
+  _now = _clock();
+  _timers = TimerWheel(_now);
+  _sleepers = TimerWheel(_now);
+  _resumed = -1;
+  _initRateLimits();
+  _sessions = SessionTable(_config.maxFrameSize, _rateLimits.size());
+  _group = std::make_shared<ShardGroup>(1);
+  _shard = 0;
+}
+
+Server::Server(unsigned short port, const ServerConfig &config) : Server(port)
+{
+  _config = config;
+  _initRateLimits();
+  _sessions = SessionTable(config.maxFrameSize, _rateLimits.size());
+}
+
+Server::Server(unsigned short port, const ServerConfig &config, std::shared_ptr<ShardGroup> group, size_t shard) : Server(port, config)
+{
+  _group = group;
+  _shard = shard;
 }
 
 Server::~Server()
 {
   if (_running)
     this->stop();
+  if (_loop)
+    _group->attach(_shard, nullptr);
   Logging::Log("Server destroyed");
 }
 
-void Server::init()
+constexpr std::array<Server::Command, 256> Server::_makeCommands()
 {
-  initCommands();
-  initDatabase();
+  std::array<Command, 256> commands{};
+
+  commands[static_cast<uint8_t>(MessageType::Login)] = &Server::clientLogin;
+  commands[static_cast<uint8_t>(MessageType::Simple)] = &Server::commandsMessage;
+  commands[static_cast<uint8_t>(MessageType::ListUsers)] = &Server::commandList;
+  commands[static_cast<uint8_t>(MessageType::JoinChannel)] = &Server::commandJoin;
+  commands[static_cast<uint8_t>(MessageType::LeaveChannel)] = &Server::commandLeave;
+  commands[static_cast<uint8_t>(MessageType::Presence)] = &Server::commandPresence;
+  commands[static_cast<uint8_t>(MessageType::Ping)] = &Server::commandPing;
+  commands[static_cast<uint8_t>(MessageType::Pong)] = &Server::commandPong;
+  commands[static_cast<uint8_t>(MessageType::SharedMemory)] = &Server::commandSharedMemory;
+  commands[static_cast<uint8_t>(MessageType::History)] = &Server::commandHistory;
+  commands[static_cast<uint8_t>(MessageType::Offline)] = &Server::commandOffline;
+  commands[static_cast<uint8_t>(MessageType::Private)] = &Server::sendPrivateMessage;
+  return commands;
+}
 
-  _socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (_socket == -1)
-    throw ServerException(SOCKET_CREATION_FAILED);
+const std::array<Server::Command, 256> Server::_commands = Server::_makeCommands();
 
-  if (setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &_opt, sizeof(_opt)) < 0)
-    throw ServerException(SOCKET_OPT_FAILED);
-  _serverAddr.sin_family = AF_INET;
-  _serverAddr.sin_addr.s_addr = INADDR_ANY;
-  _serverAddr.sin_port = htons(_port);
+void Server::init(int listener, int localListener)
+{
+  // The database is shared by the shards, the first one loads it, opens the message log and starts its retention
+  if (_shard == 0) {
+    initDatabase();
+    _group->openLog(DB_PATH LOG_FOLDER, _config.logSegmentSize, _logSync(), _config.logSyncInterval, _config.logBuffer);
+    _group->compactLog(_config.retentionAge, _config.retentionBytes, _config.retentionRules, _config.retentionInterval, _config.retentionBandwidth);
+  }
 
-  if (bind(_socket, (struct sockaddr *)&_serverAddr, sizeof(_serverAddr)) < 0)
-    throw ServerException(SOCKET_BIND_FAILED);
+  // Every client needs a file descriptor, allow as many as the hard limit
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
 
-  Logging::Log("Server initialized on port " + std::to_string(_port));
-  if (listen(_socket, 5) < 0)
-    throw ServerException(SOCKET_LISTEN_FAILED);
+  if (listener != -1) {
+    // Handed off by the previous process, already bound and listening
+    _socket = listener;
+  } else {
+    _socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (_socket == -1)
+      throw ServerException(SOCKET_CREATION_FAILED);
+
+    _opt = 1;
+    if (setsockopt(_socket, SOL_SOCKET, SO_REUSEADDR, &_opt, sizeof(_opt)) < 0)
+      throw ServerException(SOCKET_OPT_FAILED);
+    // Every shard binds its own socket to the port, the kernel spreads the connections between them
+    if (setsockopt(_socket, SOL_SOCKET, SO_REUSEPORT, &_opt, sizeof(_opt)) < 0)
+      throw ServerException(SOCKET_OPT_FAILED);
+    _serverAddr.sin_family = AF_INET;
+    _serverAddr.sin_addr.s_addr = INADDR_ANY;
+    _serverAddr.sin_port = htons(_port);
+
+    if (bind(_socket, (struct sockaddr *)&_serverAddr, sizeof(_serverAddr)) < 0)
+      throw ServerException(SOCKET_BIND_FAILED);
+
+    Logging::Log("Server initialized on port " + std::to_string(_port));
+    if (listen(_socket, static_cast<int>(std::min<size_t>(_config.listenBacklog, INT_MAX))) < 0)
+      throw ServerException(SOCKET_LISTEN_FAILED);
+  }
+  _reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  _loop = _createLoop();
+  _loop->listen(_socket);
+  // Unix sockets cannot share a path between shards, the first one accepts every local client
+  if (_shard == 0 && !_config.localSocket.empty()) {
+    _localSocket = (localListener != -1) ? localListener : _listenLocal();
+    _loop->listen(_localSocket);
+    Logging::Log("Local clients accepted on " + _config.localSocket);
+  } else if (localListener != -1) {
+    close(localListener);
+  }
+  _group->attach(_shard, this);
+  // After a handoff, the versions continue those of the previous process
+  _group->names(_presenceVersion);
 
   Logging::Log("Server listening for incoming connections...");
   _running = true;
 }
 
-void Server::commandHelp(int client, const std::string &message)
+int Server::_listenLocal()
+{
+  struct sockaddr_un address = {};
+  int listener = -1;
+
+  if (_config.localSocket.size() >= sizeof(address.sun_path))
+    throw ServerException(LOCAL_SOCKET_FAILED + std::string(": path too long"));
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1)
+    throw ServerException(LOCAL_SOCKET_FAILED + std::string(": ") + strerror(errno));
+
+  address.sun_family = AF_UNIX;
+  std::strncpy(address.sun_path, _config.localSocket.c_str(), sizeof(address.sun_path) - 1);
+  // The file left by a previous process would fail the bind
+  unlink(_config.localSocket.c_str());
+  if (bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0
+      || listen(listener, static_cast<int>(std::min<size_t>(_config.listenBacklog, INT_MAX))) < 0) {
+    int error = errno;
+    close(listener);
+    throw ServerException(LOCAL_SOCKET_FAILED + std::string(": ") + strerror(error));
+  }
+  return listener;
+}
+
+void Server::commandHelp(int client, const Frame &frame)
 {
+  (void)frame; // Unused parameter
+
   std::string helpMessage = "Available commands:\n";
-  for (auto command : _commands) {
-    helpMessage += command.first + "\n";
+  for (size_t type = 0; type < _commands.size(); type++) {
+    if (_commands[type])
+      helpMessage += BinaryProtocol::toHeader(type) + "\n";
   }
 
-  sendToClient(client, BinaryProtocol::encode(helpMessage, SIMPLE_MESSAGE));
+  sendToClient(client, helpMessage, SIMPLE_MESSAGE);
 }
 
-void Server::commandList(int client, const std::string &body)
+Task<> Server::commandList(int client, const Frame &frame)
 {
-  (void)body; // Unused parameter
-
   std::string listMessage = "";
+  std::vector<std::string> names = frame.payload.empty() ? _group->names() : _group->members(std::string(frame.payload));
 
-  if (_clientsNames.size() == 0) {
+  if (names.size() == 0) {
     Logging::LogWarning("No clients connected");
-    return;
+    co_return;
   }
-  for (auto client : _clients) {
-    listMessage += _clientsNames[client] + ",";
+  for (auto name : names) {
+    listMessage += name + ",";
   }
 
-  sendToClient(client, BinaryProtocol::encode(listMessage, LIST_USERS));
+  // A large list is not dropped, the client reads it before its next message is executed
+  co_await write(client, listMessage, LIST_USERS);
 }
 
-void Server::clientLogin(int client, const std::string &body)
+Task<> Server::clientLogin(int client, const Frame &frame)
 {
-  std::string name = BinaryProtocol::decode(body);
-
-  int count = 0;
-  std::string new_name = "";
-
-  count = std::count(_loggedInClients.begin(), _loggedInClients.end(), name);
-
-  new_name = (count > 0) ? name + std::to_string(count) : name;
-  _clientsNames[client] = (_checkIfLoggedIn(client, name)) ? new_name : name;
-  Logging::Log("Client " + std::to_string(client) + " logged in as " + _clientsNames[client]);
-
-  _loggedInClients.push_back(new_name);
-  Logging::Log("Client just logged in");
+  std::string name(frame.payload);
+
+  // The format of the LOGIN message decides the protocol version for the rest of the session
+  _sessions.setProtocol(client, frame.version);
+  Logging::Log("Client " + std::to_string(client) + " uses protocol v" + std::to_string(frame.version));
+
+  // The client sends its messages for everyone to PUBLIC_TARGET, a user cannot take it. Nor
+  // can a name hold the separators of the name lists (','), of a rename ("old>new"), or of
+  // the target of a private message ("<name> <message>")
+  auto invalid = [](char c) { return c == ',' || c == '>' || std::isspace(static_cast<unsigned char>(c)); };
+  if (name.empty() || name == PUBLIC_TARGET || std::any_of(name.begin(), name.end(), invalid)) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot log in as " + name);
+    co_return;
+  }
 
-  sendToClient(client, BinaryProtocol::encode(_clientsNames[client], LOGIN));
-  for (auto client : _clients) {
-    commandList(client, "");
+  std::string previous = _sessions.name(client);
+  if (previous.empty()) {
+    _sessions.setName(client, _group->login(_shard, _sessions.handle(client), name));
+    // The login deadline is replaced by the heartbeat
+    _checkTimeouts(client);
+  } else {
+    // Logging in again renames the session, its channels follow the new name
+    for (const auto &channel : _sessions.channels(client))
+      _group->leave(channel, previous, _shard);
+    _sessions.setName(client, _group->rename(_shard, _sessions.handle(client), previous, name));
+    for (const auto &channel : _sessions.channels(client))
+      _group->join(channel, _sessions.name(client), _shard);
   }
+  Logging::Log("Client " + std::to_string(client) + " logged in as " + _sessions.name(client));
+  Logging::Log("Client just logged in");
 
-  saveClientToDatabase(client, _clientsNames[client]);
-}
+  sendToClient(client, _sessions.name(client), LOGIN);
+  _presenceChanged();
 
-void Server::initCommands()
-{
-  _commands[LOGIN] = &Server::clientLogin;
-  _commands[SIMPLE_MESSAGE] = &Server::commandsMessage;
-  _commands[LIST_USERS] = &Server::commandList;
+  // The account is created by the disk pool, the next messages of the client wait for it
+  std::string saved = _sessions.name(client);
+  std::function<void()> save = [this, client, saved]() { saveClientToDatabase(client, saved); };
+  co_await offload(client, std::move(save));
+  co_await _drainOffline(client, false);
 }
 
 void Server::initDatabase()
 {
   if (std::filesystem::is_directory(DB_PATH)) {
     Logging::Log("Database folder exists");
-    loadDatabase();
   } else {
     Logging::Log("Database folder does not exist, creating...");
     std::filesystem::create_directory(DB_PATH);
     Logging::Log("Database folder created");
   }
+  loadDatabase();
 }
 
 void Server::loadDatabase()
 {
-  for (const auto &entry : std::filesystem::directory_iterator(DB_PATH)) {
-    std::string filename = entry.path().filename().string();
-    std::string name = filename.substr(0, filename.find("."));
-    _loggedInClients.push_back(name);
-  }
+  // Mapped, not read: the names are searched in the registry when a client logs in
+  _group->openRegistry(DB_PATH);
 }
 
 void Server::saveClientToDatabase(int client, const std::string &name)
 {
-  if (!std::filesystem::is_directory(DB_PATH + name)) {
-    std::filesystem::create_directory(DB_PATH + name);
-    std::filesystem::create_directory(DB_PATH + name + "/messages");
-    std::ofstream file(DB_PATH + name + "/info.txt");
-    file << "Client: " << name << std::endl;
-    file << "Account created on " << Utils::getCurrentTime() << std::endl;
-    file << "Last login on " << Utils::getCurrentTime() << std::endl;
-    file.close();
-  }
+  (void)client; // Unused parameter
+
+  uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  UserRegistry::User user = _group->registry()->login(name, now);
+  if (user.created == now)
+    Logging::Log("Account " + std::to_string(user.id) + " created for " + name);
 }
 
 int Server::getClientFileDescriptor(const std::string &clientName)
 {
-  for (auto client : _clientsNames) {
-    if (client.second == clientName) {
-      return client.first;
+  int client = _sessions.find(clientName);
+
+  if (client == -1)
+    Logging::LogWarning("Client not found");
+  return client;
+}
+
+Task<> Server::sendPrivateMessage(int client, const Frame &frame)
+{
+  std::string_view arguments = frame.payload;
+  std::string target(Utils::nextToken(arguments, ' '));
+  std::string message(arguments);
+  std::string name = _sessions.name(client);
+  size_t targetShard = 0;
+  SessionTable::Handle targetHandle = 0;
+
+  // A client without a name has no sender to deliver nor to log the message with
+  if (name.empty()) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot send a private message before logging in");
+    co_return;
+  }
+  if (!_group->find(target, targetShard, targetHandle)) {
+    // A client with an account gets the message at its next login, an account named
+    // PUBLIC_TARGET, created before the name was refused, never logs in again
+    if (!message.empty() && target != PUBLIC_TARGET && _group->registry() != nullptr && _group->registry()->contains(target)) {
+      Logging::Log("Storing private message for " + target);
+      co_await persist(client, MessageLog::Kind::Offline, target, message);
+      co_return;
     }
+    Logging::LogError("Target client not found");
+    co_return;
   }
-  Logging::LogWarning("Client not found");
-  return -1;
+
+  Logging::Log("Sending private message to " + target);
+  _sendToName(target, name + ": " + message, SIMPLE_MESSAGE);
+
+  if (!message.empty())
+    co_await persist(client, MessageLog::Kind::Private, target, message);
 }
 
-void Server::sendPrivateMessage(int client, const std::string &decoded)
+Task<> Server::commandsMessage(int client, const Frame &frame)
 {
-  // check for message history in database
-  std::vector<std::string> tokens = Utils::split(decoded, ' ');
-  std::string target = tokens[1];
-  std::string message = (tokens.size() == 3) ? tokens[2] : "";
-  std::string to = MESSAGES_FOLDER(_clientsNames[client]) + target + ".txt";
-  int to_Target = getClientFileDescriptor(target);
+  // "/msg <target> <message>", the message is the rest of the payload
+  std::string_view message = frame.payload;
+  Utils::nextToken(message, ' ');
+  std::string_view target = Utils::nextToken(message, ' ');
+
+  if (message.empty())
+    co_return;
+  if (_sessions.name(client).empty()) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot send a message before logging in");
+    co_return;
+  }
+  if (target.substr(0, 1) != "#") {
+    std::string text(message);
+    broadcast(_sessions.name(client) + ": " + text);
+    co_await persist(client, MessageLog::Kind::Broadcast, "", text);
+    co_return;
+  }
 
-  if (to_Target == -1) {
-    Logging::LogError("Target client not found");
-    return;
+  auto channel = _sessions.channels(client).find(target);
+  if (channel == _sessions.channels(client).end()) {
+    Logging::LogWarning("Client " + std::to_string(client) + " is not in " + std::string(target));
+    co_return;
   }
+  std::string name = *channel;
+  std::string text(message);
+  _sendToChannel(name, name + " " + _sessions.name(client) + ": " + text);
+  co_await persist(client, MessageLog::Kind::Channel, name, text);
+}
 
-  _clientsPrivateMessagesIndex[client] = getClientFileDescriptor(target);
+Task<> Server::commandJoin(int client, const Frame &frame)
+{
+  std::string channel = (frame.payload.substr(0, 1) == "#") ? std::string(frame.payload) : "#" + std::string(frame.payload);
 
-  // search for a file with the target name
-  if (!std::filesystem::is_directory(MESSAGES_FOLDER(_clientsNames[client]) + target)) {
-    Logging::LogWarning("Target client not found");
+  if (_sessions.name(client).empty() || channel.size() < 2 || channel.find(' ') != std::string::npos) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot join " + channel);
+    co_return;
   }
+  if (!_group->join(channel, _sessions.name(client), _shard))
+    co_return;
+  _channels[channel].insert(client);
+  _sessions.channels(client).insert(channel);
+  _sendToChannel(channel, _sessions.name(client) + " joined " + channel);
+}
 
-  Logging::Log("Sending private message to " + target);
-  std::ofstream file(to, std::ios::app);
+Task<> Server::commandLeave(int client, const Frame &frame)
+{
+  std::string channel = (frame.payload.substr(0, 1) == "#") ? std::string(frame.payload) : "#" + std::string(frame.payload);
 
-  if (message.size() > 0) {
-    file << Utils::getCurrentTime() << " " << _clientsNames[client] << ": " << message << std::endl;
-    file.close();
+  if (!_leaveChannel(client, channel))
+    co_return;
+  sendToClient(client, _sessions.name(client) + " left " + channel, SIMPLE_MESSAGE);
+  _sendToChannel(channel, _sessions.name(client) + " left " + channel);
+}
+
+void Server::onAccept(int client)
+{
+  uint32_t address = 0;
+
+  // Local clients are not limited by address
+  if (_config.maxSessionsPerAddress > 0) {
+    struct sockaddr_storage peer;
+    socklen_t size = sizeof(peer);
+    if (getpeername(client, (struct sockaddr *)&peer, &size) == 0 && peer.ss_family == AF_INET)
+      address = reinterpret_cast<struct sockaddr_in *>(&peer)->sin_addr.s_addr;
   }
-  sendToClient(to_Target, BinaryProtocol::encode(_clientsNames[client] + ": " + message, SIMPLE_MESSAGE));
+  if (!_group->admit(address, _config.maxSessions, _config.maxSessionsPerAddress)) {
+    Logging::LogWarning("Connection refused, too many clients, socket fd was " + std::to_string(client));
+    close(client);
+    return;
+  }
+  Logging::Log("New connection, socket fd is " + std::to_string(client));
+  addClient(client, address);
 }
 
-void Server::commandsMessage(int client, const std::string &body)
+void Server::onAcceptError(int error)
 {
-  std::string message = "";
+  if (error == EMFILE || error == ENFILE) {
+    _shed();
+    return;
+  }
+  if (error != EBADF && error != EINVAL && error != ENOTSOCK && error != EOPNOTSUPP) {
+    // The connection failed, not the socket: ENOBUFS, ENOMEM, EPERM, EPROTO...
+    Logging::LogWarning(std::string("Failed to accept a connection: ") + strerror(error));
+    return;
+  }
+  errno = error;
+  perror("accept");
+  throw ServerException(SOCKET_ACCEPT_FAILED);
+}
 
-  std::string decoded = BinaryProtocol::decode(body);
-  std::vector<std::string> tokens = Utils::split(decoded, ' ');
+void Server::_shed()
+{
+  size_t refused = 0;
+  int client;
 
-  if (tokens.size() >= 3) {
-    message = Utils::join(std::vector<std::string>(tokens.begin() + 2, tokens.end()), " ");
-    broadcast(_clientsNames[client] + ": " + message);
+  if (_reserveFd == -1) {
+    Logging::LogError("Out of file descriptors, no descriptor reserved to refuse connections");
+    return;
   }
+  close(_reserveFd);
+  for (int listener : {_socket, _localSocket}) {
+    while (listener != -1 && (client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC)) != -1) {
+      close(client);
+      refused++;
+    }
+  }
+  _reserveFd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  Logging::LogError("Out of file descriptors, " + std::to_string(refused) + " connections refused");
 }
 
-void Server::_initFdSets()
+bool Server::onData(int client, const char *data, size_t size)
 {
-  FD_ZERO(&_readFds);
-  FD_ZERO(&_writeFds);
-  FD_ZERO(&_exceptFds);
+  SessionTable::Handle handle = _sessions.handle(client);
+
+  _sessions.touch(client, _clock());
+  _sessions.readBuffer(client).append(data, size);
+  try {
+    _deliver(client);
+  } catch (FrameBuffer::FrameBufferException &e) {
+    Logging::LogError("Invalid message from " + std::to_string(client) + ": " + e.what());
+    onClose(client);
+    return false;
+  }
+  // Nothing is read from the buffer while the coroutine is busy, nor rate limited, a client
+  // writing without waiting for it is disconnected (a legacy frame is 8 characters per byte)
+  if (_sessions.valid(handle) && _sessions.readBuffer(client).pending().size() > READ_AHEAD_FRAMES * (V1_HEADER_SIZE + 8 * _config.maxFrameSize)) {
+    Logging::LogWarning("Client " + std::to_string(client) + " sent too much ahead of its messages, disconnecting");
+    onClose(client);
+    return false;
+  }
+  return _sessions.valid(handle);
+}
+
+void Server::_deliver(int client)
+{
+  Coroutine &coroutine = _coroutines[client];
+
+  // While the coroutine is busy, the messages wait in the buffer until it reads them
+  if (coroutine.wait != Wait::Frame || !_sessions.readBuffer(client).next(*coroutine.frame))
+    return;
+  coroutine.frame = nullptr;
+  _resume(client);
+}
+
+void Server::_resume(int client)
+{
+  SessionTable::Handle handle = _sessions.handle(client);
+  std::coroutine_handle<> suspended = std::exchange(_coroutines[client].suspended, nullptr);
+
+  _coroutines[client].wait = Wait::None;
+  _resumed = client;
+  suspended.resume();
+  _resumed = -1;
+  // A coroutine removing its own client is destroyed here, once nothing runs it anymore
+  if (!_sessions.valid(handle) || _coroutines[client].task.done())
+    _coroutines[client] = Coroutine();
+}
+
+void Server::_wake(SessionTable::Handle handle, Wait wait)
+{
+  int client = SessionTable::client(handle);
+
+  // Paused for a handoff, the session goes on in the new process
+  if (_paused || !_sessions.valid(handle) || _coroutines[client].wait != wait)
+    return;
+  _resume(client);
+}
+
+Task<> Server::_session(int client)
+{
+  SessionTable::Handle handle = _sessions.handle(client);
+  Frame frame;
+  bool failed = false;
+
+  try {
+    while (_sessions.valid(handle)) {
+      if (!co_await readFrame(client, frame)) {
+        failed = true;
+        break;
+      }
+      co_await _interpretMessage(client, frame);
+    }
+  } catch (std::exception &e) {
+    Logging::LogError("Session of " + std::to_string(client) + " failed: " + e.what());
+    failed = true;
+  }
+  if (failed && _sessions.valid(handle))
+    onClose(client);
+}
 
-  FD_SET(_socket, &_readFds);
-  FD_SET(_socket, &_exceptFds);
+Server::FrameAwaiter Server::readFrame(int client, Frame &frame)
+{
+  return FrameAwaiter(*this, client, frame);
+}
 
-  for (auto client : _clients) {
-    FD_SET(client, &_readFds);
-    FD_SET(client, &_exceptFds);
+bool Server::FrameAwaiter::await_ready()
+{
+  try {
+    return _server._sessions.readBuffer(_client).next(_frame);
+  } catch (FrameBuffer::FrameBufferException &e) {
+    Logging::LogError("Invalid message from " + std::to_string(_client) + ": " + e.what());
+    _valid = false;
+    return true;
   }
 }
 
-void Server::readFromClients()
+void Server::FrameAwaiter::await_suspend(std::coroutine_handle<> coroutine)
 {
-  for (auto it = _clients.begin(); it != _clients.end(); ) {
-    int client = *it;
+  Coroutine &session = _server._coroutines[_client];
 
-    if (FD_ISSET(client, &_readFds)) {
-      char buffer[1024] = {0};
-      int valread = read(client, buffer, sizeof(buffer));
+  session.suspended = coroutine;
+  session.wait = Wait::Frame;
+  session.frame = &_frame;
+}
 
-      if (valread == 0) {
-          Logging::LogWarning("Client disconnected: " + std::to_string(client));
-          broadcast(_clientsNames[client] + " has disconnected");
+void Server::Wakeup::await_suspend(std::coroutine_handle<> coroutine)
+{
+  Coroutine &session = _server._coroutines[_client];
 
-          removeClient(client);
+  session.suspended = coroutine;
+  session.wait = _wait;
+}
 
-          for (auto client : _loggedInClients)
-            Logging::Log("Logged in clients: " + client);
-      } else {
-          // Logging::Log("Message from " + std::to_string(client) + ": " + std::string(BinaryProtocol::decode(buffer)));
-          _interpretMessage(client, buffer);
-          ++it;
-      }
-    } else {
-        ++it;
+Server::Wakeup Server::write(int client, const std::string &message, const std::string &header)
+{
+  _loop->send(client, std::make_shared<const std::string>(BinaryProtocol::encode(message, header, _sessions.protocol(client))));
+  return Wakeup(*this, client, (_loop->pending(client) > _config.outboundHighWatermark) ? Wait::Drain : Wait::None);
+}
+
+Server::Wakeup Server::sleep(int client, uint64_t milliseconds)
+{
+  _sleepers.arm(client, _clock() + milliseconds);
+  return Wakeup(*this, client, Wait::Sleep);
+}
+
+Server::Wakeup Server::offload(int client, std::function<void()> work)
+{
+  SessionTable::Handle handle = _sessions.handle(client);
+  ShardGroup *group = _group.get();
+  size_t shard = _shard;
+
+  // The group outlives its disk pool, the completion is posted back to this shard
+  std::function<void()> task = [work = std::move(work), group, shard, handle]() {
+    try {
+      work();
+    } catch (std::exception &e) {
+      Logging::LogError(std::string("Offloaded task failed: ") + e.what());
     }
+    group->post(shard, [handle](Server &server) { server._wake(handle, Wait::Offload); });
+  };
+
+  // Behind the tasks already waiting for room, so they keep their order
+  if (!_offloads.empty() || !_group->offload(task))
+    _offloads.push_back(std::move(task));
+  return Wakeup(*this, client, Wait::Offload);
+}
+
+void Server::resumeOffloads()
+{
+  while (!_offloads.empty() && _group->offload(_offloads.front()))
+    _offloads.pop_front();
+}
+
+Server::Wakeup Server::persist(int client, MessageLog::Kind kind, const std::string &target, const std::string &text)
+{
+  MessageLog *log = _group->log();
+  MessageLog::Record record;
+
+  if (log == nullptr)
+    return Wakeup(*this, client, Wait::None);
+  record.kind = kind;
+  record.sender = _sessions.name(client);
+  record.target = target;
+  record.text = text;
+  // Never appended, it would wait for room forever, CHAT_MAX_FRAME_SIZE keeps messages below
+  if (MessageLog::size(record) > MESSAGE_LOG_HEADER_SIZE + MESSAGE_LOG_MAX_RECORD) {
+    Logging::LogError("Message of client " + std::to_string(client) + " too large to be logged");
+    return Wakeup(*this, client, Wait::None);
   }
+  // Behind the records already waiting for room, so they keep their order
+  if (_records.empty() && log->append(record))
+    return Wakeup(*this, client, Wait::None);
+  _records.emplace_back(_sessions.handle(client), std::move(record));
+  return Wakeup(*this, client, Wait::Log);
+}
+
+void Server::resumeLog()
+{
+  while (!_records.empty() && _group->log()->append(_records.front().second)) {
+    SessionTable::Handle handle = _records.front().first;
+    _records.pop_front();
+    // The session may append again, behind the records still waiting
+    _wake(handle, Wait::Log);
+  }
+}
+
+MessageLog::Sync Server::_logSync() const
+{
+  if (_config.logSync == "none")
+    return MessageLog::Sync::None;
+  if (_config.logSync == "batch")
+    return MessageLog::Sync::Batch;
+  if (_config.logSync != "interval")
+    Logging::LogWarning("Unknown log sync policy " + _config.logSync + ", using interval");
+  return MessageLog::Sync::Interval;
+}
+
+void Server::onClose(int client)
+{
+  std::string name = _sessions.name(client);
+
+  Logging::LogWarning("Client disconnected: " + std::to_string(client));
+  removeClient(client);
+  broadcast(name + " has disconnected");
+}
+
+void Server::onWake()
+{
+  for (auto &task : _group->take(_shard))
+    task(*this);
+}
+
+void Server::onFlushed(int client)
+{
+  size_t pending = _loop->pending(client);
+  bool congested = _sessions.congested(client);
+
+  if (!congested && pending > _config.outboundHighWatermark && _sessions.contains(client)) {
+    Logging::LogWarning("Client " + std::to_string(client) + " is a slow consumer, " + std::to_string(pending) + " bytes queued");
+    // Messages are dropped until the queue drains, or until the disconnection
+    _sessions.setCongested(client, true);
+    if (_config.slowConsumerPolicy == "disconnect")
+      _slowClients.push_back(client);
+  } else if (congested && pending <= _config.outboundLowWatermark) {
+    Logging::Log("Client " + std::to_string(client) + " caught up, " + std::to_string(_sessions.dropped(client)) + " messages dropped");
+    _sessions.setCongested(client, false);
+  }
+  // Resumed from the mailbox, not in the middle of the loop writing the queues
+  if (pending <= _config.outboundLowWatermark && _sessions.contains(client) && _coroutines[client].wait == Wait::Drain) {
+    _coroutines[client].wait = Wait::Ready;
+    _group->post(_shard, [handle = _sessions.handle(client)](Server &server) { server._wake(handle, Wait::Ready); });
+  }
+}
+
+void Server::wake()
+{
+  _loop->wake();
+}
+
+std::unique_ptr<EventLoop> Server::_createLoop()
+{
+  if (_config.ioBackend == "io_uring") {
+    try {
+      std::unique_ptr<EventLoop> loop = std::make_unique<UringLoop>(*this);
+      Logging::Log("Using the io_uring event loop");
+      return loop;
+    } catch (EventLoop::EventLoopException &e) {
+      Logging::LogWarning(std::string(e.what()) + ", falling back to epoll");
+    }
+  } else if (_config.ioBackend != "epoll") {
+    Logging::LogWarning("Unknown I/O backend " + _config.ioBackend + ", using epoll");
+  }
+  Logging::Log("Using the epoll event loop");
+  return std::make_unique<EpollLoop>(*this);
 }
 
 void Server::run()
@@ -246,108 +697,632 @@ void Server::run()
   if (!_running)
       throw ServerException(SERVER_NOT_RUNNING);
 
-  while (true) {
-    _initFdSets();
-    _maxFd = _socket;
+  if (_config.pinThreads) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(_shard % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+      Logging::LogWarning("Failed to pin shard " + std::to_string(_shard));
+  }
 
-    for (auto client : _clients) {
-      if (client > _maxFd)
-        _maxFd = client;
-    }
+  while (_running) {
+    uint64_t now = _clock();
+    int timeout = _paused ? -1 : _timers.timeout(now);
+    int sleeping = _paused ? -1 : _sleepers.timeout(now);
 
-    int activity = select(_maxFd + 1, &_readFds, nullptr, nullptr, nullptr);
-    if (activity < 0)
-      throw ServerException(SELECT_FAILED);
-
-    _clientAddrLen = sizeof(_clientAddr);
-    // Check for new connections
-    if (FD_ISSET(_socket, &_readFds)) {
-      int newClient = accept(_socket, (struct sockaddr *)&_clientAddr, (socklen_t *)&_clientAddrLen);
-      if (newClient < 0) {
-          perror("accept");
-          throw ServerException(SOCKET_ACCEPT_FAILED + std::to_string(newClient));
-      }
+    if (sleeping != -1)
+      timeout = (timeout == -1) ? sleeping : std::min(timeout, sleeping);
 
-      Logging::Log("New connection, socket fd is " + std::to_string(newClient));
-      addClient(newClient);
+    if (_presenceScheduled) {
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(_presenceDeadline - std::chrono::steady_clock::now());
+      timeout = (timeout == -1) ? std::max<int>(0, left.count()) : std::min(timeout, std::max<int>(0, left.count()));
     }
+    _loop->poll(timeout);
+    // Handed off, the sessions belong to the new process
+    if (!_running)
+      break;
+    _now = _clock();
+    // Paused for a handoff, a timer could still disconnect a client and notify the other shards
+    if (_paused)
+      _expired.clear();
+    else
+      _timers.advance(_now, _expired);
+    for (int client : _expired)
+      _checkTimeouts(client);
+    _expired.clear();
+    if (!_paused)
+      _sleepers.advance(_now, _expired);
+    for (int client : _expired)
+      _wake(_sessions.handle(client), Wait::Sleep);
+    _expired.clear();
+    if (_presenceScheduled && std::chrono::steady_clock::now() >= _presenceDeadline)
+      _flushPresence();
+    writeToClients();
+  }
+}
 
-    // Handle client messages
-    readFromClients();
+void Server::writeToClients()
+{
+  _loop->flush();
+  // Disconnecting broadcasts a message, whose flush may find more slow consumers
+  while (!_slowClients.empty()) {
+    std::vector<int> slowClients;
+
+    slowClients.swap(_slowClients);
+    for (int client : slowClients) {
+      Logging::LogWarning("Disconnecting slow consumer " + std::to_string(client));
+      onClose(client);
+    }
+    _loop->flush();
+  }
+}
+
+
+void Server::pause()
+{
+  _loop->pause();
+  _paused = true;
+}
+
+void Server::handOff(Handoff::State &state)
+{
+  // The presence changes still gathered are sent with the rest of the queued bytes
+  if (_presenceScheduled)
+    _flushPresence();
+  _loop->flush();
+  _slowClients.clear();
+  // The records the full log still refuses are lost with this process
+  resumeLog();
+  if (!_records.empty())
+    Logging::LogWarning("Shard " + std::to_string(_shard) + " drops " + std::to_string(_records.size()) + " records refused by the message log");
+
+  state.listeners.push_back(_socket);
+  state.localListener = _localSocket;
+  for (int client : _sessions.clients()) {
+    Handoff::Session session;
+
+    session.fd = client;
+    session.address = _sessions.address(client);
+    session.protocol = _sessions.protocol(client);
+    session.subscribed = _sessions.subscribed(client);
+    session.name = _sessions.name(client);
+    session.channels.assign(_sessions.channels(client).begin(), _sessions.channels(client).end());
+    session.readBuffer = std::string(_sessions.readBuffer(client).pending());
+    session.unsent = _loop->detach(client);
+    if (_sessions.sharedChannel(client)) {
+      session.sharedMemory = _sessions.sharedChannel(client)->memory();
+      session.serverSignal = _sessions.sharedChannel(client)->serverSignal();
+      session.clientSignal = _sessions.sharedChannel(client)->clientSignal();
+    }
+    state.sessions.push_back(std::move(session));
   }
+  Logging::Log("Shard " + std::to_string(_shard) + " handed off " + std::to_string(state.sessions.size()) + " sessions");
+  // The descriptors stay open until the process exits, after the new one received them
+  _running = false;
 }
 
+void Server::adopt(const Handoff::Session &session)
+{
+  int client = session.fd;
+
+  _group->admit(session.address, 0, 0);
+  addClient(client, session.address);
+  _sessions.setProtocol(client, session.protocol);
+  if (session.subscribed)
+    _sessions.subscribe(client);
+  _sessions.readBuffer(client).append(session.readBuffer.data(), session.readBuffer.size());
+  if (!session.name.empty()) {
+    _sessions.setName(client, _group->adopt(_shard, _sessions.handle(client), session.name));
+    _checkTimeouts(client);
+    for (const auto &channel : session.channels) {
+      _group->join(channel, _sessions.name(client), _shard);
+      _channels[channel].insert(client);
+      _sessions.channels(client).insert(channel);
+    }
+  }
+  if (session.sharedMemory != -1) {
+    try {
+      std::shared_ptr<SharedChannel> channel = std::make_shared<SharedChannel>(session.sharedMemory,
+          session.serverSignal, session.clientSignal, SharedChannel::Side::Server);
+      _sessions.setSharedChannel(client, channel);
+      _loop->share(client, channel);
+    } catch (SharedChannel::SharedChannelException &e) {
+      Logging::LogError("Client " + std::to_string(client) + ": " + e.what());
+    }
+  }
+  if (!session.unsent.empty())
+    _loop->send(client, std::make_shared<const std::string>(session.unsent));
+  // Messages received while the previous process was busy with the session are still buffered
+  try {
+    _deliver(client);
+  } catch (FrameBuffer::FrameBufferException &e) {
+    Logging::LogError("Invalid message from " + std::to_string(client) + ": " + e.what());
+    onClose(client);
+  }
+}
 
 void Server::stop()
 {
   close(_socket);
+  if (_localSocket != -1) {
+    close(_localSocket);
+    unlink(_config.localSocket.c_str());
+  }
+  _localSocket = -1;
+  if (_reserveFd != -1)
+    close(_reserveFd);
+  _reserveFd = -1;
 }
 
-void Server::addClient(int client)
+void Server::addClient(int client, uint32_t address)
 {
-  _clients.push_back(client);
-  Logging::Log("Client added, total clients: " + std::to_string(_clients.size()));
+  _sessions.add(client, address);
+  _sessions.touch(client, _clock());
+  if (_config.loginTimeout > 0)
+    _timers.arm(client, _sessions.lastSeen(client) + _config.loginTimeout * 1000);
+  _loop->add(client);
+  if (static_cast<size_t>(client) >= _coroutines.size())
+    _coroutines.resize(client + 1);
+  _coroutines[client] = Coroutine();
+  _coroutines[client].task = _session(client);
+  _coroutines[client].suspended = _coroutines[client].task.handle();
+  _resume(client);
+  Logging::Log("Client added, total clients: " + std::to_string(_sessions.size()));
 
 }
 
 void Server::removeClient(int client)
 {
-    FD_CLR(client, &_readFds);
-    FD_CLR(client, &_exceptFds);
+  _timers.cancel(client);
+  _sleepers.cancel(client);
+  // A coroutine removing its own client is destroyed once it suspends, see _resume()
+  if (client != _resumed && static_cast<size_t>(client) < _coroutines.size())
+    _coroutines[client] = Coroutine();
+  _loop->remove(client);
+  close(client);
+
+  for (const auto &channel : SessionTable::Channels(_sessions.channels(client)))
+    _leaveChannel(client, channel);
+  if (!_sessions.name(client).empty()) {
+    _group->logout(_sessions.name(client));
+    _presenceChanged();
+  }
+  if (_sessions.contains(client))
+    _group->release(_sessions.address(client));
+  _sessions.remove(client);
+  // A slow consumer waiting for its disconnection is gone already
+  if (!_slowClients.empty())
+    _slowClients.erase(std::remove(_slowClients.begin(), _slowClients.end(), client), _slowClients.end());
+
+  Logging::Log("Client removed, total clients: " + std::to_string(_sessions.size()));
+}
 
-    close(client);
+void Server::broadcast(const std::string &message)
+{
+  _broadcastLocal(message);
+  _group->postToOthers(_shard, [message](Server &shard) { shard._broadcastLocal(message); });
+}
 
-    if (_loggedInClients.size() > 0)
-      _loggedInClients.erase(std::remove(_loggedInClients.begin(), _loggedInClients.end(), _clientsNames[client]), _loggedInClients.end());
+void Server::_broadcastLocal(const std::string &message)
+{
+  // Encode once per protocol version, and queue the same buffer for every client
+  std::map<int, EventLoop::Buffer> bodies;
 
+  for (auto client : _sessions.clients())
+    sendToClient(client, _encodeFor(client, message, SIMPLE_MESSAGE, bodies));
+  Logging::Log("Broadcasting message to " + std::to_string(_sessions.size()) + " clients: " + message);
+}
 
-    if (_clientsNames.find(client) != _clientsNames.end())
-      _clientsNames.erase(client);
+const EventLoop::Buffer &Server::_encodeFor(int client, const std::string &message, const std::string &header, std::map<int, EventLoop::Buffer> &bodies)
+{
+  int protocol = _sessions.protocol(client);
+  EventLoop::Buffer &body = bodies[protocol];
 
-    if (_clients.size() > 0)
-      _clients.erase(std::remove(_clients.begin(), _clients.end(), client), _clients.end());
+  if (!body)
+    body = std::make_shared<const std::string>(BinaryProtocol::encode(message, header, protocol));
+  return body;
+}
 
-    Logging::Log("Client removed, total clients: " + std::to_string(_clients.size()));
+void Server::_sendToChannel(const std::string &channel, const std::string &message)
+{
+  for (size_t shard : _group->channelShards(channel)) {
+    if (shard == _shard)
+      _sendToChannelLocal(channel, message);
+    else
+      _group->post(shard, [channel, message](Server &owner) { owner._sendToChannelLocal(channel, message); });
+  }
 }
 
-void Server::broadcast(const std::string &message)
+void Server::_sendToChannelLocal(const std::string &channel, const std::string &message)
 {
-  std::string body = BinaryProtocol::encode(message, SIMPLE_MESSAGE);
+  auto members = _channels.find(channel);
+  std::map<int, EventLoop::Buffer> bodies;
 
-  for (auto client : _clients) {
-    sendToClient(client, body);
-    Logging::Log("Broadcasting message to " + std::to_string(client) + ": " + message);
-  }
+  if (members == _channels.end())
+    return;
+  for (int client : members->second)
+    sendToClient(client, _encodeFor(client, message, SIMPLE_MESSAGE, bodies));
+  Logging::Log("Sending message to " + std::to_string(members->second.size()) + " members of " + channel + ": " + message);
+}
+
+bool Server::_leaveChannel(int client, const std::string &channel)
+{
+  auto members = _channels.find(channel);
+
+  if (members == _channels.end() || members->second.erase(client) == 0)
+    return false;
+  if (members->second.empty())
+    _channels.erase(members);
+  _sessions.channels(client).erase(channel);
+  _group->leave(channel, _sessions.name(client), _shard);
+  return true;
 }
 
 void Server::sendToClient(int client, const std::string &message)
 {
-  send(client, message.c_str(), message.size(), 0);
+  sendToClient(client, std::make_shared<const std::string>(message));
+}
+
+void Server::sendToClient(int client, const EventLoop::Buffer &message)
+{
+  if (_sessions.congested(client)) {
+    _sessions.drop(client);
+    return;
+  }
+  _loop->send(client, message);
+}
+
+void Server::sendToClient(int client, const std::string &message, const std::string &header)
+{
+  sendToClient(client, BinaryProtocol::encode(message, header, _sessions.protocol(client)));
+}
+
+Task<> Server::_interpretMessage(int client, Frame &frame)
+{
+  // Checked before unpacking, so a flood costs as little as possible
+  if (!_withinRate(client, frame))
+    return Task<>();
+  if (!BinaryProtocol::unpack(frame, _payload)) {
+    Logging::LogWarning("Invalid message from " + std::to_string(client));
+    return Task<>();
+  }
+
+  Command command = _commands[frame.type];
+  if (!command)
+    return Task<>();
+  return (this->*command)(client, frame);
+}
+
+void Server::_initRateLimits()
+{
+  _rateBuckets.fill(NO_BUCKET);
+  _rateLimits.assign(1, RateLimit{static_cast<double>(_config.byteRate), static_cast<double>(_config.byteBurst)});
+  for (const auto &limit : _config.rateLimits) {
+    if (_rateLimits.size() == NO_BUCKET)
+      break;
+    _rateBuckets[limit.first] = _rateLimits.size();
+    _rateLimits.push_back(limit.second);
+  }
+}
+
+bool Server::_withinRate(int client, const Frame &frame)
+{
+  uint64_t now = _sessions.lastSeen(client);
+  uint8_t bucket = _rateBuckets[frame.type];
+  bool bytes = _config.byteRate == 0 || _sessions.bucket(client, BYTE_BUCKET).take(frame.length, _rateLimits[BYTE_BUCKET], now);
+
+  if (bytes && (bucket == NO_BUCKET || _sessions.bucket(client, bucket).take(1, _rateLimits[bucket], now))) {
+    _sessions.setThrottled(client, false);
+    return true;
+  }
+  if (!_sessions.throttled(client)) {
+    _sessions.setThrottled(client, true);
+    Logging::LogWarning("Client " + std::to_string(client) + " is over its rate limit, dropping its messages");
+    sendToClient(client, std::to_string(frame.type), RATE_LIMITED);
+  }
+  return false;
+}
+
+Task<> Server::commandPresence(int client, const Frame &frame)
+{
+  (void)frame; // Unused parameter
+
+  _sessions.subscribe(client);
+  co_await write(client, *_group->presenceSnapshot(), PRESENCE);
+}
+
+void Server::_presenceChanged()
+{
+  _schedulePresence();
+  _group->postToOthers(_shard, [](Server &shard) { shard._schedulePresence(); });
+}
+
+void Server::_schedulePresence()
+{
+  if (_presenceScheduled)
+    return;
+  _presenceScheduled = true;
+  _presenceDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_config.presenceWindow);
+}
+
+Task<> Server::commandSharedMemory(int client, const Frame &frame)
+{
+  (void)frame; // Unused parameter
+
+  struct sockaddr_storage local;
+  socklen_t size = sizeof(local);
+  std::shared_ptr<SharedChannel> channel;
+
+  // Only for the clients of the Unix socket, and while nothing is queued before the answer
+  if (_config.sharedRingSize == 0 || _sessions.sharedChannel(client) || _loop->pending(client) > 0
+      || getsockname(client, (struct sockaddr *)&local, &size) == -1 || local.ss_family != AF_UNIX) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot use a shared memory channel");
+    sendToClient(client, "", SHARED_MEMORY);
+    co_return;
+  }
+  try {
+    channel = std::make_shared<SharedChannel>(_config.sharedRingSize);
+  } catch (SharedChannel::SharedChannelException &e) {
+    Logging::LogError(e.what());
+    sendToClient(client, "", SHARED_MEMORY);
+    co_return;
+  }
+
+  // Sent right away, as the descriptors go with the bytes. A Unix socket sends a message this
+  // small whole or not at all
+  std::string answer = BinaryProtocol::encode(std::to_string(channel->capacity()), SHARED_MEMORY, _sessions.protocol(client));
+  int fds[3] = {channel->memory(), channel->serverSignal(), channel->clientSignal()};
+  alignas(struct cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {&answer[0], answer.size()};
+  struct msghdr message = {};
+
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  struct cmsghdr *rights = CMSG_FIRSTHDR(&message);
+  rights->cmsg_level = SOL_SOCKET;
+  rights->cmsg_type = SCM_RIGHTS;
+  rights->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(rights), fds, sizeof(fds));
+  if (sendmsg(client, &message, MSG_DONTWAIT | MSG_NOSIGNAL) != static_cast<ssize_t>(answer.size())) {
+    Logging::LogWarning("Failed to send a shared memory channel to " + std::to_string(client) + ": " + strerror(errno));
+    sendToClient(client, "", SHARED_MEMORY);
+    co_return;
+  }
+
+  _sessions.setSharedChannel(client, channel);
+  _loop->share(client, channel);
+  Logging::Log("Client " + std::to_string(client) + " uses a shared memory channel of " + std::to_string(channel->capacity()) + " bytes");
+}
+
+Task<> Server::commandHistory(int client, const Frame &frame)
+{
+  std::string_view arguments = frame.payload;
+  std::string target(Utils::nextToken(arguments, ' '));
+  std::string count(Utils::nextToken(arguments, ' '));
+  std::string before(Utils::nextToken(arguments, ' '));
+  std::string name = _sessions.name(client);
+  HistoryStore *history = _group->history();
+  std::string conversation;
+
+  // Only the conversations a logged in client takes part in
+  if (!name.empty()) {
+    if (target == "*")
+      conversation = target;
+    else if (target.substr(0, 1) == "#" && _sessions.channels(client).count(target) > 0)
+      conversation = target;
+    else if (!target.empty() && target.substr(0, 1) != "#")
+      conversation = HistoryStore::conversation(MessageLog::Kind::Private, name, target);
+  }
+  if (conversation.empty() || history == nullptr) {
+    Logging::LogWarning("Client " + std::to_string(client) + " cannot read the history of " + target);
+    co_await write(client, "0", HISTORY);
+    co_return;
+  }
+
+  size_t limit = count.empty() ? HISTORY_DEFAULT_COUNT : std::min<size_t>(std::strtoull(count.c_str(), nullptr, 10), HISTORY_MAX_COUNT);
+  uint64_t cursor = std::strtoull(before.c_str(), nullptr, 10);
+  size_t budget = _config.maxFrameSize;
+  auto answer = std::make_shared<std::string>();
+
+  // The answer fits in a frame, the older messages are left to the next page
+  std::function<void()> read = [history, conversation, limit, cursor, budget, answer]() {
+    std::vector<std::string> lines;
+    size_t size = 0;
+    uint64_t oldest = 0;
+    bool more = history->read(conversation, cursor, limit, [&](const MessageLog::RecordView &record) {
+      std::string line = _formatRecord(record);
+      if (!lines.empty() && size + line.size() + 1 > budget)
+        return false;
+      size += line.size() + 1;
+      oldest = record.sequence;
+      lines.push_back(std::move(line));
+      return true;
+    });
+    *answer = std::to_string(more ? oldest : 0);
+    answer->reserve(answer->size() + size);
+    for (auto line = lines.rbegin(); line != lines.rend(); line++)
+      *answer += "\n" + *line;
+  };
+  co_await offload(client, std::move(read));
+  co_await write(client, *answer, HISTORY);
 }
 
-void Server::_interpretMessage(int client, const std::string &message)
+Task<> Server::commandOffline(int client, const Frame &frame)
 {
-  std::string header = BinaryProtocol::getHeader(message);
-  int targetClient = 0;
+  (void)frame; // Unused parameter
+
+  co_await _drainOffline(client, true);
+}
 
-  Logging::Log("Header: " + header);
-  std::string body = BinaryProtocol::decode(message);
+Task<> Server::_drainOffline(int client, bool always)
+{
+  std::string name = _sessions.name(client);
+  HistoryStore *history = _group->history();
+  MessageLog *log = _group->log();
+
+  if (name.empty() || history == nullptr || log == nullptr) {
+    if (always)
+      co_await write(client, "0", OFFLINE);
+    co_return;
+  }
 
-  std::cout << "Body: " << body << std::endl;
-  for (auto command : _commands) {
-    if (header == command.first) {
-      (this->*command.second)(client, message);
+  // The messages stored before now, and the acknowledgements of the previous drains, are
+  // indexed once written: the disk thread waits for them before reading the queue
+  uint64_t written = log->nextSequence();
+  uint64_t after = 0;
+  size_t sent = 0;
+  size_t budget = _config.maxFrameSize;
+
+  while (sent < _config.offlineDrain) {
+    size_t limit = std::min(_config.offlineBatch, _config.offlineDrain - sent);
+    auto batch = std::make_shared<OfflineBatch>();
+    std::function<void()> read = [log, history, name, written, after, limit, budget, batch]() {
+      if (!log->waitWritten(written))
+        Logging::LogWarning("Message log: offline messages for " + name + " may be missing, some records could not be written");
+      batch->remaining = history->readOffline(name, after, limit, [&](const MessageLog::RecordView &record) {
+        std::string line = _formatRecord(record);
+        if (batch->count > 0 && batch->lines.size() + line.size() + 1 > budget)
+          return false;
+        batch->lines += "\n" + line;
+        batch->count++;
+        batch->last = record.sequence;
+        return true;
+      });
+    };
+    co_await offload(client, std::move(read));
+    if (batch->count == 0 && (sent > 0 || !always))
+      break;
+    co_await write(client, std::to_string(batch->remaining) + batch->lines, OFFLINE);
+    if (batch->count == 0)
+      break;
+
+    // Handed to the client, the messages leave its queue once the acknowledgement is written
+    co_await persist(client, MessageLog::Kind::Delivered, name, std::to_string(batch->last));
+    sent += batch->count;
+    after = batch->last;
+    if (batch->remaining == 0)
+      break;
+  }
+  if (sent > 0)
+    Logging::Log("Sent " + std::to_string(sent) + " offline messages to " + name);
+}
+
+std::string Server::_formatRecord(const MessageLog::RecordView &record)
+{
+  return std::to_string(record.sequence) + " " + std::to_string(record.time) + " " + std::string(record.sender)
+    + " " + std::to_string(record.text.size()) + " " + std::string(record.text);
+}
+
+Task<> Server::commandPing(int client, const Frame &frame)
+{
+  sendToClient(client, std::string(frame.payload), PONG);
+  co_return;
+}
+
+Task<> Server::commandPong(int client, const Frame &frame)
+{
+  (void)client; // Unused parameter
+  (void)frame; // Unused parameter
+  co_return;
+}
+
+void Server::_checkTimeouts(int client)
+{
+  if (!_sessions.contains(client))
+    return;
+
+  uint64_t lastSeen = _sessions.lastSeen(client);
+  uint64_t silence = (_now > lastSeen) ? _now - lastSeen : 0;
+  uint64_t heartbeat = _config.heartbeatInterval * 1000;
+  uint64_t idle = _config.idleTimeout * 1000;
+  uint64_t next = UINT64_MAX;
+
+  if (_sessions.name(client).empty()) {
+    Logging::LogWarning("Client " + std::to_string(client) + " did not log in in time");
+    onClose(client);
+    return;
+  }
+  if (idle > 0) {
+    if (silence >= idle) {
+      Logging::LogWarning("Disconnecting idle client " + std::to_string(client));
+      onClose(client);
       return;
     }
+    next = lastSeen + idle;
   }
+  if (heartbeat > 0) {
+    if (silence >= heartbeat) {
+      sendToClient(client, "", PING);
+      next = std::min(next, _now + heartbeat);
+    } else {
+      next = std::min(next, lastSeen + heartbeat);
+    }
+  }
+  if (next == UINT64_MAX)
+    _timers.cancel(client);
+  else
+    _timers.arm(client, next);
 }
-bool Server::_checkIfLoggedIn(int client, const std::string &message)
+
+uint64_t Server::_clock()
 {
-  for (auto name : _clientsNames) {
-    if (name.second == message) {
-      Logging::LogWarning("Client already logged in: " + message);
-      return true;
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void Server::_flushPresence()
+{
+  std::vector<std::string> changes;
+  uint64_t version = 0;
+  std::string delta = "";
+  std::shared_ptr<const std::string> list;
+  std::map<int, EventLoop::Buffer> deltas;
+  std::map<int, EventLoop::Buffer> lists;
+
+  _presenceScheduled = false;
+  // Changes no longer kept are replaced by a snapshot, which tells the clients to start over
+  if (_group->presenceSince(_presenceVersion, changes, version)) {
+    delta = std::to_string(_presenceVersion) + "," + std::to_string(version) + ",";
+    for (const auto &change : changes)
+      delta += change + ",";
+  } else {
+    delta = *_group->presenceSnapshot();
+  }
+  if (version == _presenceVersion)
+    return;
+
+  // Every message is built and encoded once, and shared by the clients using the same
+  // protocol, the list of names by every shard
+  for (auto client : _sessions.clients()) {
+    if (_sessions.subscribed(client)) {
+      sendToClient(client, _encodeFor(client, delta, PRESENCE, deltas));
+      continue;
     }
+    if (!list)
+      list = _group->nameList();
+    sendToClient(client, _encodeFor(client, *list, LIST_USERS, lists));
   }
-  return false;
+  _presenceVersion = version;
+}
+
+bool Server::_sendToName(const std::string &name, const std::string &message, const std::string &header)
+{
+  size_t shard = 0;
+  SessionTable::Handle handle = 0;
+
+  if (!_group->find(name, shard, handle))
+    return false;
+  if (shard == _shard) {
+    if (!_sessions.valid(handle))
+      return false;
+    sendToClient(SessionTable::client(handle), message, header);
+    return true;
+  }
+  // The owning shard checks the handle, the session may be gone by then
+  _group->post(shard, [handle, message, header](Server &owner) {
+    if (owner._sessions.valid(handle))
+      owner.sendToClient(SessionTable::client(handle), message, header);
+  });
+  return true;
 }
@@ -0,0 +1,218 @@
+#include "SessionTable.hpp"
+
+#include <algorithm>
+
+SessionTable::SessionTable(size_t maxFrameSize, size_t buckets) : _maxFrameSize(maxFrameSize), _bucketCount(buckets)
+{
+}
+
+void SessionTable::_grow(int client)
+{
+  size_t size = static_cast<size_t>(client) + 1;
+
+  if (size <= _generations.size())
+    return;
+  _generations.resize(size, 0);
+  _positions.resize(size, NO_POSITION);
+  _protocols.resize(size, PROTOCOL_V1);
+  _congested.resize(size, 0);
+  _subscribed.resize(size, 0);
+  _lastSeen.resize(size, 0);
+  _throttled.resize(size, 0);
+  _buckets.resize(size * _bucketCount);
+  _names.resize(size);
+  _readBuffers.resize(size, FrameBuffer(_maxFrameSize));
+  _dropped.resize(size, 0);
+  _channels.resize(size);
+  _addresses.resize(size, 0);
+  _sharedChannels.resize(size);
+}
+
+void SessionTable::add(int client, uint32_t address)
+{
+  _grow(client);
+  if (_positions[client] != NO_POSITION)
+    return;
+
+  _positions[client] = _clients.size();
+  _clients.push_back(client);
+  _protocols[client] = PROTOCOL_V1;
+  _congested[client] = 0;
+  _subscribed[client] = 0;
+  _throttled[client] = 0;
+  std::fill_n(_buckets.begin() + static_cast<size_t>(client) * _bucketCount, _bucketCount, TokenBucket());
+  _dropped[client] = 0;
+  _addresses[client] = address;
+  _readBuffers[client] = FrameBuffer(_maxFrameSize);
+}
+
+void SessionTable::remove(int client)
+{
+  if (!contains(client))
+    return;
+
+  // Move the last client in the hole
+  uint32_t position = _positions[client];
+  int last = _clients.back();
+  _clients[position] = last;
+  _positions[last] = position;
+  _clients.pop_back();
+  _positions[client] = NO_POSITION;
+  _generations[client]++;
+
+  auto indexed = _byName.find(_names[client]);
+  if (indexed != _byName.end() && indexed->second == client)
+    _byName.erase(indexed);
+  _names[client].clear();
+  _channels[client].clear();
+  _sharedChannels[client].reset();
+  // Release the memory of a large message that was being received
+  _readBuffers[client] = FrameBuffer(_maxFrameSize);
+}
+
+bool SessionTable::contains(int client) const
+{
+  return client >= 0 && static_cast<size_t>(client) < _positions.size() && _positions[client] != NO_POSITION;
+}
+
+const std::vector<int> &SessionTable::clients() const
+{
+  return _clients;
+}
+
+size_t SessionTable::size() const
+{
+  return _clients.size();
+}
+
+uint32_t SessionTable::address(int client) const
+{
+  return _addresses[client];
+}
+
+SessionTable::Handle SessionTable::handle(int client) const
+{
+  return (static_cast<Handle>(_generations[client]) << 32) | static_cast<uint32_t>(client);
+}
+
+bool SessionTable::valid(Handle handle) const
+{
+  int fd = client(handle);
+
+  return contains(fd) && _generations[fd] == static_cast<uint32_t>(handle >> 32);
+}
+
+int SessionTable::client(Handle handle)
+{
+  return static_cast<int>(handle & 0xFFFFFFFF);
+}
+
+void SessionTable::setName(int client, const std::string &name)
+{
+  auto indexed = _byName.find(_names[client]);
+
+  if (indexed != _byName.end() && indexed->second == client)
+    _byName.erase(indexed);
+  _names[client] = name;
+  _byName[name] = client;
+}
+
+const std::string &SessionTable::name(int client) const
+{
+  static const std::string none;
+
+  return contains(client) ? _names[client] : none;
+}
+
+int SessionTable::find(const std::string &name) const
+{
+  auto indexed = _byName.find(name);
+
+  return (indexed != _byName.end()) ? indexed->second : -1;
+}
+
+int SessionTable::protocol(int client) const
+{
+  return contains(client) ? _protocols[client] : PROTOCOL_V1;
+}
+
+void SessionTable::setProtocol(int client, int version)
+{
+  _protocols[client] = static_cast<uint8_t>(version);
+}
+
+FrameBuffer &SessionTable::readBuffer(int client)
+{
+  return _readBuffers[client];
+}
+
+bool SessionTable::congested(int client) const
+{
+  return contains(client) && _congested[client] != 0;
+}
+
+void SessionTable::setCongested(int client, bool congested)
+{
+  _congested[client] = congested ? 1 : 0;
+  _dropped[client] = 0;
+}
+
+void SessionTable::drop(int client)
+{
+  _dropped[client]++;
+}
+
+size_t SessionTable::dropped(int client) const
+{
+  return _dropped[client];
+}
+
+bool SessionTable::subscribed(int client) const
+{
+  return contains(client) && _subscribed[client] != 0;
+}
+
+void SessionTable::subscribe(int client)
+{
+  _subscribed[client] = 1;
+}
+
+void SessionTable::touch(int client, uint64_t now)
+{
+  _lastSeen[client] = now;
+}
+
+uint64_t SessionTable::lastSeen(int client) const
+{
+  return _lastSeen[client];
+}
+
+TokenBucket &SessionTable::bucket(int client, size_t index)
+{
+  return _buckets[static_cast<size_t>(client) * _bucketCount + index];
+}
+
+bool SessionTable::throttled(int client) const
+{
+  return _throttled[client] != 0;
+}
+
+void SessionTable::setThrottled(int client, bool throttled)
+{
+  _throttled[client] = throttled ? 1 : 0;
+}
+
+const std::shared_ptr<SharedChannel> &SessionTable::sharedChannel(int client) const
+{
+  return _sharedChannels[client];
+}
+
+void SessionTable::setSharedChannel(int client, const std::shared_ptr<SharedChannel> &channel)
+{
+  _sharedChannels[client] = channel;
+}
+
+SessionTable::Channels &SessionTable::channels(int client)
+{
+  return _channels[client];
+}
@@ -0,0 +1,370 @@
+#include "ShardGroup.hpp"
+#include "Server.hpp"
+
+
+ShardGroup::ShardGroup(size_t shards, size_t diskThreads, size_t diskQueue)
+  : _servers(shards, nullptr), _disk(diskThreads, diskQueue, [this]() {
+      for (size_t shard = 0; shard < _servers.size(); shard++)
+        post(shard, [](Server &server) { server.resumeOffloads(); });
+    })
+{
+  for (size_t i = 0; i < shards; i++)
+    _mailboxes.push_back(std::make_unique<Mailbox>());
+}
+
+size_t ShardGroup::size() const
+{
+  return _servers.size();
+}
+
+void ShardGroup::attach(size_t shard, Server *server)
+{
+  // Under the lock of the mailbox, a disk worker may be posting to the shard
+  std::lock_guard<std::mutex> lock(_mailboxes[shard]->mutex);
+  _servers[shard] = server;
+}
+
+void ShardGroup::post(size_t shard, Task task)
+{
+  Mailbox &mailbox = *_mailboxes[shard];
+  std::lock_guard<std::mutex> lock(mailbox.mutex);
+  bool wasEmpty = mailbox.tasks.empty();
+
+  mailbox.tasks.push_back(std::move(task));
+  if (wasEmpty && _servers[shard] != nullptr)
+    _servers[shard]->wake();
+}
+
+void ShardGroup::postToOthers(size_t from, const Task &task)
+{
+  for (size_t shard = 0; shard < _servers.size(); shard++) {
+    if (shard != from)
+      post(shard, task);
+  }
+}
+
+std::vector<ShardGroup::Task> ShardGroup::take(size_t shard)
+{
+  Mailbox &mailbox = *_mailboxes[shard];
+  std::vector<Task> tasks;
+
+  std::lock_guard<std::mutex> lock(mailbox.mutex);
+  tasks.swap(mailbox.tasks);
+  return tasks;
+}
+
+bool ShardGroup::offload(std::function<void()> &work)
+{
+  return _disk.submit(work);
+}
+
+void ShardGroup::openLog(const std::string &directory, size_t segmentSize, MessageLog::Sync sync, size_t syncInterval, size_t bufferSize)
+{
+  _log = std::make_unique<MessageLog>(directory, segmentSize, sync, syncInterval, bufferSize, [this]() {
+    for (size_t shard = 0; shard < _servers.size(); shard++)
+      post(shard, [](Server &server) { server.resumeLog(); });
+  });
+  _history = std::make_unique<HistoryStore>(*_log);
+  _log->observe([history = _history.get()](const MessageLog::RecordView &record, uint64_t segment, uint64_t offset) {
+    history->add(record, segment, offset);
+  });
+  _log->open();
+}
+
+MessageLog *ShardGroup::log()
+{
+  return _log.get();
+}
+
+HistoryStore *ShardGroup::history()
+{
+  return _history.get();
+}
+
+void ShardGroup::compactLog(uint64_t age, uint64_t logBytes, const std::string &rules, size_t interval, size_t bandwidth)
+{
+  auto compactor = std::make_unique<LogCompactor>(*_log, *_history, age, logBytes, LogCompactor::parseRules(rules), interval, bandwidth);
+
+  if (!compactor->enabled())
+    return;
+  _compactor = std::move(compactor);
+  _compactor->start();
+}
+
+void ShardGroup::closeLog()
+{
+  if (_compactor)
+    _compactor->stop();
+  if (_log)
+    _log->close();
+}
+
+bool ShardGroup::admit(uint32_t address, size_t maxSessions, size_t maxPerAddress)
+{
+  std::lock_guard<std::mutex> lock(_admissionMutex);
+
+  if (maxSessions > 0 && _connections >= maxSessions)
+    return false;
+  if (address != 0) {
+    size_t &count = _addresses[address];
+    if (maxPerAddress > 0 && count >= maxPerAddress)
+      return false;
+    count++;
+  }
+  _connections++;
+  return true;
+}
+
+void ShardGroup::release(uint32_t address)
+{
+  std::lock_guard<std::mutex> lock(_admissionMutex);
+
+  _connections--;
+  if (address == 0)
+    return;
+  auto count = _addresses.find(address);
+  if (count != _addresses.end() && --count->second == 0)
+    _addresses.erase(count);
+}
+
+void ShardGroup::openRegistry(const std::string &directory)
+{
+  _registry = std::make_unique<UserRegistry>(directory);
+  _registry->open();
+}
+
+UserRegistry *ShardGroup::registry()
+{
+  return _registry.get();
+}
+
+std::string ShardGroup::login(size_t shard, SessionTable::Handle handle, const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  std::string given = _login(shard, handle, name);
+
+  _record("+" + given);
+  return given;
+}
+
+void ShardGroup::logout(const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (_logout(name))
+    _record("-" + name);
+}
+
+std::string ShardGroup::rename(size_t shard, SessionTable::Handle handle, const std::string &from, const std::string &to)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _logout(from);
+  std::string given = _login(shard, handle, to);
+  _record("~" + from + ">" + given);
+  return given;
+}
+
+std::string ShardGroup::adopt(size_t shard, SessionTable::Handle handle, const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  return _login(shard, handle, name);
+}
+
+void ShardGroup::setPresenceVersion(uint64_t version)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  _presence.clear();
+  _presenceVersion = version;
+  _presenceSnapshot.reset();
+}
+
+std::string ShardGroup::_login(size_t shard, SessionTable::Handle handle, const std::string &name)
+{
+  size_t count = _knownCount(name);
+  std::string newName = (count > 0) ? name + std::to_string(count) : name;
+  std::string given = (_sessions.find(name) != _sessions.end()) ? newName : name;
+
+  while (_sessions.find(given) != _sessions.end())
+    given = name + std::to_string(++count);
+
+  _knownNames[newName] = _knownCount(newName) + 1;
+  _sessions[given] = Session{shard, handle, _names.size()};
+  _names.push_back(given);
+  _nameList.reset();
+  return given;
+}
+
+bool ShardGroup::_logout(const std::string &name)
+{
+  auto session = _sessions.find(name);
+
+  // Forgotten, even if it has an account
+  _knownNames[name] = 0;
+  if (session == _sessions.end())
+    return false;
+
+  // Move the last name in the hole
+  size_t position = session->second.position;
+  if (position != _names.size() - 1) {
+    _names[position] = std::move(_names.back());
+    _sessions[_names[position]].position = position;
+  }
+  _names.pop_back();
+  _sessions.erase(session);
+  _nameList.reset();
+  return true;
+}
+
+size_t ShardGroup::_knownCount(const std::string &name)
+{
+  auto known = _knownNames.find(name);
+
+  // The accounts are not loaded, the registry is searched for the names not seen yet
+  if (known != _knownNames.end())
+    return known->second;
+  return (_registry && _registry->contains(name)) ? 1 : 0;
+}
+
+void ShardGroup::_record(const std::string &change)
+{
+  _presence.push_back(change);
+  if (_presence.size() > PRESENCE_LOG_SIZE)
+    _presence.pop_front();
+  _presenceVersion++;
+  _presenceSnapshot.reset();
+}
+
+bool ShardGroup::find(const std::string &name, size_t &shard, SessionTable::Handle &handle)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto session = _sessions.find(name);
+
+  if (session == _sessions.end())
+    return false;
+  shard = session->second.shard;
+  handle = session->second.handle;
+  return true;
+}
+
+std::vector<std::string> ShardGroup::names()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  return _names;
+}
+
+std::vector<std::string> ShardGroup::names(uint64_t &version)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  version = _presenceVersion;
+  return _names;
+}
+
+std::shared_ptr<const std::string> ShardGroup::nameList()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (!_nameList) {
+    std::string list;
+    for (const auto &name : _names)
+      list += name + ",";
+    _nameList = std::make_shared<const std::string>(std::move(list));
+  }
+  return _nameList;
+}
+
+std::shared_ptr<const std::string> ShardGroup::presenceSnapshot()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  if (!_presenceSnapshot) {
+    std::string snapshot = "0," + std::to_string(_presenceVersion) + ",";
+    for (const auto &name : _names)
+      snapshot += "+" + name + ",";
+    _presenceSnapshot = std::make_shared<const std::string>(std::move(snapshot));
+  }
+  return _presenceSnapshot;
+}
+
+bool ShardGroup::presenceSince(uint64_t since, std::vector<std::string> &changes, uint64_t &version)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  uint64_t first = _presenceVersion - _presence.size();
+
+  version = _presenceVersion;
+  changes.clear();
+  if (since >= _presenceVersion)
+    return true;
+  if (since < first)
+    return false;
+  changes.assign(_presence.begin() + (since - first), _presence.end());
+  return true;
+}
+
+bool ShardGroup::join(const std::string &channel, const std::string &name, size_t shard)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  Channel &members = _channels[channel];
+
+  if (!members.positions.emplace(name, members.members.size()).second)
+    return false;
+  members.members.push_back(name);
+  members.shardMembers.resize(_servers.size(), 0);
+  members.shardMembers[shard]++;
+  return true;
+}
+
+bool ShardGroup::leave(const std::string &channel, const std::string &name, size_t shard)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _channels.find(channel);
+
+  if (found == _channels.end())
+    return false;
+  Channel &members = found->second;
+  auto position = members.positions.find(name);
+  if (position == members.positions.end())
+    return false;
+
+  // Move the last member in the hole
+  size_t index = position->second;
+  members.positions.erase(position);
+  if (index != members.members.size() - 1) {
+    members.members[index] = std::move(members.members.back());
+    members.positions[members.members[index]] = index;
+  }
+  members.members.pop_back();
+  members.shardMembers[shard]--;
+  if (members.members.empty())
+    _channels.erase(found);
+  return true;
+}
+
+std::vector<std::string> ShardGroup::members(const std::string &channel)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _channels.find(channel);
+
+  if (found == _channels.end())
+    return {};
+  return found->second.members;
+}
+
+std::vector<size_t> ShardGroup::channelShards(const std::string &channel)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  auto found = _channels.find(channel);
+  std::vector<size_t> shards;
+
+  if (found == _channels.end())
+    return shards;
+  for (size_t shard = 0; shard < found->second.shardMembers.size(); shard++) {
+    if (found->second.shardMembers[shard] > 0)
+      shards.push_back(shard);
+  }
+  return shards;
+}
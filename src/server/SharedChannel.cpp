@@ -0,0 +1,225 @@
+#include "SharedChannel.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// The header gets a cache line of its own, the rings one per field, then the bytes
+constexpr size_t HEADER_SIZE = 64;
+
+size_t layoutSize(size_t ringSize, size_t capacity)
+{
+  return HEADER_SIZE + 2 * ringSize + 2 * capacity;
+}
+
+}
+
+SharedChannel::SharedChannel(size_t capacity)
+  : _memory(-1), _serverSignal(-1), _clientSignal(-1), _side(Side::Server), _mapping(MAP_FAILED), _size(0), _capacity(64)
+{
+  while (_capacity < capacity)
+    _capacity <<= 1;
+  _size = layoutSize(sizeof(Ring), _capacity);
+
+  _memory = memfd_create("chat-channel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  _serverSignal = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  _clientSignal = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  // Sealed to its size, so the client cannot shrink it under the server and make it crash
+  if (_memory == -1 || _serverSignal == -1 || _clientSignal == -1 || ftruncate(_memory, _size) == -1
+      || fcntl(_memory, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+    int error = errno;
+    _close();
+    throw SharedChannelException(SHARED_CHANNEL_FAILED + std::string(": ") + strerror(error));
+  }
+  _map(_size);
+
+  Header *header = static_cast<Header *>(_mapping);
+  header->magic = SHARED_CHANNEL_MAGIC;
+  header->reserved = 0;
+  header->capacity = _capacity;
+  for (Ring *ring : {_in, _out}) {
+    new (ring) Ring();
+    // Both sides start asleep, the first bytes written to a ring always signal its reader
+    ring->sleeping.store(1, std::memory_order_relaxed);
+  }
+}
+
+SharedChannel::SharedChannel(int memory, int serverSignal, int clientSignal, Side side)
+  : _memory(memory), _serverSignal(serverSignal), _clientSignal(clientSignal), _side(side), _mapping(MAP_FAILED), _size(0), _capacity(0)
+{
+  struct stat status;
+  Header header;
+
+  if (fstat(_memory, &status) == -1 || static_cast<size_t>(status.st_size) < HEADER_SIZE
+      || pread(_memory, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+    _close();
+    throw SharedChannelException(SHARED_CHANNEL_FAILED + std::string(": unreadable memory"));
+  }
+  _capacity = header.capacity;
+  _size = layoutSize(sizeof(Ring), _capacity);
+  if (header.magic != SHARED_CHANNEL_MAGIC || _capacity == 0 || (_capacity & (_capacity - 1)) != 0
+      || static_cast<size_t>(status.st_size) < _size) {
+    _close();
+    throw SharedChannelException(SHARED_CHANNEL_FAILED + std::string(": not a channel"));
+  }
+  _map(_size);
+}
+
+SharedChannel::~SharedChannel()
+{
+  if (_mapping != MAP_FAILED)
+    munmap(_mapping, _size);
+  _close();
+}
+
+void SharedChannel::_map(size_t size)
+{
+  _mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, _memory, 0);
+  if (_mapping == MAP_FAILED) {
+    int error = errno;
+    _close();
+    throw SharedChannelException(SHARED_CHANNEL_FAILED + std::string(": mmap: ") + strerror(error));
+  }
+
+  char *base = static_cast<char *>(_mapping);
+  Ring *toServer = reinterpret_cast<Ring *>(base + HEADER_SIZE);
+  Ring *toClient = reinterpret_cast<Ring *>(base + HEADER_SIZE + sizeof(Ring));
+  char *toServerData = base + HEADER_SIZE + 2 * sizeof(Ring);
+  char *toClientData = toServerData + _capacity;
+
+  _in = (_side == Side::Server) ? toServer : toClient;
+  _out = (_side == Side::Server) ? toClient : toServer;
+  _inData = (_side == Side::Server) ? toServerData : toClientData;
+  _outData = (_side == Side::Server) ? toClientData : toServerData;
+}
+
+void SharedChannel::_close()
+{
+  for (int fd : {_memory, _serverSignal, _clientSignal}) {
+    if (fd != -1)
+      close(fd);
+  }
+  _memory = _serverSignal = _clientSignal = -1;
+}
+
+size_t SharedChannel::write(const char *data, size_t size)
+{
+  size_t written = 0;
+
+  while (true) {
+    uint64_t tail = _out->tail.load(std::memory_order_relaxed);
+    uint64_t head = _out->head.load(std::memory_order_acquire);
+    // Positions written by the other process are not trusted, a ring never holds more than its capacity
+    size_t count = std::min<size_t>(size - written, _capacity - std::min<uint64_t>(tail - head, _capacity));
+
+    if (count > 0) {
+      size_t offset = tail & (_capacity - 1);
+      size_t first = std::min(count, _capacity - offset);
+      std::memcpy(_outData + offset, data + written, first);
+      std::memcpy(_outData, data + written + first, count - first);
+      _out->tail.store(tail + count, std::memory_order_release);
+      written += count;
+      tail += count;
+    }
+    if (written == size)
+      return written;
+
+    // Full: the reader signals once it made room, unless it already did before seeing the flag
+    _out->blocked.store(1, std::memory_order_seq_cst);
+    if (tail - _out->head.load(std::memory_order_seq_cst) >= _capacity)
+      return written;
+  }
+}
+
+void SharedChannel::notify()
+{
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_out->sleeping.load(std::memory_order_relaxed) != 0 && _out->sleeping.exchange(0) != 0)
+    _wakePeer();
+}
+
+size_t SharedChannel::read(char *data, size_t size)
+{
+  uint64_t head = _in->head.load(std::memory_order_relaxed);
+  uint64_t tail = _in->tail.load(std::memory_order_acquire);
+  size_t count = std::min<uint64_t>(std::min<uint64_t>(size, tail - head), _capacity);
+
+  if (count == 0)
+    return 0;
+  size_t offset = head & (_capacity - 1);
+  size_t first = std::min(count, _capacity - offset);
+  std::memcpy(data, _inData + offset, first);
+  std::memcpy(data + first, _inData, count - first);
+  _in->head.store(head + count, std::memory_order_seq_cst);
+
+  if (_in->blocked.load(std::memory_order_seq_cst) != 0 && _in->blocked.exchange(0) != 0)
+    _wakePeer();
+  return count;
+}
+
+bool SharedChannel::sleep()
+{
+  _in->sleeping.store(1, std::memory_order_seq_cst);
+  return _in->tail.load(std::memory_order_seq_cst) == _in->head.load(std::memory_order_relaxed);
+}
+
+void SharedChannel::resume()
+{
+  uint64_t one = 1;
+
+  if (!sleep()) {
+    while (::write(signal(), &one, sizeof(one)) == -1 && errno == EINTR)
+      ;
+  }
+}
+
+void SharedChannel::clearSignal()
+{
+  uint64_t count;
+
+  while (::read(signal(), &count, sizeof(count)) == -1 && errno == EINTR)
+    ;
+}
+
+void SharedChannel::_wakePeer()
+{
+  uint64_t one = 1;
+  int peer = (_side == Side::Server) ? _clientSignal : _serverSignal;
+
+  // EAGAIN only happens once the counter is about to overflow, the peer has a wakeup pending anyway
+  while (::write(peer, &one, sizeof(one)) == -1 && errno == EINTR)
+    ;
+}
+
+size_t SharedChannel::capacity() const
+{
+  return _capacity;
+}
+
+int SharedChannel::memory() const
+{
+  return _memory;
+}
+
+int SharedChannel::serverSignal() const
+{
+  return _serverSignal;
+}
+
+int SharedChannel::clientSignal() const
+{
+  return _clientSignal;
+}
+
+int SharedChannel::signal() const
+{
+  return (_side == Side::Server) ? _serverSignal : _clientSignal;
+}
@@ -0,0 +1,142 @@
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+#include <climits>
+
+/**
+ * Rotates the occupancy bits of a level right, so bit 0 becomes the slot at start.
+ */
+static uint64_t rotate(uint64_t bits, size_t start)
+{
+  return (start == 0) ? bits : (bits >> start) | (bits << (TIMER_WHEEL_SLOTS - start));
+}
+
+TimerWheel::TimerWheel(uint64_t now)
+  : _slots(TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS, NONE), _occupied(), _current(now / TIMER_TICK_MS), _armed(0)
+{
+}
+
+void TimerWheel::arm(int id, uint64_t deadline)
+{
+  if (static_cast<size_t>(id) >= _nodes.size())
+    _nodes.resize(static_cast<size_t>(id) + 1);
+  if (_nodes[id].slot != NONE)
+    _unlink(id);
+
+  // Rounded up to a tick, and never in a tick already processed
+  _nodes[id].expiry = std::max<uint64_t>((deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS, _current + 1);
+  _insert(id);
+}
+
+void TimerWheel::cancel(int id)
+{
+  if (armed(id))
+    _unlink(id);
+}
+
+bool TimerWheel::armed(int id) const
+{
+  return id >= 0 && static_cast<size_t>(id) < _nodes.size() && _nodes[id].slot != NONE;
+}
+
+void TimerWheel::_insert(int id)
+{
+  Node &node = _nodes[id];
+  uint64_t delta = node.expiry - _current;
+  int level = 0;
+
+  if (delta >= (uint64_t(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+    node.expiry = _current + (uint64_t(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    delta = node.expiry - _current;
+  }
+  while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (uint64_t(1) << (TIMER_WHEEL_BITS * (level + 1))))
+    level++;
+
+  size_t index = (node.expiry >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+  int slot = level * TIMER_WHEEL_SLOTS + index;
+
+  node.slot = slot;
+  node.previous = NONE;
+  node.next = _slots[slot];
+  if (node.next != NONE)
+    _nodes[node.next].previous = id;
+  _slots[slot] = id;
+  _occupied[level] |= uint64_t(1) << index;
+  _armed++;
+}
+
+void TimerWheel::_unlink(int id)
+{
+  Node &node = _nodes[id];
+
+  if (node.previous != NONE)
+    _nodes[node.previous].next = node.next;
+  else
+    _slots[node.slot] = node.next;
+  if (node.next != NONE)
+    _nodes[node.next].previous = node.previous;
+  if (_slots[node.slot] == NONE)
+    _occupied[node.slot / TIMER_WHEEL_SLOTS] &= ~(uint64_t(1) << (node.slot % TIMER_WHEEL_SLOTS));
+  node.previous = NONE;
+  node.next = NONE;
+  node.slot = NONE;
+  _armed--;
+}
+
+void TimerWheel::_cascade(int level, size_t index)
+{
+  int id = _slots[level * TIMER_WHEEL_SLOTS + index];
+
+  while (id != NONE) {
+    int next = _nodes[id].next;
+    _unlink(id);
+    _insert(id);
+    id = next;
+  }
+}
+
+void TimerWheel::advance(uint64_t now, std::vector<int> &expired)
+{
+  uint64_t target = now / TIMER_TICK_MS;
+
+  while (_current < target) {
+    if (_armed == 0) {
+      _current = target;
+      return;
+    }
+    _current++;
+
+    // Entering a new block of a level brings its timers down, up to the first level not wrapping
+    size_t index = _current & (TIMER_WHEEL_SLOTS - 1);
+    for (int level = 1; index == 0 && level < TIMER_WHEEL_LEVELS; level++) {
+      index = (_current >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+      _cascade(level, index);
+    }
+
+    int slot = _current & (TIMER_WHEEL_SLOTS - 1);
+    while (_slots[slot] != NONE) {
+      int id = _slots[slot];
+      _unlink(id);
+      expired.push_back(id);
+    }
+  }
+}
+
+int TimerWheel::timeout(uint64_t now) const
+{
+  uint64_t next = UINT64_MAX;
+
+  if (_armed == 0)
+    return -1;
+  for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+    if (_occupied[level] == 0)
+      continue;
+    // First occupied slot after the current one, the current one coming last as it holds the next round
+    uint64_t block = (_current >> (TIMER_WHEEL_BITS * level)) + 1;
+    uint64_t distance = __builtin_ctzll(rotate(_occupied[level], block & (TIMER_WHEEL_SLOTS - 1)));
+    next = std::min(next, (block + distance) << (TIMER_WHEEL_BITS * level));
+  }
+
+  uint64_t deadline = next * TIMER_TICK_MS;
+  return (deadline <= now) ? 0 : static_cast<int>(std::min<uint64_t>(deadline - now, INT_MAX));
+}
@@ -0,0 +1,632 @@
+#include "UringLoop.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// Kind of operation, stored in the top byte of the user data of every entry
+enum Operation : uint64_t {
+  ACCEPT = 1,
+  RECV = 2,
+  SEND = 3,
+  CANCEL = 4,
+  WAKE = 5,
+  SIGNAL = 6
+};
+
+uint64_t makeTag(Operation operation, uint32_t generation, int fd)
+{
+  return (static_cast<uint64_t>(operation) << 56)
+       | (static_cast<uint64_t>(generation & 0xFFFFFF) << 32)
+       | static_cast<uint32_t>(fd);
+}
+
+Operation tagOperation(uint64_t tag) { return static_cast<Operation>(tag >> 56); }
+uint32_t tagGeneration(uint64_t tag) { return static_cast<uint32_t>((tag >> 32) & 0xFFFFFF); }
+int tagFd(uint64_t tag) { return static_cast<int>(tag & 0xFFFFFFFF); }
+
+int uringSetup(unsigned entries, struct io_uring_params *params)
+{
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int uringEnter(int ring, unsigned toSubmit, unsigned minComplete, unsigned flags, const void *arg, size_t argSize)
+{
+  return static_cast<int>(syscall(__NR_io_uring_enter, ring, toSubmit, minComplete, flags, arg, argSize));
+}
+
+int uringRegister(int ring, unsigned opcode, void *arg, unsigned count)
+{
+  return static_cast<int>(syscall(__NR_io_uring_register, ring, opcode, arg, count));
+}
+
+}
+
+UringLoop::UringLoop(Handler &handler)
+  : _handler(handler), _accepting(0), _paused(false), _toSubmit(0), _wakeFd(-1), _wakeValue(0), _sqRing(MAP_FAILED), _cqRing(MAP_FAILED),
+    _sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), _bufferRing(static_cast<struct io_uring_buf_ring *>(MAP_FAILED)),
+    _bufferTail(0), _buffers(static_cast<size_t>(URING_BUFFER_COUNT) * URING_BUFFER_SIZE), _sharedBuffer(READ_CHUNK_SIZE)
+{
+  struct io_uring_params params = {};
+
+  _ring = uringSetup(URING_ENTRIES, &params);
+  if (_ring == -1)
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": io_uring_setup: ") + strerror(errno));
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(_ring);
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": io_uring is too old"));
+  }
+
+  _sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  _cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+  _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+  _cqRing = _sqRing;
+  _sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES));
+  if (_sqRing == MAP_FAILED || _sqes == MAP_FAILED) {
+    int error = errno;
+    _release();
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": mmap: ") + strerror(error));
+  }
+
+  char *sq = static_cast<char *>(_sqRing);
+  char *cq = static_cast<char *>(_cqRing);
+  _sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+  _sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  _sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  _sqEntries = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+  _cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  _cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  _cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+  // Entry i of the submission array always points to submission entry i
+  unsigned *array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; i++)
+    array[i] = i;
+
+  // Provided buffer ring: the kernel picks a buffer for every received chunk
+  _bufferRing = static_cast<struct io_uring_buf_ring *>(mmap(nullptr, URING_BUFFER_COUNT * sizeof(struct io_uring_buf),
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  struct io_uring_buf_reg registration = {};
+  registration.ring_addr = reinterpret_cast<uint64_t>(_bufferRing);
+  registration.ring_entries = URING_BUFFER_COUNT;
+  registration.bgid = URING_BUFFER_GROUP;
+  if (_bufferRing == MAP_FAILED || uringRegister(_ring, IORING_REGISTER_PBUF_RING, &registration, 1) == -1) {
+    int error = errno;
+    _release();
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": buffer ring: ") + strerror(error));
+  }
+  for (uint16_t id = 0; id < URING_BUFFER_COUNT; id++)
+    _recycle(id);
+
+  _wakeFd = eventfd(0, EFD_CLOEXEC);
+  if (_wakeFd == -1) {
+    int error = errno;
+    _release();
+    throw EventLoopException(EVENT_LOOP_CREATION_FAILED + std::string(": eventfd: ") + strerror(error));
+  }
+  _armWake();
+}
+
+UringLoop::~UringLoop()
+{
+  _release();
+}
+
+void UringLoop::_release()
+{
+  if (_bufferRing != MAP_FAILED)
+    munmap(_bufferRing, URING_BUFFER_COUNT * sizeof(struct io_uring_buf));
+  if (_sqes != MAP_FAILED)
+    munmap(_sqes, _sqesSize);
+  if (_sqRing != MAP_FAILED)
+    munmap(_sqRing, _sqRingSize);
+  if (_wakeFd != -1)
+    close(_wakeFd);
+  close(_ring);
+}
+
+struct io_uring_sqe *UringLoop::_getSqe()
+{
+  // The kernel refuses the entries while its completion queue is full, until it is emptied
+  while (*_sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) >= *_sqEntries) {
+    if (!_enter(0, 0))
+      _defer();
+  }
+
+  unsigned tail = *_sqTail;
+  struct io_uring_sqe *sqe = &_sqes[tail & *_sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+  _toSubmit++;
+  return sqe;
+}
+
+bool UringLoop::_enter(unsigned wait, int timeout)
+{
+  struct io_uring_getevents_arg arg = {};
+  struct __kernel_timespec ts = {};
+  unsigned flags = 0;
+
+  // The completions set aside are handled before waiting for others
+  if (!_deferred.empty())
+    wait = 0;
+  if (wait > 0) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = static_cast<long long>(timeout % 1000) * 1000000;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+    }
+  }
+
+  int result = uringEnter(_ring, _toSubmit, wait, flags, (wait > 0) ? &arg : nullptr, (wait > 0) ? sizeof(arg) : 0);
+  if (result >= 0) {
+    _toSubmit -= std::min<unsigned>(result, _toSubmit);
+    return true;
+  }
+  if (errno == EINTR || errno == ETIME || errno == EAGAIN || errno == EBUSY)
+    return false;
+  throw EventLoopException(EVENT_LOOP_WAIT_FAILED + std::string(": io_uring_enter: ") + strerror(errno));
+}
+
+void UringLoop::_recycle(uint16_t id)
+{
+  struct io_uring_buf *buffers = reinterpret_cast<struct io_uring_buf *>(_bufferRing);
+  struct io_uring_buf &buffer = buffers[_bufferTail & (URING_BUFFER_COUNT - 1)];
+
+  buffer.addr = reinterpret_cast<uint64_t>(_buffers.data() + static_cast<size_t>(id) * URING_BUFFER_SIZE);
+  buffer.len = URING_BUFFER_SIZE;
+  buffer.bid = id;
+  _bufferTail++;
+  __atomic_store_n(&_bufferRing->tail, _bufferTail, __ATOMIC_RELEASE);
+}
+
+void UringLoop::_armAccept(int listener)
+{
+  struct io_uring_sqe *sqe = _getSqe();
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = listener;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = makeTag(ACCEPT, 0, listener);
+  _accepting++;
+}
+
+void UringLoop::_armWake()
+{
+  struct io_uring_sqe *sqe = _getSqe();
+
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = _wakeFd;
+  sqe->addr = reinterpret_cast<uint64_t>(&_wakeValue);
+  sqe->len = sizeof(_wakeValue);
+  sqe->user_data = makeTag(WAKE, 0, _wakeFd);
+}
+
+void UringLoop::_armRecv(int client)
+{
+  struct io_uring_sqe *sqe = _getSqe();
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = client;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  sqe->user_data = makeTag(RECV, _connections[client].generation, client);
+  _connections[client].receiving = true;
+}
+
+void UringLoop::_armSignal(int client)
+{
+  struct io_uring_sqe *sqe = _getSqe();
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = _connections[client].shared->signal();
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = makeTag(SIGNAL, _connections[client].generation, client);
+}
+
+void UringLoop::_armSend(int client)
+{
+  Connection &connection = _connections[client];
+
+  if (!connection.inflight) {
+    connection.inflight = std::make_unique<Batch>();
+    while (!connection.outbound.empty() && connection.inflight->buffers.size() < SEND_BATCH_SIZE) {
+      Buffer &data = connection.outbound.front();
+      connection.inflight->iov.push_back({const_cast<char *>(data->data()), data->size()});
+      connection.inflight->buffers.push_back(std::move(data));
+      connection.outbound.pop_front();
+    }
+  }
+
+  Batch &batch = *connection.inflight;
+  batch.header.msg_iov = batch.iov.data();
+  batch.header.msg_iovlen = batch.iov.size();
+
+  struct io_uring_sqe *sqe = _getSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = client;
+  sqe->addr = reinterpret_cast<uint64_t>(&batch.header);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = makeTag(SEND, connection.generation, client);
+  connection.sending = true;
+}
+
+void UringLoop::listen(int socket)
+{
+  _listeners.push_back(socket);
+  _armAccept(socket);
+}
+
+void UringLoop::add(int client)
+{
+  if (static_cast<size_t>(client) >= _connections.size())
+    _connections.resize(client + 1);
+
+  Connection &connection = _connections[client];
+  connection.registered = true;
+  connection.sending = false;
+  connection.detaching = false;
+  connection.pending = 0;
+  connection.sent = 0;
+  connection.outbound.clear();
+  connection.inflight.reset();
+  connection.shared.reset();
+  _armRecv(client);
+}
+
+void UringLoop::share(int client, const std::shared_ptr<SharedChannel> &channel)
+{
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered)
+    return;
+  _connections[client].shared = channel;
+  _connections[client].sent = 0;
+  _armSignal(client);
+  channel->resume();
+}
+
+void UringLoop::_unshare(int client)
+{
+  Connection &connection = _connections[client];
+
+  // The poll holds no memory of the loop, its completion is dropped by the generation
+  if (connection.shared)
+    _cancel(makeTag(SIGNAL, connection.generation, client));
+  connection.shared.reset();
+  connection.sent = 0;
+}
+
+void UringLoop::remove(int client)
+{
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered)
+    return;
+
+  Connection &connection = _connections[client];
+
+  // The kernel may still be reading the message in flight, keep it until its completion
+  if (connection.inflight)
+    _orphans.emplace(makeTag(SEND, connection.generation, client), std::move(connection.inflight));
+  _unshare(client);
+  connection.outbound.clear();
+  connection.pending = 0;
+  connection.registered = false;
+  connection.receiving = false;
+  connection.sending = false;
+  connection.generation++;
+
+  struct io_uring_sqe *sqe = _getSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = client;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = makeTag(CANCEL, 0, client);
+
+  // Submit now: the caller closes the descriptor next, and it may be reused right away
+  _enter(0, 0);
+}
+
+void UringLoop::_cancel(uint64_t tag)
+{
+  struct io_uring_sqe *sqe = _getSqe();
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = tag;
+  sqe->user_data = makeTag(CANCEL, 0, tagFd(tag));
+}
+
+void UringLoop::pause()
+{
+  _paused = true;
+
+  // The accepts first, so no client is added while the receives are cancelled
+  for (int listener : _listeners)
+    _cancel(makeTag(ACCEPT, 0, listener));
+  while (_accepting > 0) {
+    _enter(1, -1);
+    _reap();
+  }
+
+  for (size_t client = 0; client < _connections.size(); client++) {
+    if (_connections[client].registered && _connections[client].receiving)
+      _cancel(makeTag(RECV, _connections[client].generation, client));
+  }
+  // The data received before the cancellations is given to the handler meanwhile
+  auto receiving = [this]() {
+    return std::any_of(_connections.begin(), _connections.end(), [](const Connection &c) { return c.registered && c.receiving; });
+  };
+  while (receiving()) {
+    _enter(1, -1);
+    _reap();
+  }
+}
+
+std::string UringLoop::detach(int client)
+{
+  std::string unsent;
+
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered)
+    return unsent;
+
+  _connections[client].detaching = true;
+  if (_connections[client].sending)
+    _cancel(makeTag(SEND, _connections[client].generation, client));
+  // The handler may add clients meanwhile, which moves _connections
+  while (_connections[client].sending) {
+    _enter(1, -1);
+    _reap();
+  }
+
+  Connection &connection = _connections[client];
+  unsent.reserve(connection.pending);
+  if (connection.inflight) {
+    for (const auto &part : connection.inflight->iov)
+      unsent.append(static_cast<const char *>(part.iov_base), part.iov_len);
+  }
+  for (size_t i = 0; i < connection.outbound.size(); i++)
+    unsent.append(*connection.outbound[i], (i == 0) ? connection.sent : 0, std::string::npos);
+  _unshare(client);
+  connection.inflight.reset();
+  connection.outbound.clear();
+  connection.pending = 0;
+  connection.registered = false;
+  connection.receiving = false;
+  connection.detaching = false;
+  connection.generation++;
+  return unsent;
+}
+
+void UringLoop::send(int client, const Buffer &data)
+{
+  if (static_cast<size_t>(client) >= _connections.size() || !_connections[client].registered || data->empty())
+    return;
+
+  Connection &connection = _connections[client];
+  connection.outbound.push_back(data);
+  connection.pending += data->size();
+  if (connection.shared) {
+    if (!connection.dirty) {
+      connection.dirty = true;
+      _dirty.push_back(client);
+    }
+  } else if (!connection.inflight && !connection.detaching) {
+    _armSend(client);
+  }
+}
+
+void UringLoop::flush()
+{
+  // The sends are queued as they are made, and submitted by the next poll. The shared
+  // memory channels are written here, once per wakeup, the handler may queue more meanwhile
+  std::vector<int> dirty;
+
+  dirty.swap(_dirty);
+  for (int client : dirty) {
+    _connections[client].dirty = false;
+    if (_connections[client].registered && _connections[client].shared)
+      _writeShared(client);
+  }
+  dirty.clear();
+  if (_dirty.empty())
+    _dirty.swap(dirty);
+}
+
+void UringLoop::_readShared(int client)
+{
+  // The handler may remove the client, which releases its reference
+  std::shared_ptr<SharedChannel> channel = _connections[client].shared;
+
+  channel->clearSignal();
+  while (true) {
+    size_t result = channel->read(_sharedBuffer.data(), _sharedBuffer.size());
+
+    if (result > 0) {
+      if (!_handler.onData(client, _sharedBuffer.data(), result))
+        return;
+    } else if (channel->sleep()) {
+      return;
+    }
+  }
+}
+
+void UringLoop::_writeShared(int client)
+{
+  Connection &connection = _connections[client];
+  size_t pending = connection.pending;
+
+  while (!connection.outbound.empty()) {
+    const std::string &data = *connection.outbound.front();
+    size_t written = connection.shared->write(data.data() + connection.sent, data.size() - connection.sent);
+
+    connection.pending -= written;
+    connection.sent += written;
+    if (connection.sent < data.size())
+      break;
+    connection.outbound.pop_front();
+    connection.sent = 0;
+  }
+  if (connection.pending != pending)
+    connection.shared->notify();
+  _handler.onFlushed(client);
+}
+
+size_t UringLoop::pending(int client) const
+{
+  if (static_cast<size_t>(client) >= _connections.size())
+    return 0;
+  return _connections[client].pending;
+}
+
+void UringLoop::wake()
+{
+  uint64_t one = 1;
+
+  if (write(_wakeFd, &one, sizeof(one)) == -1)
+    Logging::LogError("Failed to wake the event loop: " + std::string(strerror(errno)));
+}
+
+void UringLoop::poll(int timeout)
+{
+  if (!_enter(1, timeout) && _deferred.empty())
+    return;
+  _reap();
+}
+
+void UringLoop::_reap()
+{
+  while (true) {
+    // Copy and release the entry first, handlers may queue new entries and wait again
+    struct io_uring_cqe cqe;
+    unsigned head = *_cqHead;
+    if (!_deferred.empty()) {
+      cqe = _deferred.front();
+      _deferred.pop_front();
+    } else if (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE)) {
+      cqe = _cqes[head & *_cqMask];
+      __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+    } else {
+      break;
+    }
+    _complete(cqe);
+  }
+}
+
+void UringLoop::_defer()
+{
+  unsigned head = *_cqHead;
+
+  while (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+    _deferred.push_back(_cqes[head++ & *_cqMask]);
+  __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+}
+
+void UringLoop::_complete(const struct io_uring_cqe &cqe)
+{
+  Operation operation = tagOperation(cqe.user_data);
+  int fd = tagFd(cqe.user_data);
+  bool more = cqe.flags & IORING_CQE_F_MORE;
+
+  if (operation == WAKE) {
+    _armWake();
+    _handler.onWake();
+    return;
+  }
+
+  if (operation == ACCEPT) {
+    if (!more)
+      _accepting--;
+    if (cqe.res >= 0)
+      _handler.onAccept(cqe.res);
+    else if (!_paused)
+      _handler.onAcceptError(-cqe.res);
+    if (!more && !_paused)
+      _armAccept(fd);
+    return;
+  }
+
+  bool current = static_cast<size_t>(fd) < _connections.size() && _connections[fd].registered
+    && (_connections[fd].generation & 0xFFFFFF) == tagGeneration(cqe.user_data);
+
+  if (operation == SIGNAL) {
+    // The client wrote to its ring, or made room in the ring of the server
+    if (!current || !_connections[fd].shared || cqe.res < 0)
+      return;
+    if (!_paused)
+      _readShared(fd);
+    if (static_cast<size_t>(fd) >= _connections.size() || !_connections[fd].registered || !_connections[fd].shared
+        || (_connections[fd].generation & 0xFFFFFF) != tagGeneration(cqe.user_data))
+      return;
+    _writeShared(fd);
+    if (!more)
+      _armSignal(fd);
+  } else if (operation == RECV) {
+    bool hasBuffer = cqe.flags & IORING_CQE_F_BUFFER;
+    uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (current && !more)
+      _connections[fd].receiving = false;
+    if (current && cqe.res > 0)
+      current = _handler.onData(fd, _buffers.data() + static_cast<size_t>(id) * URING_BUFFER_SIZE, cqe.res);
+    if (hasBuffer)
+      _recycle(id);
+    if (!current || (_paused && cqe.res == -ECANCELED))
+      return;
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS)) {
+      _handler.onClose(fd);
+      return;
+    }
+    // Out of buffers, or the kernel ended the multishot receive: start a new one
+    if (!more && !_paused)
+      _armRecv(fd);
+  } else if (operation == SEND) {
+    if (!current) {
+      _orphans.erase(cqe.user_data);
+      return;
+    }
+
+    Connection &connection = _connections[fd];
+    connection.sending = false;
+    if (cqe.res < 0) {
+      // A cancelled send wrote nothing, detach gives its bytes back
+      if (connection.detaching)
+        return;
+      connection.inflight.reset();
+      connection.outbound.clear();
+      connection.pending = 0;
+      return;
+    }
+
+    // Skip what was sent, a partial send is resumed where it stopped
+    Batch &batch = *connection.inflight;
+    size_t sent = cqe.res;
+    size_t done = 0;
+    connection.pending -= sent;
+    while (done < batch.iov.size() && sent >= batch.iov[done].iov_len)
+      sent -= batch.iov[done++].iov_len;
+    batch.iov.erase(batch.iov.begin(), batch.iov.begin() + done);
+    if (!batch.iov.empty()) {
+      batch.iov.front().iov_base = static_cast<char *>(batch.iov.front().iov_base) + sent;
+      batch.iov.front().iov_len -= sent;
+    } else {
+      connection.inflight.reset();
+    }
+    if ((connection.inflight || !connection.outbound.empty()) && !connection.detaching)
+      _armSend(fd);
+    _handler.onFlushed(fd);
+  }
+}
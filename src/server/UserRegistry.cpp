@@ -0,0 +1,379 @@
+#include "UserRegistry.hpp"
+#include "MessageLog.hpp"
+#include "Logging.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define USER_REGISTRY_MAGIC "CHATUSR1" // First bytes of the snapshot
+#define USER_REGISTRY_HEADER_SIZE 32 // Bytes of the header of the snapshot
+#define USER_REGISTRY_ENTRY_SIZE 32 // Bytes of an entry of the snapshot
+#define USER_JOURNAL_FIELDS_SIZE 32 // Bytes of a journal record before its name
+
+namespace {
+
+void putInteger(char *out, uint64_t value, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    out[i] = static_cast<char>((value >> (8 * (size - 1 - i))) & 0xFF);
+}
+
+void putInteger(std::string &out, uint64_t value, size_t size)
+{
+  char bytes[8];
+
+  putInteger(bytes, value, size);
+  out.append(bytes, size);
+}
+
+uint64_t getInteger(const char *data, size_t size)
+{
+  uint64_t value = 0;
+
+  for (size_t i = 0; i < size; i++)
+    value = (value << 8) | static_cast<uint8_t>(data[i]);
+  return value;
+}
+
+// The checksum of a journal record skips its last login, written in place
+uint32_t recordChecksum(const char *record, size_t length)
+{
+  return MessageLog::checksum(record + 16, length - 8);
+}
+
+// Time of a line "<label> <%Y-%m-%d %H:%M:%S>" of a legacy info.txt, 0 if there is none
+uint64_t legacyTime(const std::string &info, const std::string &label)
+{
+  size_t start = info.find(label);
+  struct tm fields = {};
+
+  if (start == std::string::npos || strptime(info.c_str() + start + label.size(), "%Y-%m-%d %H:%M:%S", &fields) == nullptr)
+    return 0;
+  fields.tm_isdst = -1;
+  time_t seconds = mktime(&fields);
+  return (seconds == -1) ? 0 : static_cast<uint64_t>(seconds) * 1000;
+}
+
+std::string errorText(const std::string &path)
+{
+  return USER_REGISTRY_FAILED + std::string(": ") + path + ": " + strerror(errno);
+}
+
+}
+
+UserRegistry::UserRegistry(const std::string &directory)
+  : _directory(directory), _snapshot(nullptr), _snapshotSize(0), _count(0), _nextId(1), _journal(-1), _journalSize(0)
+{
+  if (!_directory.empty() && _directory.back() != '/')
+    _directory += '/';
+}
+
+UserRegistry::~UserRegistry()
+{
+  _unmapSnapshot();
+  if (_journal != -1)
+    close(_journal);
+}
+
+void UserRegistry::open()
+{
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  std::string journal = _directory + USER_JOURNAL_FILE;
+  bool fresh = !std::filesystem::exists(_directory + USER_REGISTRY_FILE) && !std::filesystem::exists(journal);
+
+  if (!_mapSnapshot())
+    _count = 0;
+  _journal = ::open(journal.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (_journal == -1)
+    throw UserRegistryException(errorText(journal));
+  if (fresh)
+    _import();
+  else
+    _readJournal();
+
+  // The journal is merged while it stays small next to the snapshot, so it is read fast
+  if (_added.size() > std::max<uint64_t>(USER_REGISTRY_COMPACT_MIN, _count / 16) || (fresh && !_added.empty()))
+    _compact();
+  Logging::Log("User registry: " + std::to_string(_count + _added.size()) + " accounts");
+}
+
+bool UserRegistry::_mapSnapshot()
+{
+  std::string path = _directory + USER_REGISTRY_FILE;
+  int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+  struct stat status;
+
+  if (fd == -1 && errno == ENOENT)
+    return false;
+  if (fd == -1 || fstat(fd, &status) == -1) {
+    std::string error = errorText(path);
+    if (fd != -1)
+      close(fd);
+    throw UserRegistryException(error);
+  }
+  size_t size = status.st_size;
+  void *data = (size > 0) ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED)
+    throw UserRegistryException(USER_REGISTRY_FAILED + std::string(": ") + path + ": cannot be mapped");
+
+  _snapshot = static_cast<char *>(data);
+  _snapshotSize = size;
+  uint64_t count = (size >= USER_REGISTRY_HEADER_SIZE) ? getInteger(_snapshot + 8, 8) : 0;
+  bool valid = size >= USER_REGISTRY_HEADER_SIZE && std::memcmp(_snapshot, USER_REGISTRY_MAGIC, 8) == 0
+    && count <= (size - USER_REGISTRY_HEADER_SIZE) / USER_REGISTRY_ENTRY_SIZE;
+  // Every name must lie in the file, the search reads them in place
+  uint64_t pool = USER_REGISTRY_HEADER_SIZE + count * USER_REGISTRY_ENTRY_SIZE;
+  for (uint64_t i = 0; valid && i < count; i++) {
+    const char *entry = _snapshot + USER_REGISTRY_HEADER_SIZE + i * USER_REGISTRY_ENTRY_SIZE;
+    valid = pool + getInteger(entry + 24, 4) + getInteger(entry + 28, 4) <= size;
+  }
+  if (!valid) {
+    _unmapSnapshot();
+    throw UserRegistryException(USER_REGISTRY_FAILED + std::string(": ") + path + " is corrupted");
+  }
+  _count = count;
+  _nextId = std::max<uint64_t>(1, getInteger(_snapshot + 16, 8));
+  return true;
+}
+
+void UserRegistry::_unmapSnapshot()
+{
+  if (_snapshot != nullptr)
+    munmap(_snapshot, _snapshotSize);
+  _snapshot = nullptr;
+  _snapshotSize = 0;
+  _count = 0;
+}
+
+void UserRegistry::_readJournal()
+{
+  std::string path = _directory + USER_JOURNAL_FILE;
+  struct stat status;
+
+  if (fstat(_journal, &status) == -1)
+    throw UserRegistryException(errorText(path));
+  std::string data(status.st_size, '\0');
+  if (!data.empty() && pread(_journal, &data[0], data.size(), 0) != static_cast<ssize_t>(data.size()))
+    throw UserRegistryException(errorText(path));
+
+  size_t offset = 0;
+  while (data.size() - offset >= 8 + USER_JOURNAL_FIELDS_SIZE - 8) {
+    const char *record = data.data() + offset;
+    size_t length = getInteger(record, 4);
+    if (length < USER_JOURNAL_FIELDS_SIZE - 8 || length > data.size() - offset - 8 || recordChecksum(record, length) != getInteger(record + 4, 4))
+      break;
+    std::string name(record + USER_JOURNAL_FIELDS_SIZE, length + 8 - USER_JOURNAL_FIELDS_SIZE);
+    Added added{User{getInteger(record + 16, 8), getInteger(record + 24, 8), getInteger(record + 8, 8)}, offset};
+    // Left by a merge interrupted before the journal was emptied
+    if (_search(name) == _count)
+      _added[name] = added;
+    _nextId = std::max(_nextId, added.user.id + 1);
+    offset += 8 + length;
+  }
+  if (offset != data.size()) {
+    Logging::LogWarning("User registry: truncating " + path + " from " + std::to_string(data.size()) + " to " + std::to_string(offset) + " bytes");
+    if (ftruncate(_journal, offset) == -1)
+      throw UserRegistryException(errorText(path));
+  }
+  _journalSize = offset;
+}
+
+void UserRegistry::_import()
+{
+  std::error_code error;
+  std::error_code ignored;
+  size_t imported = 0;
+
+  // One folder per client, with its times in info.txt
+  for (const auto &entry : std::filesystem::directory_iterator(_directory, error)) {
+    std::string name = entry.path().filename().string();
+    if (!entry.is_directory(ignored) || !std::filesystem::exists(entry.path() / "info.txt", ignored) || _added.count(name) > 0)
+      continue;
+    std::ifstream file(entry.path() / "info.txt");
+    std::string info((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    uint64_t created = legacyTime(info, "Account created on ");
+    uint64_t lastLogin = legacyTime(info, "Last login on ");
+    if (created == 0) {
+      auto modified = std::filesystem::last_write_time(entry.path(), ignored);
+      created = ignored ? 0 : std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::file_clock::to_sys(modified).time_since_epoch()).count();
+    }
+    _added[name] = Added{User{_nextId++, created, std::max(created, lastLogin)}, 0};
+    imported++;
+  }
+  if (error)
+    throw UserRegistryException(USER_REGISTRY_FAILED + std::string(": ") + error.message());
+  if (imported > 0)
+    Logging::Log("User registry: imported " + std::to_string(imported) + " accounts from the legacy folders");
+}
+
+void UserRegistry::_compact()
+{
+  std::string path = _directory + USER_REGISTRY_FILE;
+  std::string temporary = path + ".tmp";
+  std::vector<std::pair<std::string_view, User>> users;
+
+  users.reserve(_count + _added.size());
+  for (uint64_t i = 0; i < _count; i++) {
+    const char *entry = _snapshot + USER_REGISTRY_HEADER_SIZE + i * USER_REGISTRY_ENTRY_SIZE;
+    const char *pool = _snapshot + USER_REGISTRY_HEADER_SIZE + _count * USER_REGISTRY_ENTRY_SIZE;
+    users.emplace_back(std::string_view(pool + getInteger(entry + 24, 4), getInteger(entry + 28, 4)),
+                       User{getInteger(entry, 8), getInteger(entry + 8, 8), getInteger(entry + 16, 8)});
+  }
+  size_t merged = users.size();
+  for (const auto &added : _added)
+    users.emplace_back(added.first, added.second.user);
+  std::sort(users.begin() + merged, users.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+  std::inplace_merge(users.begin(), users.begin() + merged, users.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  std::string data(USER_REGISTRY_MAGIC);
+  std::string names;
+  putInteger(data, users.size(), 8);
+  putInteger(data, _nextId, 8);
+  putInteger(data, 0, 8);
+  for (const auto &user : users) {
+    putInteger(data, user.second.id, 8);
+    putInteger(data, user.second.created, 8);
+    putInteger(data, user.second.lastLogin, 8);
+    putInteger(data, names.size(), 4);
+    putInteger(data, user.first.size(), 4);
+    names += user.first;
+  }
+  data += names;
+
+  // Written aside then renamed, a crash leaves the old snapshot or the new one
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    throw UserRegistryException(errorText(temporary));
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t result = write(fd, data.data() + written, data.size() - written);
+    if (result == -1 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      std::string error = errorText(temporary);
+      close(fd);
+      throw UserRegistryException(error);
+    }
+    written += result;
+  }
+  if (fsync(fd) == -1 || close(fd) == -1 || rename(temporary.c_str(), path.c_str()) == -1)
+    throw UserRegistryException(errorText(path));
+  int directory = ::open(_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (directory != -1) {
+    fsync(directory);
+    close(directory);
+  }
+
+  // The journal is only emptied once the snapshot holds its accounts
+  users.clear();
+  _unmapSnapshot();
+  _added.clear();
+  if (ftruncate(_journal, 0) == -1)
+    throw UserRegistryException(errorText(_directory + USER_JOURNAL_FILE));
+  _journalSize = 0;
+  _mapSnapshot();
+  Logging::Log("User registry: wrote a snapshot of " + std::to_string(_count) + " accounts");
+}
+
+size_t UserRegistry::_search(std::string_view name) const
+{
+  const char *pool = _snapshot + USER_REGISTRY_HEADER_SIZE + _count * USER_REGISTRY_ENTRY_SIZE;
+  size_t low = 0;
+  size_t high = _count;
+
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    const char *entry = _snapshot + USER_REGISTRY_HEADER_SIZE + middle * USER_REGISTRY_ENTRY_SIZE;
+    std::string_view candidate(pool + getInteger(entry + 24, 4), getInteger(entry + 28, 4));
+    int order = candidate.compare(name);
+    if (order == 0)
+      return middle;
+    if (order < 0)
+      low = middle + 1;
+    else
+      high = middle;
+  }
+  return _count;
+}
+
+bool UserRegistry::find(std::string_view name, User &user)
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+  size_t index = _search(name);
+
+  if (index < _count) {
+    const char *entry = _snapshot + USER_REGISTRY_HEADER_SIZE + index * USER_REGISTRY_ENTRY_SIZE;
+    user = User{getInteger(entry, 8), getInteger(entry + 8, 8), getInteger(entry + 16, 8)};
+    return true;
+  }
+  auto added = _added.find(std::string(name));
+  if (added == _added.end())
+    return false;
+  user = added->second.user;
+  return true;
+}
+
+bool UserRegistry::contains(std::string_view name)
+{
+  User user;
+
+  return find(name, user);
+}
+
+UserRegistry::User UserRegistry::login(const std::string &name, uint64_t time)
+{
+  std::unique_lock<std::shared_mutex> lock(_mutex);
+  size_t index = _search(name);
+  char bytes[8];
+
+  putInteger(bytes, time, 8);
+  if (index < _count) {
+    char *entry = _snapshot + USER_REGISTRY_HEADER_SIZE + index * USER_REGISTRY_ENTRY_SIZE;
+    std::memcpy(entry + 16, bytes, 8);
+    return User{getInteger(entry, 8), getInteger(entry + 8, 8), time};
+  }
+
+  auto added = _added.find(name);
+  if (added != _added.end()) {
+    added->second.user.lastLogin = time;
+    if (pwrite(_journal, bytes, 8, added->second.offset + 8) != 8)
+      Logging::LogError("User registry: failed to update " + name + ": " + strerror(errno));
+    return added->second.user;
+  }
+
+  Added created{User{_nextId++, time, time}, _journalSize};
+  std::string record(8, '\0');
+  putInteger(record, created.user.lastLogin, 8);
+  putInteger(record, created.user.id, 8);
+  putInteger(record, created.user.created, 8);
+  record += name;
+  putInteger(&record[0], record.size() - 8, 4);
+  putInteger(&record[4], recordChecksum(record.data(), record.size() - 8), 4);
+  if (pwrite(_journal, record.data(), record.size(), _journalSize) != static_cast<ssize_t>(record.size())) {
+    Logging::LogError("User registry: failed to add " + name + ": " + strerror(errno));
+    return created.user;
+  }
+  _journalSize += record.size();
+  _added[name] = created;
+  return created.user;
+}
+
+size_t UserRegistry::size()
+{
+  std::shared_lock<std::shared_mutex> lock(_mutex);
+
+  return _count + _added.size();
+}
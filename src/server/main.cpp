@@ -1,17 +1,71 @@
 #include "Server.hpp"
+#include "Handoff.hpp"
+#include "Logging.hpp"
 
 int main(int ac, char **av)
 {
   unsigned short port = (ac == 2) ? std::atoi(av[1]) : 4242;
-  Server server(port);
+  ServerConfig config = ServerConfig::fromEnvironment();
+  std::shared_ptr<ShardGroup> group = std::make_shared<ShardGroup>(config.threads, config.diskThreads, config.diskQueue);
+  std::vector<std::unique_ptr<Server>> shards;
+  std::vector<std::thread> threads;
+  std::thread handoff;
+  Handoff::State inherited;
+
+  // A process already serving the handoff socket hands its sockets and sessions over
+  int predecessor = config.handoffSocket.empty() ? -1 : Handoff::connect(config.handoffSocket);
+  if (predecessor != -1) {
+    try {
+      inherited = Handoff::receive(predecessor);
+      group->setPresenceVersion(inherited.presenceVersion);
+      Logging::Log("Took over " + std::to_string(inherited.sessions.size()) + " sessions");
+    } catch (Handoff::HandoffException &e) {
+      Logging::LogError(e.what());
+      inherited = Handoff::State();
+    }
+    close(predecessor);
+  }
 
   try {
-    server.init();
-    server.run();
-    server.stop();
+    for (size_t shard = 0; shard < config.threads; shard++)
+      shards.push_back(std::make_unique<Server>(port, config, group, shard));
+    // Every shard listens before any of them runs, so no task is posted to a shard without a loop
+    for (size_t shard = 0; shard < shards.size(); shard++)
+      shards[shard]->init(shard < inherited.listeners.size() ? inherited.listeners[shard] : -1, (shard == 0) ? inherited.localListener : -1);
+    // The previous process had more shards: the connections waiting on its extra sockets go to the first shard
+    for (size_t extra = shards.size(); extra < inherited.listeners.size(); extra++) {
+      int client;
+      while ((client = accept4(inherited.listeners[extra], nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        shards[0]->onAccept(client);
+      close(inherited.listeners[extra]);
+    }
+    for (size_t session = 0; session < inherited.sessions.size(); session++)
+      shards[session % shards.size()]->adopt(inherited.sessions[session]);
+    inherited = Handoff::State();
+
+    if (!config.handoffSocket.empty())
+      handoff = std::thread(Handoff::serve, config.handoffSocket, std::ref(*group));
+    for (size_t shard = 1; shard < shards.size(); shard++) {
+      threads.emplace_back([&shards, shard]() {
+        try {
+          shards[shard]->run();
+        } catch (std::exception &e) {
+          std::cerr << e.what() << std::endl;
+        }
+      });
+    }
+    shards[0]->run();
+    // The shards only return once handed off, the process ends when everything is sent
+    for (auto &thread : threads)
+      thread.join();
+    if (handoff.joinable())
+      handoff.join();
+    return 0;
   } catch (std::exception &e) {
     std::cerr << e.what() << std::endl;
   }
+  // The other shards never return, the process ends with the first one
+  if (!threads.empty() || handoff.joinable())
+    std::exit(0);
   return 0;
-
 }